@@ -16,269 +16,2036 @@
  *  the tail of the list. When there is a cache hit, we also 
  *  move this cache block to the head of the list. For thread-safe, 
  *  we lock the cache list each time we manipulate the cache block.
+ *
+ *  Moving a block on every hit made each hit a writer of the list.
+ *  Now a hit only sets the referenced bit of the block, so hits 
+ *  take the lock of the list as readers and run side by side. The
+ *  order is kept approximately with CLOCK: to make room the hand 
+ *  looks at the block at the tail, a referenced one loses its bit 
+ *  and goes back to the head, the first one not referenced since 
+ *  the last pass is evicted. Inserts and evictions are writers.
+ *
+ *  CLOCK is the default of several eviction policies, picked at 
+ *  startup. A policy is told about inserts and hits and picks the
+ *  block to evict, see the policy table below. Only strict LRU 
+ *  changes the list on a hit, its hits lock the list as writers.
+ *
+ *  With one lock, every hit and every insert of every thread went
+ *  through the same semaphore. So the cache is split into shards, 
+ *  each one is such a locked LRU list with its own share of the
+ *  cache size, and an id always goes to the shard picked by its
+ *  hash. Threads working on different shards do not wait for each 
+ *  other. There are as many shards as the cache size allows with 
+ *  room for a max size object in each, up to MAX_CACHE_SHARDS, so
+ *  the shares add up to at most the cache size.
+ *
+ *  The id is the whole request, so walking the list with strcmp
+ *  cost a compare of hundreds of bytes per cached object. Each 
+ *  shard also keeps a hash table of its blocks, the 64-bit hash 
+ *  and length of the id are compared before the id itself. The
+ *  table doubles when it has more blocks than buckets.
+ *
+ *  A cached object is never changed, so a hit does not copy it:
+ *  read_cache takes a reference on the block, the caller writes 
+ *  the content straight from the cache and calls cache_release.
+ *  The list holds a reference too, a block that is evicted while
+ *  it is being sent is freed by the release of its last reader.
+ *
+ *  Most objects are asked for once and never again, caching them
+ *  only pushes out objects that would be hit. With admission on, 
+ *  a doorkeeper remembers the ids that missed in a counting Bloom
+ *  filter per shard, and an object is only cached on a miss of an
+ *  id seen before. The counters are halved every window misses of
+ *  the shard, so "before" means roughly the last window misses.
+ *  The fetcher asks cache_admit before the response comes, so a 
+ *  response that will not be cached is not copied at all.
+ *
+ *  A block is one allocation: the header, then the id, then the
+ *  content. It is made before the lock is taken, and blocks that 
+ *  are deleted under the lock are only freed after it is dropped.
+ *  The size of a shard counts what the blocks really take, header
+ *  and malloc overhead included, not only the objects.
+ *
+ *  Concurrent misses on the same id are collapsed: the first one
+ *  registers a cache fill and fetches the object, the later ones
+ *  add themselves to the waiters of that fill. When the fetch is 
+ *  done the fetcher ends the fill, which wakes the waiters, and 
+ *  they read the object from the cache instead of asking the 
+ *  server again. A waiter that still misses, because the response
+ *  could not be cached, goes to the server on its own.
+ *
+ *  With a disk tier, see disk.c, evicted blocks are written to it
+ *  once the lock is dropped, and a miss in memory looks there 
+ *  before it is a miss. What the disk has is copied into a new
+ *  block of the shard, which is then a hit like any other.
+ *
+ *  The cache can be saved to a snapshot file and loaded from it,
+ *  so a restarted proxy does not send every first request to the
+ *  servers. A snapshot lists the blocks of each shard coldest 
+ *  first with their hit counts, loading adds them in that order.
+ *
+ *  Servers often send the same bytes under many ids, a url with a
+ *  query string to get around caches or the same file at several
+ *  paths. So a body of BODY_MIN bytes or more is not kept in its
+ *  block but in a table of bodies shared by all the shards, by the
+ *  128-bit hash of its bytes. A block gets the headers of its own 
+ *  object and a reference on the body, an object that has a body
+ *  stored already only adds its headers. A shard counts each body
+ *  once in its size however many of its blocks have it, so equal
+ *  bodies in one shard take its room once and a body is never 
+ *  counted in fewer shards than it is in. The disk tier and the
+ *  snapshot still get whole objects.
+ *
+ *  With compression on, a new body of a text object is stored gzip
+ *  if that saves an eighth of it at least, see zip.c. A client that
+ *  accepts gzip is sent the stored bytes with headers saying so,
+ *  the others get the body decompressed into a buffer of their own.
+ *  gzip bodies are shared like the others: equal bodies compress to
+ *  equal bytes, so a new body is compressed before it is compared
+ *  to a stored gzip one.
+ *
+ *  With worker processes, see proxy.c, everything of the cache is
+ *  allocated in the shared arena of shm.c and the locks are shared
+ *  between the processes, so the workers have one cache. A fill is
+ *  only joined by requests of the process that fetches, its end
+ *  wakes the waiters with calls in that process.
+ *
+ *  A worker may be killed in the middle of a change of the cache, 
+ *  holding a lock, so every lock of the cache is taken between 
+ *  shm_enter and shm_leave: the master then knows if the cache is 
+ *  still whole. The references a worker holds on blocks count the
+ *  same, a killed worker would never drop them and the blocks would
+ *  never be freed. The fills of a worker killed holding nothing are
+ *  dropped by the one forked in its place.
+ */
+
+#define _GNU_SOURCE
+#include "csapp.h"
+#include "cache.h"
+#include "disk.h"
+#include "http.h"
+#include "shm.h"
+#include "zip.h"
+
+#define CACHE_BUCKETS 64	/* initial hash buckets of a shard */
+#define CACHE_GHOST 1024	/* S3-FIFO: evicted ids remembered per shard */
+#define S3FIFO_MAX_FREQ 3	/* S3-FIFO: hits counted per block */
+#define GDSF_SCALE (1 << 20)	/* GDSF: priority of one hit on one byte */
+#define DOOR_HASHES 4		/* counters of the doorkeeper set per id */
+#define DOOR_MAX 15			/* a counter saturates there */
+#define DOOR_LOAD 8			/* counters per id of a window */
+#define BODY_MIN 1024		/* smaller bodies stay in their block */
+#define BODY_BUCKET_BYTES 4096	/* one body bucket per this many bytes */
+#define SNAPSHOT_MAGIC "213CACHE"
+#define SNAPSHOT_VERSION 2
+
+/* Header of a snapshot file, the blocks follow it */
+typedef struct
+{
+	char magic[8];
+	unsigned int version;
+	unsigned int nblocks;
+	long long saved;			/* time(), when it was written */
+}snapshot_header;
+
+/* 
+ * Header of a block in a snapshot, the id, its '\0' and the 
+ * content follow, then padding up to a multiple of 8 bytes
+ */
+typedef struct
+{
+	unsigned int id_len;
+	unsigned int block_size;
+	unsigned int freq;
+	unsigned int pad;
+	long long expires;
+}snapshot_block;
+
+/* Definition of a thread loading some shards from a snapshot */
+typedef struct
+{
+	cache_list *cl;
+	char *map;					/* the snapshot file */
+	size_t size;
+	unsigned int nblocks;		/* as the header says */
+	int nthreads;
+	int id;						/* loads the shards with index % nthreads */
+	unsigned int n;				/* blocks found in the file */
+	int loaded;					/* of them added to the cache */
+}snapshot_loader;
+
+/* Definition of an eviction policy */
+struct cache_policy
+{
+	char *name;
+	int hit_writes;				/* hit changes the list, lock as writer */
+	void (*insert)(cache_shard *cs, cache_block *cb);
+	void (*hit)(cache_shard *cs, cache_block *cb);
+	cache_block *(*victim)(cache_shard *cs);
+};
+
+/*
+ * Declaration of the methods and variables that only used
+ * in cache.c
+ */
+static cache_block *new_cache(char *id, size_t id_len, 
+				unsigned long long hash, char *content, 
+				unsigned int head_size, cache_body *body);
+static cache_block *make_block(cache_shard *cs, char *id, size_t id_len,
+				unsigned long long hash, char *content, 
+				unsigned int block_size);
+static size_t block_cost(cache_shard *cs, cache_block *cb);
+static cache_body *get_body(cache_bodies *cbs, char *data, 
+				unsigned int size, int zip);
+static cache_body *copy_body(cache_bodies *cbs, char *data, 
+				unsigned int size, unsigned long long *hash, int zip);
+static char *plain_body(cache_block *cb, char **buf);
+static unsigned long long cpu_ns(void);
+static void release_body(cache_body *body);
+static void hash_body(const char *data, size_t len, 
+				unsigned long long *out);
+static void insert_cache(cache_shard *cs, cache_block *cb);
+static void replace_cache(cache_shard *cs, cache_block *new_cb);
+static cache_block *delete_cache(cache_shard *cs, cache_block *cb);
+static cache_block *take_dead(cache_shard *cs);
+static void release_dead(cache_block *dead);
+static void hold_block(cache_block *cb);
+static void drop_block(cache_block *cb);
+static cache_block *promote_cache(cache_shard *cs, char *id, 
+				size_t id_len, unsigned long long hash);
+static void count_lookup(cache_shard *cs, cache_block *cb);
+static int add_cache(cache_list *cl, char *id, char *content, 
+				unsigned int block_size, time_t expires, unsigned int freq,
+				int fill);
+static int save_shard(FILE *fp, cache_shard *cs);
+static void *load_blocks(void *vargp);
+static void update_cache(cache_shard *cs, cache_block *cb);
+static int evict_cache(cache_shard *cs);
+static cache_block *find_cache(cache_shard *cs, char *id, 
+				size_t id_len, unsigned long long hash);
+static unsigned long long hash_id(char *id, size_t *id_len);
+static cache_shard *get_shard(cache_list *cl, unsigned long long hash);
+static void grow_index(cache_shard *cs);
+static void shard_rdlock(cache_shard *cs);
+static void shard_wrlock(cache_shard *cs);
+static void shard_unlock(cache_shard *cs);
+static void body_lock(sem_t *lock);
+static void body_unlock(sem_t *lock);
+
+static void lru_hit(cache_shard *cs, cache_block *cb);
+static cache_block *lru_victim(cache_shard *cs);
+static void clock_hit(cache_shard *cs, cache_block *cb);
+static cache_block *clock_victim(cache_shard *cs);
+static void lfu_hit(cache_shard *cs, cache_block *cb);
+static cache_block *lfu_victim(cache_shard *cs);
+static void gdsf_insert(cache_shard *cs, cache_block *cb);
+static void gdsf_hit(cache_shard *cs, cache_block *cb);
+static cache_block *gdsf_victim(cache_shard *cs);
+static void s3fifo_insert(cache_shard *cs, cache_block *cb);
+static void s3fifo_hit(cache_shard *cs, cache_block *cb);
+static cache_block *s3fifo_victim(cache_shard *cs);
+
+/*
+ * The eviction policies:
+ *	lru		strict LRU, a hit moves the block to the head
+ *	clock	approximate LRU, a hit sets a bit, see above
+ *	lfu		evict the block with the fewest hits, the oldest of them
+ *	gdsf	GreedyDual-Size-Frequency, evict the lowest hits per byte,
+ *			aged by the priority of the last evicted block so that
+ *			blocks that were hot once do not stay forever
+ *	s3fifo	new blocks go to a small FIFO queue of a tenth of the
+ *			shard, those hit there move on to the main queue, the
+ *			others are evicted and remembered in a ghost table, a
+ *			block that comes back while remembered goes to main
+ * lfu and gdsf scan the shard to evict, which happens on a miss only.
+ */
+static const struct cache_policy policies[] =
+{
+	{"clock", 0, NULL, clock_hit, clock_victim},
+	{"lru", 1, NULL, lru_hit, lru_victim},
+	{"lfu", 0, NULL, lfu_hit, lfu_victim},
+	{"gdsf", 0, gdsf_insert, gdsf_hit, gdsf_victim},
+	{"s3fifo", 0, s3fifo_insert, s3fifo_hit, s3fifo_victim},
+};
+
+
+/*
+ * Initialize caceh list of cache_size bytes for objects smaller
+ * than object_size with the named eviction policy, return -1 if
+ * there is no such policy or the sizes do not make sense
+ */
+int init_cache_list(cache_list *cl, char *policy, size_t cache_size,
+					size_t object_size)
+{
+	const struct cache_policy *cp = NULL;
+	pthread_rwlockattr_t attr;
+	int pshared = shm_enabled();
+	cache_shard *cs;
+	int i;
+
+	for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++)
+	{
+		if (!strcmp(policies[i].name, policy))
+			cp = &policies[i];
+	}
+	if (cp == NULL || object_size == 0 || cache_size < object_size)
+		return -1;
+	cl->max_size = cache_size;
+	cl->max_object = object_size;
+
+	/* as many shards as still hold a max size object each */
+	cl->nshards = 1;
+	while (cl->nshards < MAX_CACHE_SHARDS &&
+		   cache_size / (cl->nshards * 2) >= object_size)
+		cl->nshards *= 2;
+	cl->shards = (cache_shard *)Shm_calloc(cl->nshards, sizeof(cache_shard));
+
+	/* bodies are at least BODY_MIN bytes, a few of them per bucket */
+	memset(&cl->bodies, 0, sizeof(cl->bodies));
+	cl->bodies.nbuckets = 64;
+	while (cl->bodies.nbuckets < cache_size / BODY_BUCKET_BYTES)
+		cl->bodies.nbuckets *= 2;
+	cl->bodies.buckets = (cache_body **)Shm_calloc(cl->bodies.nbuckets, 
+												   sizeof(cache_body *));
+	cl->bodies.nshards = cl->nshards;
+	for (i = 0; i < BODY_LOCKS; i++)
+		Sem_init(&cl->bodies.locks[i], pshared, 1);
+
+	/* in shared memory, worker processes take the locks too */
+	pthread_rwlockattr_init(&attr);
+	if (pshared)
+		pthread_rwlockattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+
+	for (i = 0; i < cl->nshards; i++)
+	{
+		cs = &cl->shards[i];
+		cs->index = i;
+		cs->bodies = &cl->bodies;
+		cs->total_size = 0;
+		cs->max_size = cache_size / cl->nshards;
+
+		/* initialize the two cache block as head and tail */
+		cs->head = new_cache(NULL, 0, 0, NULL, 0, NULL);
+		cs->tail = new_cache(NULL, 0, 0, NULL, 0, NULL);
+
+		cs->head->next = cs->tail;
+		cs->tail->prev = cs->head;
+		cs->fills = NULL;
+		cs->policy = cp;
+
+		cs->small_head = new_cache(NULL, 0, 0, NULL, 0, NULL);
+		cs->small_tail = new_cache(NULL, 0, 0, NULL, 0, NULL);
+		cs->small_head->next = cs->small_tail;
+		cs->small_tail->prev = cs->small_head;
+		if (cp->insert == s3fifo_insert)
+			cs->ghost = (unsigned long long *)Shm_calloc(CACHE_GHOST, 
+											sizeof(unsigned long long));
+
+		cs->nbuckets = CACHE_BUCKETS;
+		cs->nblocks = 0;
+		cs->buckets = (cache_block **)Shm_calloc(cs->nbuckets, 
+												 sizeof(cache_block *));
+
+		/* initialize lock */
+		pthread_rwlock_init(&cs->lock, &attr); 
+	}
+	pthread_rwlockattr_destroy(&attr);
+
+	return 0;
+}
+
+/*
+ * Free cache list
+ */
+void free_cache_list(cache_list *cl)
+{
+	cache_shard *cs;
+	cache_block *cb;
+	int i;
+
+	for (i = 0; i < cl->nshards; i++)
+	{
+		/* delete all cache block */
+		cs = &cl->shards[i];
+		for(cb = cs->tail->prev; cb != cs->head;)
+		{
+			cb = delete_cache(cs, cb);
+		}
+		for(cb = cs->small_tail->prev; cb != cs->small_head;)
+		{
+			cb = delete_cache(cs, cb);
+		}
+		release_dead(take_dead(cs));
+
+		/* free heap */
+		shm_free(cs->head);
+		shm_free(cs->tail);
+		shm_free(cs->small_head);
+		shm_free(cs->small_tail);
+		shm_free(cs->buckets);
+		shm_free(cs->ghost);
+		shm_free(cs->door);
+		pthread_rwlock_destroy(&cs->lock);
+	}
+
+	/* the last block of each body freed it */
+	for (i = 0; i < BODY_LOCKS; i++)
+		sem_destroy(&cl->bodies.locks[i]);
+	shm_free(cl->bodies.buckets);
+	shm_free(cl->shards);
+	shm_free(cl);
+	return;
+}
+
+/*
+ * Turn on the doorkeeper: an object is cached only if its id 
+ * missed before within about the last window misses
+ */
+void cache_admission(cache_list *cl, int window)
+{
+	cache_shard *cs;
+	int i;
+
+	if (window <= 0)
+		return;
+
+	for (i = 0; i < cl->nshards; i++)
+	{
+		cs = &cl->shards[i];
+		cs->door_window = window / cl->nshards > 0 ? 
+						  window / cl->nshards : 1;
+
+		/* a few counters per id keeps false positives rare */
+		cs->door_size = 64;
+		while (cs->door_size < cs->door_window * DOOR_LOAD)
+			cs->door_size *= 2;
+		cs->door = (unsigned char *)Shm_calloc(cs->door_size, 1);
+	}
+	return;
+}
+
+/*
+ * Store the bodies of text objects gzip from now on, those cached
+ * already stay as they are
+ */
+void cache_compress(cache_list *cl, int on)
+{
+	cl->bodies.compress = on;
+	return;
+}
+
+/*
+ * Called once per miss by the request that fetches the object,
+ * return 1 if the object should be cached. Without admission 
+ * every object is.
+ */
+int cache_admit(cache_list *cl, char *id)
+{
+	size_t id_len;
+	unsigned long long hash = hash_id(id, &id_len);
+	cache_shard *cs = get_shard(cl, hash);
+	unsigned long long step = (hash >> 17) | 1;
+	unsigned char *ctr;
+	unsigned int i, seen = DOOR_MAX;
+
+	if (cs->door == NULL)
+		return 1;
+
+	shard_wrlock(cs);
+	cs->n_checks++;
+
+	/* the smallest counter of the id tells whether it was seen */
+	for (i = 0; i < DOOR_HASHES; i++)
+	{
+		ctr = &cs->door[(hash + i * step) & (cs->door_size - 1)];
+		if (*ctr < seen)
+			seen = *ctr;
+		if (*ctr < DOOR_MAX)
+			(*ctr)++;
+	}
+	if (!seen)
+		cs->n_rejects++;
+
+	/* age the filter, ids of the last window stay seen */
+	if (++cs->door_adds >= cs->door_window)
+	{
+		for (i = 0; i < cs->door_size; i++)
+			cs->door[i] >>= 1;
+		cs->door_adds = 0;
+	}
+	shard_unlock(cs);
+	return seen > 0;
+}
+
+/*
+ * Return which of n caches id goes to, when each event loop has a
+ * cache of its own. Bits of the hash above those of the shards pick
+ * it, so every shard of every cache still gets its share of ids.
+ */
+int cache_partition(char *id, int n)
+{
+	size_t id_len;
+
+	return (int)((hash_id(id, &id_len) >> 40) % n);
+}
+
+/*
+ * The 64-bit FNV-1a hash of an id, its length goes to id_len.
+ * The last bytes of FNV-1a barely reach its high bits, which pick
+ * the shard, and urls that only differ at the end would all go to
+ * one shard. So the hash is mixed once more, as MurmurHash3 ends.
+ */
+static unsigned long long hash_id(char *id, size_t *id_len)
+{
+	unsigned long long h = 14695981039346656037ULL;
+	unsigned char *p;
+
+	for (p = (unsigned char *)id; *p; p++)
+		h = (h ^ *p) * 1099511628211ULL;
+	*id_len = (char *)p - id;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/*
+ * Pick the shard of an id by its hash
+ */
+static cache_shard *get_shard(cache_list *cl, unsigned long long hash)
+{
+	/* the high bits, the low ones pick the bucket in the shard */
+	return &cl->shards[(hash >> 32) & (cl->nshards - 1)];
+}
+
+/*
+ * Take the lock of a shard as a reader or a writer, and release it.
+ * A worker in there counts as busy, see shm.c.
+ */
+static void shard_rdlock(cache_shard *cs)
+{
+	shm_enter();
+	pthread_rwlock_rdlock(&cs->lock);
+	return;
+}
+
+static void shard_wrlock(cache_shard *cs)
+{
+	shm_enter();
+	pthread_rwlock_wrlock(&cs->lock);
+	return;
+}
+
+static void shard_unlock(cache_shard *cs)
+{
+	pthread_rwlock_unlock(&cs->lock);
+	shm_leave();
+	return;
+}
+
+/*
+ * Take and release a lock of the table of bodies
+ */
+static void body_lock(sem_t *lock)
+{
+	shm_enter();
+	P(lock);
+	return;
+}
+
+static void body_unlock(sem_t *lock)
+{
+	V(lock);
+	shm_leave();
+	return;
+}
+
+/*
+ * Double the hash buckets of a shard. Must hold the lock
+ * of the shard. Without memory the chains just get longer.
+ */
+static void grow_index(cache_shard *cs)
+{
+	unsigned int nbuckets = cs->nbuckets * 2;
+	cache_block **buckets;
+	cache_block *cb;
+
+	if ((buckets = shm_calloc(nbuckets, sizeof(cache_block *))) == NULL)
+		return;
+
+	for (cb = cs->head->next; cb != cs->tail; cb = cb->next)
+	{
+		cb->hnext = buckets[cb->hash & (nbuckets - 1)];
+		buckets[cb->hash & (nbuckets - 1)] = cb;
+	}
+	for (cb = cs->small_head->next; cb != cs->small_tail; cb = cb->next)
+	{
+		cb->hnext = buckets[cb->hash & (nbuckets - 1)];
+		buckets[cb->hash & (nbuckets - 1)] = cb;
+	}
+	shm_free(cs->buckets);
+	cs->buckets = buckets;
+	cs->nbuckets = nbuckets;
+	return;
+}
+
+/*
+ * Create a new cache block, the id and the head_size bytes of
+ * content are copied right behind the header, the rest of the
+ * object is the body it takes the reference of. Return NULL 
+ * without memory.
+ */
+static cache_block *new_cache(char *id, size_t id_len, 
+				unsigned long long hash, char *content, 
+				unsigned int head_size, cache_body *body)
+{
+	cache_block *cb;
+	size_t size = sizeof(cache_block);
+
+	/* if id == NULL, it is header and tail */
+	if (id != NULL)
+		size += id_len + 1 + head_size;
+	if ((cb = (cache_block *)shm_malloc(size)) == NULL)
+		return NULL;
+
+	cb->id = NULL;
+	cb->content = NULL;
+	if (id != NULL)
+	{
+		cb->id = (char *)(cb + 1);
+		memcpy(cb->id, id, id_len + 1);
+		cb->content = cb->id + id_len + 1;
+		memcpy(cb->content, content, head_size);
+	}
+	cb->id_len = id_len;
+	cb->hash = hash;
+	cb->head_size = head_size;
+	cb->body = body;
+	cb->block_size = head_size + (body != NULL ? body->size : 0);
+
+	/* what the allocation really takes */
+	cb->charge = shm_charge(cb);
+
+	cb->refcnt = 1;
+	cb->freq = 0;
+	cb->prio = 0;
+	cb->small = 0;
+	cb->evicted = 0;
+	cb->ondisk = 0;
+	cb->expires = 0;
+	cb->prev = NULL;
+	cb->next = NULL;
+	cb->hnext = NULL;
+
+	return cb;
+}
+
+/*
+ * Make a block for an object of block_size bytes at content. If
+ * the body after its headers is big enough to be shared, it goes
+ * to the table of bodies and the block only keeps the headers, the
+ * body of a text object gzip with compression on. Return NULL 
+ * without memory.
+ */
+static cache_block *make_block(cache_shard *cs, char *id, size_t id_len,
+				unsigned long long hash, char *content, 
+				unsigned int block_size)
+{
+	unsigned int head_size = block_size;
+	cache_body *body = NULL;
+	cache_block *cb;
+	char *end;
+	int zip;
+
+	/* the block is the caller's until the list or cache_release takes it */
+	shm_enter();
+
+	/* the body starts after the empty line */
+	if ((end = memmem(content, block_size, "\r\n\r\n", 4)) != NULL &&
+		block_size - (end + 4 - content) >= BODY_MIN)
+	{
+		head_size = end + 4 - content;
+		zip = cs->bodies->compress && 
+			http_compressible(content, head_size - 2);
+		if ((body = get_body(cs->bodies, content + head_size, 
+							 block_size - head_size, zip)) == NULL)
+		{
+			shm_leave();
+			return NULL;
+		}
+	}
+	if ((cb = new_cache(id, id_len, hash, content, head_size, body)) == NULL)
+	{
+		if (body != NULL)
+			release_body(body);
+		shm_leave();
+	}
+	return cb;
+}
+
+/*
+ * Take a reference on the stored body equal to the size bytes at
+ * data, or store a copy of them if there is none, gzip if zip.
+ * Return NULL without memory.
+ */
+static cache_body *get_body(cache_bodies *cbs, char *data, 
+				unsigned int size, int zip)
+{
+	unsigned long long hash[2];
+	unsigned int i;
+	cache_body *body, *new_body = NULL;
+	sem_t *lock;
+
+	hash_body(data, size, hash);
+	i = hash[0] & (cbs->nbuckets - 1);
+	lock = &cbs->locks[i % BODY_LOCKS];
+	__sync_fetch_and_add(&cbs->n_adds, 1);
+
+	/* the first pass looks, the second one adds the copy made meanwhile */
+	while (1)
+	{
+		body_lock(lock);
+		for (body = cbs->buckets[i]; body != NULL; body = body->next)
+		{
+			if (body->hash[0] != hash[0] || body->hash[1] != hash[1] ||
+				body->size != size)
+				continue;
+
+			/* 
+			 * the bytes are compared too, a hash can be made to collide,
+			 * gzip bytes to those of the copy, once it is made
+			 */
+			if (body->zsize == 0 ? !memcmp(body->data, data, size) :
+				new_body != NULL && new_body->zsize == body->zsize &&
+				!memcmp(body->data, new_body->data, body->zsize))
+				break;
+		}
+		if (body != NULL)
+		{
+			body->refcnt++;
+			body_unlock(lock);
+			shm_free(new_body);
+			__sync_fetch_and_add(&cbs->n_found, 1);
+			return body;
+		}
+		if (new_body != NULL)
+			break;
+		body_unlock(lock);
+
+		/* copy it without the lock */
+		if ((new_body = copy_body(cbs, data, size, hash, zip)) == NULL)
+			return NULL;
+	}
+	new_body->next = cbs->buckets[i];
+	cbs->buckets[i] = new_body;
+	body_unlock(lock);
+	__sync_fetch_and_add(&cbs->n_bodies, 1);
+	__sync_fetch_and_add(&cbs->n_bytes, size);
+	if (new_body->zsize > 0)
+	{
+		__sync_fetch_and_add(&cbs->n_zipped, 1);
+		__sync_fetch_and_add(&cbs->n_zip_bytes, size);
+		__sync_fetch_and_add(&cbs->n_zip_stored, new_body->zsize);
+	}
+	return new_body;
+}
+
+/*
+ * Make a body of the size bytes at data, not in the table yet. If
+ * zip, it is stored gzip when that saves an eighth of it at least.
+ * Return NULL without memory.
+ */
+static cache_body *copy_body(cache_bodies *cbs, char *data, 
+				unsigned int size, unsigned long long *hash, int zip)
+{
+	size_t hdr_size = sizeof(cache_body) + cbs->nshards * sizeof(unsigned int);
+	unsigned long long start;
+	cache_body *body, *p;
+
+	if ((body = (cache_body *)shm_malloc(hdr_size + size)) == NULL)
+		return NULL;
+	body->data = (char *)(body->shard_refs + cbs->nshards);
+	body->zsize = 0;
+	if (zip)
+	{
+		start = cpu_ns();
+		body->zsize = zip_deflate(data, size, body->data, size - size / 8);
+		__sync_fetch_and_add(&cbs->zip_ns, cpu_ns() - start);
+		__sync_fetch_and_add(&cbs->n_zip_tries, 1);
+	}
+	if (body->zsize == 0)
+		memcpy(body->data, data, size);
+	else if ((p = shm_realloc(body, hdr_size + body->zsize)) != NULL)
+	{
+		/* give back the room the gzip bytes do not take */
+		body = p;
+		body->data = (char *)(body->shard_refs + cbs->nshards);
+	}
+
+	body->hash[0] = hash[0];
+	body->hash[1] = hash[1];
+	body->size = size;
+	body->charge = shm_charge(body);
+	body->refcnt = 1;
+	body->table = cbs;
+	memset(body->shard_refs, 0, cbs->nshards * sizeof(unsigned int));
+	return body;
+}
+
+/*
+ * Return where the body of a block is plain. A gzip body is
+ * decompressed into memory that *buf points to afterwards, the 
+ * caller frees it. Return NULL without memory.
+ */
+static char *plain_body(cache_block *cb, char **buf)
+{
+	*buf = NULL;
+	if (cb->body->zsize == 0)
+		return cb->body->data;
+	if ((*buf = malloc(cb->body->size)) == NULL ||
+		zip_inflate(cb->body->data, cb->body->zsize, *buf, 
+					cb->body->size) != cb->body->size)
+	{
+		free(*buf);
+		*buf = NULL;
+		return NULL;
+	}
+	return *buf;
+}
+
+/*
+ * CPU time of the calling thread in nanoseconds
+ */
+static unsigned long long cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Drop the reference of a block on its body, the last one 
+ * takes it out of the table and frees it
+ */
+static void release_body(cache_body *body)
+{
+	cache_bodies *cbs = body->table;
+	unsigned int i = body->hash[0] & (cbs->nbuckets - 1);
+	cache_body **pp;
+
+	body_lock(&cbs->locks[i % BODY_LOCKS]);
+	if (--body->refcnt > 0)
+	{
+		body_unlock(&cbs->locks[i % BODY_LOCKS]);
+		return;
+	}
+	for (pp = &cbs->buckets[i]; *pp != body; pp = &(*pp)->next)
+		;
+	*pp = body->next;
+	body_unlock(&cbs->locks[i % BODY_LOCKS]);
+
+	__sync_fetch_and_sub(&cbs->n_bodies, 1);
+	__sync_fetch_and_sub(&cbs->n_bytes, body->size);
+	if (body->zsize > 0)
+	{
+		__sync_fetch_and_sub(&cbs->n_zipped, 1);
+		__sync_fetch_and_sub(&cbs->n_zip_bytes, body->size);
+		__sync_fetch_and_sub(&cbs->n_zip_stored, body->zsize);
+	}
+	shm_free(body);
+	return;
+}
+
+/*
+ * The 128-bit MurmurHash3 (x64 variant, seed 0) of len bytes 
+ * at data into out[0] and out[1]
+ */
+static void hash_body(const char *data, size_t len, 
+				unsigned long long *out)
+{
+	const unsigned long long c1 = 0x87c37b91114253d5ULL;
+	const unsigned long long c2 = 0x4cf5ad432745937fULL;
+	const unsigned char *tail = (const unsigned char *)data + len / 16 * 16;
+	unsigned long long h1 = 0, h2 = 0, k1, k2, *h;
+	size_t i;
+	int j;
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+	for (i = 0; i < len / 16; i++)
+	{
+		memcpy(&k1, data + i * 16, 8);
+		memcpy(&k2, data + i * 16 + 8, 8);
+		k1 *= c1;
+		k1 = ROTL64(k1, 31);
+		k1 *= c2;
+		h1 ^= k1;
+		h1 = ROTL64(h1, 27);
+		h1 += h2;
+		h1 = h1 * 5 + 0x52dce729;
+		k2 *= c2;
+		k2 = ROTL64(k2, 33);
+		k2 *= c1;
+		h2 ^= k2;
+		h2 = ROTL64(h2, 31);
+		h2 += h1;
+		h2 = h2 * 5 + 0x38495ab5;
+	}
+
+	/* the last up to 15 bytes, little endian */
+	k1 = k2 = 0;
+	for (i = 0; i < len % 16; i++)
+	{
+		if (i < 8)
+			k1 ^= (unsigned long long)tail[i] << (i * 8);
+		else
+			k2 ^= (unsigned long long)tail[i] << ((i - 8) * 8);
+	}
+	if (len % 16 > 8)
+	{
+		k2 *= c2;
+		k2 = ROTL64(k2, 33);
+		k2 *= c1;
+		h2 ^= k2;
+	}
+	if (len % 16 > 0)
+	{
+		k1 *= c1;
+		k1 = ROTL64(k1, 31);
+		k1 *= c2;
+		h1 ^= k1;
+	}
+#undef ROTL64
+
+	h1 ^= len;
+	h2 ^= len;
+	h1 += h2;
+	h2 += h1;
+	for (j = 0; j < 2; j++)
+	{
+		/* the final mix of each half */
+		h = j == 0 ? &h1 : &h2;
+		*h ^= *h >> 33;
+		*h *= 0xff51afd7ed558ccdULL;
+		*h ^= *h >> 33;
+		*h *= 0xc4ceb9fe1a85ec53ULL;
+		*h ^= *h >> 33;
+	}
+	h1 += h2;
+	h2 += h1;
+	out[0] = h1;
+	out[1] = h2;
+	return;
+}
+
+/*
+ * Bytes a block adds to a shard: its body too, unless another
+ * block of the shard has it already. Must hold the lock.
+ */
+static size_t block_cost(cache_shard *cs, cache_block *cb)
+{
+	if (cb->body != NULL && cb->body->shard_refs[cs->index] == 0)
+		return cb->charge + cb->body->charge;
+	return cb->charge;
+}
+
+/*
+ * Insert a cache block into cache list
+ */
+static void insert_cache(cache_shard *cs, cache_block *cb)
+{
+	/* manipulate pointer */
+	cb->prev = cs->head;
+	cb->next = cs->head->next;
+	cs->head->next->prev = cb;
+	cs->head->next = cb;
+
+	/* add it to the hash index */
+	cb->hnext = cs->buckets[cb->hash & (cs->nbuckets - 1)];
+	cs->buckets[cb->hash & (cs->nbuckets - 1)] = cb;
+	if (++cs->nblocks > cs->nbuckets)
+		grow_index(cs);
+
+    /* change total size, a body counts once per shard */
+	cs->total_size += cb->charge;
+	if (cb->body != NULL)
+	{
+		if (cb->body->shard_refs[cs->index]++ == 0)
+		{
+			cs->total_size += cb->body->charge;
+			cs->n_body_bytes += cb->body->size;
+		}
+		cs->n_ref_bytes += cb->body->size;
+	}
+
+	/* the policy may move it elsewhere */
+	if (cs->policy->insert != NULL)
+		cs->policy->insert(cs, cb);
+	return;
+}
+
+/*
+ * Delete cache block
+ */
+static cache_block *delete_cache(cache_shard *cs, cache_block *cb)
+{
+	/* remove cache block from list */
+	cache_block *prev_cb, **pp;
+	cb->next->prev = cb->prev;
+	cb->prev->next = cb->next;
+	cs->total_size -= cb->charge;
+	if (cb->small)
+		cs->small_size -= cb->charge;
+	if (cb->body != NULL)
+	{
+		if (--cb->body->shard_refs[cs->index] == 0)
+		{
+			cs->total_size -= cb->body->charge;
+			cs->n_body_bytes -= cb->body->size;
+		}
+		cs->n_ref_bytes -= cb->body->size;
+	}
+	prev_cb = cb->prev;
+
+	/* and from the hash index */
+	for (pp = &cs->buckets[cb->hash & (cs->nbuckets - 1)]; *pp != cb; 
+		 pp = &(*pp)->hnext)
+		;
+	*pp = cb->hnext;
+	cs->nblocks--;
+
+	/* the reference of the list is dropped once the lock is not held */
+	cb->prev = NULL;
+	cb->next = cs->dead;
+	cs->dead = cb;
+
+	return prev_cb;
+}
+
+/*
+ * Take the blocks deleted from a shard, with its lock held. They
+ * are the caller's until release_dead.
+ */
+static cache_block *take_dead(cache_shard *cs)
+{
+	cache_block *dead = cs->dead;
+
+	cs->dead = NULL;
+	if (dead != NULL)
+		shm_enter();
+	return dead;
+}
+
+/*
+ * Drop the reference of the list on blocks deleted under the lock,
+ * the evicted ones are written to the disk tier first
+ */
+static void release_dead(cache_block *dead)
+{
+	cache_block *next;
+	char *body, *buf;
+
+	if (dead == NULL)
+		return;
+	for (; dead != NULL; dead = next)
+	{
+		next = dead->next;
+
+		/* the disk gets the body plain, a gzip one is decompressed */
+		body = buf = NULL;
+		if (dead->evicted && disk_enabled() && (dead->body == NULL ||
+			(body = plain_body(dead, &buf)) != NULL))
+			disk_put(dead->id, dead->id_len, dead->hash, dead->content,
+					 dead->head_size, body, 
+					 dead->block_size - dead->head_size, dead->expires,
+					 dead->ondisk);
+		free(buf);
+		drop_block(dead);
+	}
+	shm_leave();
+	return;
+}
+
+/*
+ * Update cache list, put a new cache block
+ * to the head of the cache list.
+ */
+static void update_cache(cache_shard *cs, cache_block *cb)
+{
+	/* put cache block to the head */
+	cb->next->prev = cb->prev;
+	cb->prev->next = cb->next;
+	cb->prev = cs->head;
+	cb->next = cs->head->next;
+	cs->head->next = cb;
+	cb->next->prev = cb;
+
+	return;
+}
+
+/*
+ * When eviction, delete cache block from tail, 
+ * make room from new cache block, then insert
+ * the new cache block into head of the list.
+ */
+static void replace_cache(cache_shard *cs, cache_block *new_cb)
+{
+	/* evict by the policy, make room for new cache block */
+	while (cs->total_size + block_cost(cs, new_cb) > cs->max_size &&
+		   evict_cache(cs))
+		;
+
+	/* inster new cache block */
+	insert_cache(cs, new_cb);
+
+	return;
+}
+
+/*
+ * Evict the block the policy picks, return 0 if the
+ * shard is empty. Must hold the lock as writer.
+ */
+static int evict_cache(cache_shard *cs)
+{
+	cache_block *cb;
+
+	if ((cb = cs->policy->victim(cs)) == NULL)
+		return 0;
+	delete_cache(cs, cb);
+	cb->evicted = 1;
+	cs->n_evictions++;
+	return 1;
+}
+
+/*
+ * LRU: a hit moves the block to the head. Must hold the lock
+ * as writer, which is what hit_writes asks for.
+ */
+static void lru_hit(cache_shard *cs, cache_block *cb)
+{
+	update_cache(cs, cb);
+	return;
+}
+
+/*
+ * LRU: the block at the tail
+ */
+static cache_block *lru_victim(cache_shard *cs)
+{
+	return cs->tail->prev != cs->head ? cs->tail->prev : NULL;
+}
+
+/*
+ * CLOCK: a hit sets the referenced bit
+ */
+static void clock_hit(cache_shard *cs, cache_block *cb)
+{
+	/* only store the bit if it is not set, that line stays shared */
+	if (!__atomic_load_n(&cb->freq, __ATOMIC_RELAXED))
+		__atomic_store_n(&cb->freq, 1, __ATOMIC_RELAXED);
+	return;
+}
+
+/*
+ * CLOCK: move the hand until it finds a block that was
+ * not referenced since the last pass
+ */
+static cache_block *clock_victim(cache_shard *cs)
+{
+	cache_block *cb;
+
+	/* every block gets its bit cleared once, so two passes at most */
+	while ((cb = cs->tail->prev) != cs->head)
+	{
+		if (!cb->freq)
+			return cb;
+
+		/* second chance, it goes around once more */
+		cb->freq = 0;
+		update_cache(cs, cb);
+	}
+	return NULL;
+}
+
+/*
+ * LFU: count the hit
+ */
+static void lfu_hit(cache_shard *cs, cache_block *cb)
+{
+	__sync_fetch_and_add(&cb->freq, 1);
+	return;
+}
+
+/*
+ * LFU: the block with the fewest hits, the oldest on a tie
+ */
+static cache_block *lfu_victim(cache_shard *cs)
+{
+	cache_block *cb, *victim = NULL;
+
+	for (cb = cs->tail->prev; cb != cs->head; cb = cb->prev)
+	{
+		if (victim == NULL || cb->freq < victim->freq)
+			victim = cb;
+	}
+	return victim;
+}
+
+/*
+ * GDSF: a new block starts at the age of the cache with one hit
+ */
+static void gdsf_insert(cache_shard *cs, cache_block *cb)
+{
+	cb->prio = cs->age;
+	cb->freq = 1;
+	return;
+}
+
+/*
+ * GDSF: count the hit and bring the block up to the age of
+ * the cache. The age only changes under the lock as writer.
+ */
+static void gdsf_hit(cache_shard *cs, cache_block *cb)
+{
+	__sync_fetch_and_add(&cb->freq, 1);
+	__atomic_store_n(&cb->prio, cs->age, __ATOMIC_RELAXED);
+	return;
+}
+
+/*
+ * GDSF: the block with the lowest priority, the age of the
+ * cache moves up to it
+ */
+static cache_block *gdsf_victim(cache_shard *cs)
+{
+	cache_block *cb, *victim = NULL;
+	unsigned long long prio, low = 0;
+
+	for (cb = cs->tail->prev; cb != cs->head; cb = cb->prev)
+	{
+		prio = cb->prio + (unsigned long long)cb->freq * GDSF_SCALE / 
+			   cb->block_size;
+		if (victim == NULL || prio < low)
+		{
+			victim = cb;
+			low = prio;
+		}
+	}
+	if (victim != NULL)
+		cs->age = low;
+	return victim;
+}
+
+/*
+ * S3-FIFO: a block evicted from the small queue not long ago
+ * goes to the main queue, any other block to the small queue
  */
+static void s3fifo_insert(cache_shard *cs, cache_block *cb)
+{
+	unsigned long long *slot = &cs->ghost[cb->hash & (CACHE_GHOST - 1)];
 
-#include "csapp.h"
-#include "cache.h"
+	if (*slot == cb->hash)
+	{
+		*slot = 0;
+		return;
+	}
+
+	/* move it from the head of main to the head of small */
+	cb->next->prev = cb->prev;
+	cb->prev->next = cb->next;
+	cb->prev = cs->small_head;
+	cb->next = cs->small_head->next;
+	cs->small_head->next->prev = cb;
+	cs->small_head->next = cb;
+	cb->small = 1;
+	cs->small_size += cb->charge;
+	return;
+}
 
 /*
- * Declaration of the methods and variables that only used
- * in cache.c
+ * S3-FIFO: count the hit, up to S3FIFO_MAX_FREQ
  */
-static cache_block *new_cache(char *id, char *content, 
-				unsigned int block_size);
-static void insert_cache(cache_list *cl, cache_block *cb);
-static void replace_cache(cache_list *cl, cache_block *new_cb);
-static cache_block *delete_cache(cache_list *cl, cache_block *cb);
-static void update_cache(cache_list *cl, cache_block *cb);
-static sem_t sem;
+static void s3fifo_hit(cache_shard *cs, cache_block *cb)
+{
+	unsigned int freq = __atomic_load_n(&cb->freq, __ATOMIC_RELAXED);
 
+	if (freq < S3FIFO_MAX_FREQ)
+		__atomic_store_n(&cb->freq, freq + 1, __ATOMIC_RELAXED);
+	return;
+}
 
 /*
- * Initialize caceh list
+ * S3-FIFO: evict from the small queue while it is over its 
+ * share, else from main. A block hit in small moves on to
+ * main, a block hit in main goes around once more per hit.
  */
-void init_cache_list(cache_list *cl)
+static cache_block *s3fifo_victim(cache_shard *cs)
 {
-	cl->total_size = 0;
+	cache_block *cb;
 
-	/* initialize the two cache block as head and tail */
-	cl->head = new_cache(NULL, NULL, 0);
-	cl->tail = new_cache(NULL, NULL, 0);
+	/* each round moves a block to main or takes a hit off one */
+	while (1)
+	{
+		cb = cs->small_tail->prev;
+		if (cb != cs->small_head && 
+			(cs->small_size > cs->max_size / 10 || 
+			 cs->tail->prev == cs->head))
+		{
+			if (!cb->freq)
+			{
+				cs->ghost[cb->hash & (CACHE_GHOST - 1)] = cb->hash;
+				return cb;
+			}
+			cb->freq = 0;
+			cb->small = 0;
+			cs->small_size -= cb->charge;
+			update_cache(cs, cb);
+			continue;
+		}
 
-	cl->head->next = cl->tail;
-	cl->tail->prev = cl->head;
+		if ((cb = cs->tail->prev) == cs->head)
+			return NULL;
+		if (!cb->freq)
+			return cb;
+		cb->freq--;
+		update_cache(cs, cb);
+	}
+}
 
-	/* initialize lock */
-	Sem_init(&sem, 0, 1); 
+/*
+ * Find a cache block in a shard by id
+ */
+static cache_block *find_cache(cache_shard *cs, char *id, 
+				size_t id_len, unsigned long long hash)
+{
+	cache_block *cb;
 
-	return;
+	/* serach the hash bucket, the list is not changed */
+	for(cb = cs->buckets[hash & (cs->nbuckets - 1)]; cb != NULL; 
+		cb = cb->hnext)
+	{
+    	if(cb->hash == hash && cb->id_len == id_len && 
+    	   !memcmp(cb->id, id, id_len))
+    	{
+    		return cb; 
+    	} 			
+    }
+    return NULL;
 }
 
 /*
- * Free cache list
+ * Check cache list, if there exist the request content,
+ * return its block with a reference held for the caller,
+ * who reads the content and then calls cache_release.
  */
-void free_cache_list(cache_list *cl)
+cache_block *read_cache(cache_list *cl, char *id)
 {
-	/* delete all cache block */
-	cache_block *cb;
-	for(cb = cl->tail->prev; cb != cl->head;)
+	size_t id_len;
+	unsigned long long hash = hash_id(id, &id_len);
+	cache_shard *cs = get_shard(cl, hash);
+	cache_block *cache = NULL;
+
+	/* 
+	 * Unless the policy changes the list on a hit, hits 
+	 * only lock it as readers and may run at the same time
+	 */
+	if (cs->policy->hit_writes)
+		shard_wrlock(cs);
+	else
+		shard_rdlock(cs);
+	cache = find_cache(cs, id, id_len, hash);
+
+	/* 
+	 * If cache hit, keep the block alive for the reader. A stale
+	 * one is returned too, the caller revalidates it.
+	 */
+	if (cache != NULL)
 	{
-		cb = delete_cache(cl, cb);
+		hold_block(cache);
+		cs->policy->hit(cs, cache);
 	}
+	shard_unlock(cs);
+
+	/* the disk tier may still have it, a hit there is a hit too */
+	if (cache == NULL)
+		cache = promote_cache(cs, id, id_len, hash);
+	count_lookup(cs, cache);
+	return cache;
+}
 
-	/* free heap */
-	free(cl->head);
-	free(cl->tail);
-	free(cl);
+/*
+ * Count a lookup in a shard that found cb, or nothing if it is NULL
+ */
+static void count_lookup(cache_shard *cs, cache_block *cb)
+{
+	if (cb == NULL)
+		__sync_fetch_and_add(&cs->n_misses, 1);
+	else if (cache_fresh(cb))
+	{
+		__sync_fetch_and_add(&cs->n_hits, 1);
+		__sync_fetch_and_add(&cs->n_hit_bytes, cb->block_size);
+	}
+	else
+		__sync_fetch_and_add(&cs->n_stale, 1);
 	return;
 }
 
 /*
- * Create a new cache block
+ * Look for id on the disk after a miss, a hit there is copied back
+ * into the shard. Return the block with a reference held for the
+ * caller, or NULL if the disk does not have it either.
  */
-static cache_block *new_cache(char *id, char *content, 
-				unsigned int block_size)
+static cache_block *promote_cache(cache_shard *cs, char *id, 
+				size_t id_len, unsigned long long hash)
 {
-	cache_block *cb;
-	cb = (cache_block *)malloc(sizeof(cache_block));
+	cache_block *cb, *old_cb, *dead;
+	unsigned int size;
+	time_t expires;
+	char *content, *copy = NULL;
+
+	if ((content = disk_get(id, id_len, hash, &size, &expires)) == NULL)
+		return NULL;
 
 	/* 
-	 * copy cache id, if id == NULL, 
-	 * it is header and tail
+	 * copy it out first, evictions wait for the disk while it is 
+	 * held, and a body may be hashed and compressed for the block
 	 */
-	if (id != NULL)
+	if (size <= cs->max_size && (copy = malloc(size)) != NULL)
+		memcpy(copy, content, size);
+	disk_release();
+	if (copy == NULL)
+		return NULL;
+	cb = make_block(cs, id, id_len, hash, copy, size);
+	free(copy);
+	if (cb == NULL)
+		return NULL;
+	if (cb->charge + (cb->body ? cb->body->charge : 0) > cs->max_size)
 	{
-		cb->id = (char *) malloc(sizeof(char) * (strlen(id) + 1));
-		strcpy(cb->id, id);
+		cache_release(cb);
+		return NULL;
 	}
+	cb->ondisk = 1;
+	cb->expires = expires;
 
-	cb->block_size = block_size;
+	shard_wrlock(cs);
 
-	/* 
-	 * copy cache content, if content == NULL, 
-	 * it is header and tail
-	 */
-	if (content != NULL)
+	/* another miss brought it in meanwhile, keep that one */
+	if ((old_cb = find_cache(cs, id, id_len, hash)) != NULL)
 	{
-		cb->content = (char *) malloc(sizeof(char) * block_size);
-		memcpy(cb->content, content, sizeof(char) * block_size);
+		cache_release(cb);
+		cb = old_cb;
 	}
+	else
+	{
+		/* the list takes the reference of make_block */
+		replace_cache(cs, cb);
+		shm_leave();
+	}
+	hold_block(cb);
+	dead = take_dead(cs);
+	shard_unlock(cs);
 
-	cb->prev = NULL;
-	cb->next = NULL;
-
+	release_dead(dead);
 	return cb;
 }
 
 /*
- * Insert a cache block into cache list
+ * Drop a reference on a cache block, the last one frees it.
+ * Readers release without the lock of the shard.
  */
-static void insert_cache(cache_list *cl, cache_block *cb)
+void cache_release(cache_block *cb)
 {
-	/* manipulate pointer */
-	cb->prev = cl->head;
-	cb->next = cl->head->next;
-	cl->head->next->prev = cb;
-	cl->head->next = cb;
+	drop_block(cb);
+	shm_leave();
+	return;
+}
 
-    /* change total size */
-	cl->total_size += cb->block_size;
+/*
+ * Take a reference on a cache block for the caller. A worker that
+ * holds one counts as busy: killed, it would never drop it.
+ */
+static void hold_block(cache_block *cb)
+{
+	__sync_fetch_and_add(&cb->refcnt, 1);
+	shm_enter();
 	return;
 }
 
 /*
- * Delete cache block
+ * Drop a reference on a cache block, not counted for the caller
  */
-static cache_block *delete_cache(cache_list *cl, cache_block *cb)
+static void drop_block(cache_block *cb)
 {
-	/* remove cache block from list */
-	cache_block *prev_cb;
-	cb->next->prev = cb->prev;
-	cb->prev->next = cb->next;
-	cl->total_size -= cb->block_size;
-	prev_cb = cb->prev;
+	if (__sync_sub_and_fetch(&cb->refcnt, 1) > 0)
+		return;
 
-	cb->prev = NULL;
-	cb->next = NULL;
+	/* Free heap, the id and content go with it, a shared body may not */
+	if (cb->body != NULL)
+		release_body(cb->body);
+	shm_free(cb);
+	return;
+}
+
+/*
+ * Check if a block may be sent without asking its server
+ */
+int cache_fresh(cache_block *cb)
+{
+	return __atomic_load_n(&cb->expires, __ATOMIC_RELAXED) > time(NULL);
+}
 
-	/* Free heap */
-	free(cb->id);
-	free(cb->content);
-	free(cb);
+/*
+ * The server told that a stale block did not change, it is
+ * fresh again until expires. The content stays as it is.
+ */
+void cache_refresh(cache_list *cl, cache_block *cb, time_t expires)
+{
+	cache_shard *cs = get_shard(cl, cb->hash);
 
-	return prev_cb;
+	__atomic_store_n(&cb->expires, expires, __ATOMIC_RELAXED);
+	__sync_fetch_and_add(&cs->n_refreshes, 1);
+	return;
 }
 
 /*
- * Update cache list, put a new cache block
- * to the head of the cache list.
+ * Decompress the gzip body of a hit into buf, which has room for
+ * its block_size - head_size bytes. Return -1 if it can not be.
  */
-static void update_cache(cache_list *cl, cache_block *cb)
+int cache_inflate(cache_block *cb, char *buf)
 {
-	/* put cache block to the head */
-	cb->next->prev = cb->prev;
-	cb->prev->next = cb->next;
-	cb->prev = cl->head;
-	cb->next = cl->head->next;
-	cl->head->next = cb;
-	cb->next->prev = cb;
+	cache_bodies *cbs = cb->body->table;
+	unsigned long long start = cpu_ns();
+	long n;
+
+	n = zip_inflate(cb->body->data, cb->body->zsize, buf, cb->body->size);
+	__sync_fetch_and_add(&cbs->inflate_ns, cpu_ns() - start);
+	__sync_fetch_and_add(&cbs->n_inflates, 1);
+	return n == cb->body->size ? 0 : -1;
+}
 
+/*
+ * Count a hit sent with its gzip body as it is stored
+ */
+void cache_gzip_hit(cache_block *cb)
+{
+	__sync_fetch_and_add(&cb->body->table->n_gzip_hits, 1);
 	return;
 }
 
 /*
- * When eviction, delete cache block from tail, 
- * make room from new cache block, then insert
- * the new cache block into head of the list.
+ * Write a new cache block to cache list
+ */
+void modify_cache(cache_list *cl, char *id, char *content,
+		unsigned int block_size, time_t expires)
+{
+	add_cache(cl, id, content, block_size, expires, 0, 1);
+	return;
+}
+
+/*
+ * Add a block for an object, stale from expires on, freq hits 
+ * already counted for it. A fill is an object just fetched, it 
+ * counts for the byte hit ratio. Return 1 if it was added, 0 if
+ * it does not fit or there is no memory for it.
+ */
+static int add_cache(cache_list *cl, char *id, char *content, 
+				unsigned int block_size, time_t expires, unsigned int freq,
+				int fill)
+{
+	size_t id_len;
+	unsigned long long hash = hash_id(id, &id_len);
+	cache_shard *cs = get_shard(cl, hash);
+	cache_block *new_cb = NULL, *old_cb, *dead;
+
+	/* a shard can not make room for more than its share */
+	if (block_size > cs->max_size)
+		return 0;
+
+	/* copy the object before taking the lock */
+	if ((new_cb = make_block(cs, id, id_len, hash, content, 
+							 block_size)) == NULL)
+		return 0;
+	if (new_cb->charge + (new_cb->body ? new_cb->body->charge : 0) > 
+		cs->max_size)
+	{
+		cache_release(new_cb);
+		return 0;
+	}
+	new_cb->freq = freq;
+	new_cb->expires = expires;
+
+	/* 
+	 * Write operation should lock the cache list
+	 * for thread safety
+	 */
+	shard_wrlock(cs);
+
+	/* the index keeps one block per id, the newer object wins */
+	if ((old_cb = find_cache(cs, id, id_len, hash)) != NULL)
+		delete_cache(cs, old_cb);
+	if (fill)
+		cs->n_fill_bytes += block_size;
+
+    /* 
+     * When there is enough room, insert the cache,
+	 * else replace old cache block.
+     */
+    if(cs->total_size + block_cost(cs, new_cb) <= cs->max_size)
+    {
+    	insert_cache(cs, new_cb);
+    }
+    else
+    {
+    	replace_cache(cs, new_cb);
+    }
+    shm_leave();
+    dead = take_dead(cs);
+
+    shard_unlock(cs);
+
+    /* the evicted blocks are freed without holding up the shard */
+    release_dead(dead);
+    return 1;
+
+}
+
+/*
+ * Register a fetch of id after a miss. Return FILL_FETCH if 
+ * the caller has to fetch the object and call cache_fill_end,
+ * FILL_WAIT if another request fetches it already, w->wake is 
+ * then called once that fetch is done, or FILL_HIT if the object
+ * made it into the cache since the miss. A stale object counts as
+ * a miss, the fetch revalidates it.
  */
-static void replace_cache(cache_list *cl, cache_block *new_cb)
+int cache_fill_begin(cache_list *cl, char *id, cache_waiter *w)
 {
+	size_t id_len;
+	unsigned long long hash = hash_id(id, &id_len);
+	cache_shard *cs = get_shard(cl, hash);
+	pid_t pid = getpid();
 	cache_block *cb;
-	
-	/* delete from tail, make room for new cache block */
-	for(cb = cl->tail->prev; cb != cl->head;)
+	cache_fill *cf;
+
+	shard_wrlock(cs);
+	if ((cb = find_cache(cs, id, id_len, hash)) != NULL && cache_fresh(cb))
+	{
+		shard_unlock(cs);
+		return FILL_HIT;
+	}
+
+	/* 
+	 * somebody is on it, wait for the object. Only for a fetch of
+	 * this process: a waiter is woken by a call of the fetcher.
+	 */
+	for (cf = cs->fills; cf != NULL; cf = cf->next)
 	{
-		cb = delete_cache(cl, cb);
-		if(cl->total_size + new_cb->block_size <= MAX_CACHE_SIZE)
+		if (cf->pid == pid && !strcmp(cf->id, id))
 		{
-			break;
+			w->next = cf->waiters;
+			cf->waiters = w;
+			cs->n_waits++;
+			shard_unlock(cs);
+			return FILL_WAIT;
 		}
 	}
 
-	/* inster new cache block */
-	insert_cache(cl, new_cb);
+	/* 
+	 * Can not track the fetch without memory, 
+	 * let the caller fetch on its own
+	 */
+	if ((cf = (cache_fill *)shm_malloc(sizeof(cache_fill))) == NULL ||
+		(cf->id = (char *)shm_malloc(id_len + 1)) == NULL)
+	{
+		shm_free(cf);
+		shard_unlock(cs);
+		return FILL_FETCH;
+	}
+	memcpy(cf->id, id, id_len + 1);
+	cf->pid = pid;
+	cf->waiters = NULL;
+	cf->next = cs->fills;
+	cs->fills = cf;
+	cs->n_fills++;
+	shard_unlock(cs);
+	return FILL_FETCH;
+}
 
+/*
+ * The fetch of id is done, whether the object was cached or not,
+ * wake the requests waiting for it
+ */
+void cache_fill_end(cache_list *cl, char *id)
+{
+	size_t id_len;
+	cache_shard *cs = get_shard(cl, hash_id(id, &id_len));
+	pid_t pid = getpid();
+	cache_fill *cf, **pp;
+	cache_waiter *w, *next;
+
+	shard_wrlock(cs);
+	for (pp = &cs->fills; *pp != NULL; pp = &(*pp)->next)
+	{
+		if ((*pp)->pid == pid && !strcmp((*pp)->id, id))
+			break;
+	}
+	if ((cf = *pp) == NULL)
+	{
+		shard_unlock(cs);
+		return;
+	}
+	*pp = cf->next;
+	shard_unlock(cs);
+
+	/* a woken waiter may be gone right after wake, read next first */
+	for (w = cf->waiters; w != NULL; w = next)
+	{
+		next = w->next;
+		w->wake(w->arg);
+	}
+	shm_free(cf->id);
+	shm_free(cf);
 	return;
 }
 
 /*
- * Find a cache block in cache list by id
+ * Free the fills of the process pid, which was killed, their
+ * waiters went with it. A new process with the same pid must not
+ * join them.
  */
-cache_block *find_cache(cache_list *cl, char *id)
+void cache_fill_drop(cache_list *cl, pid_t pid)
 {
-	cache_block *cb;
+	cache_shard *cs;
+	cache_fill *cf, **pp;
+	int i;
 
-	/*
-	 * serach the cache list, if there is a hit, move
-	 * the cache block to the head of cache list
-	 */
-	for(cb = cl->head->next; cb != cl->tail; cb = cb->next)
+	for (i = 0; i < cl->nshards; i++)
 	{
-    	if(!strcmp(cb->id, id))
-    	{
-    		update_cache(cl, cb);
-    		return cb; 
-    	} 			
-    }
-    return NULL;
+		cs = &cl->shards[i];
+		shard_wrlock(cs);
+		pp = &cs->fills;
+		while ((cf = *pp) != NULL)
+		{
+			if (cf->pid != pid)
+			{
+				pp = &cf->next;
+				continue;
+			}
+			*pp = cf->next;
+			shm_free(cf->id);
+			shm_free(cf);
+		}
+		shard_unlock(cs);
+	}
+	return;
 }
 
 /*
- * Check cache list, if there exist the request content,
- * read from it.
+ * Print the hit ratio, the byte hit ratio and how many misses
+ * were collapsed, summed over the shards. The byte hit ratio 
+ * only knows the misses that were cached afterwards.
  */
-char* read_cache(cache_list *cl, char *id, int* size)
+void cache_stats(cache_list *cl, FILE *fp)
 {
-	cache_block *cache = NULL;
+	unsigned long hits = 0, misses = 0, fills = 0, waits = 0, lookups;
+	unsigned long size = 0, evictions = 0, checks = 0, rejects = 0;
+	unsigned long stale = 0, refreshes = 0;
+	unsigned long long hit_bytes = 0, fill_bytes = 0;
+	unsigned long long body_bytes = 0, ref_bytes = 0;
+	cache_bodies *cbs = &cl->bodies;
+	cache_shard *cs;
+	int i;
+
+	for (i = 0; i < cl->nshards; i++)
+	{
+		cs = &cl->shards[i];
+		shard_rdlock(cs);
+		hits += cs->n_hits;
+		misses += cs->n_misses;
+		fills += cs->n_fills;
+		waits += cs->n_waits;
+		size += cs->total_size;
+		evictions += cs->n_evictions;
+		checks += cs->n_checks;
+		rejects += cs->n_rejects;
+		stale += cs->n_stale;
+		refreshes += cs->n_refreshes;
+		hit_bytes += cs->n_hit_bytes;
+		fill_bytes += cs->n_fill_bytes;
+		body_bytes += cs->n_body_bytes;
+		ref_bytes += cs->n_ref_bytes;
+		shard_unlock(cs);
+	}
+
+	lookups = hits + stale + misses;
+	fprintf(fp, "cache: %lu lookups, %lu hits (%.1f%%), byte hit ratio "
+			"%.1f%%, %lu of %lu bytes in use in %d shards, %s policy, "
+			"%lu evictions, %lu fetches, %lu requests waited on a fetch, "
+			"%lu stale, %lu revalidated with a 304\n",
+			lookups, hits, lookups ? 100.0 * hits / lookups : 0.0,
+			hit_bytes + fill_bytes ? 
+			100.0 * hit_bytes / (hit_bytes + fill_bytes) : 0.0,
+			size, (unsigned long)cl->max_size, cl->nshards, 
+			cl->shards[0].policy->name, evictions, 
+			fills, waits, stale, refreshes);
 
 	/* 
-	 * As we would manipulate the cache list 
-	 * when there is cache hit, we first lock 
-	 * it for thread safety
+	 * The bodies of the cached objects take ref_bytes of room without
+	 * sharing, the shards count body_bytes, the difference is room
+	 * gained. Bodies of evicted blocks still being sent count in
+	 * n_bytes of the table, but in no shard.
 	 */
-	P(&sem);
-	char* content_copy;
+	fprintf(fp, "cache dedup: %lu of %lu bodies found stored, %lu bodies "
+			"of %llu bytes stored, %llu bytes of bodies in cached objects "
+			"counted as %llu (ratio %.2f), %llu bytes of cache size gained\n",
+			cbs->n_found, cbs->n_adds, cbs->n_bodies, cbs->n_bytes, 
+			ref_bytes, body_bytes, 
+			body_bytes ? (double)ref_bytes / body_bytes : 1.0,
+			ref_bytes - body_bytes);
 
-	cache = find_cache(cl, id);
+	/* 
+	 * The CPU time to compress is that of every new text body, those
+	 * left plain too, and to decompress that of each plain hit
+	 */
+	if (cbs->compress)
+		fprintf(fp, "cache compression: %lu text bodies compressed in "
+				"%.1f us of CPU each, %lu bodies of %llu bytes stored gzip "
+				"in %llu (ratio %.2f), %lu hits sent gzip, %lu hits "
+				"decompressed in %.1f us of CPU each\n",
+				cbs->n_zip_tries, cbs->n_zip_tries ? 
+				cbs->zip_ns / 1000.0 / cbs->n_zip_tries : 0.0,
+				cbs->n_zipped, cbs->n_zip_bytes, cbs->n_zip_stored,
+				cbs->n_zip_stored ? 
+				(double)cbs->n_zip_bytes / cbs->n_zip_stored : 1.0,
+				cbs->n_gzip_hits, cbs->n_inflates, cbs->n_inflates ?
+				cbs->inflate_ns / 1000.0 / cbs->n_inflates : 0.0);
 
-	/* if cache hit, copy the content */
-	if (cache != NULL)
+	/* 
+	 * An admitted miss was seen before, so it would have been a hit
+	 * had the first one been cached and kept: the most it cost
+	 */
+	if (cl->shards[0].door != NULL)
+		fprintf(fp, "cache admission: %lu misses checked, %lu not cached "
+				"as first seen (%.1f%%), %lu repeated misses, at most %.1f%% "
+				"of lookups that could have hit without admission\n",
+				checks, rejects, checks ? 100.0 * rejects / checks : 0.0,
+				checks - rejects, lookups ? 
+				100.0 * (checks - rejects) / lookups : 0.0);
+	return;
+}
+
+/*
+ * Write the cached objects to a snapshot file at path, coldest 
+ * first, so that loading them in order restores the order of the 
+ * shards. The file is replaced only once it is complete. Return 
+ * the number of objects written, or -1 if it could not be.
+ */
+int cache_save(cache_list *cl, char *path)
+{
+	char tmp[MAXLINE];
+	snapshot_header hdr;
+	FILE *fp;
+	int i, n, err, nblocks = 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if ((fp = fopen(tmp, "w")) == NULL)
+		return -1;
+
+	/* the count is known at the end, the header is written again then */
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.saved = time(NULL);
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	for (i = 0; i < cl->nshards; i++)
+	{
+		if ((n = save_shard(fp, &cl->shards[i])) < 0)
+			break;
+		nblocks += n;
+	}
+	hdr.nblocks = nblocks;
+	rewind(fp);
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+
+	err = i < cl->nshards || ferror(fp);
+	if (fclose(fp) != 0 || err || rename(tmp, path) < 0)
 	{
-		*size = cache->block_size;
-		content_copy = (char*) malloc(sizeof(char)*cache->block_size);
+		unlink(tmp);
+		return -1;
+	}
+	return nblocks;
+}
 
-		memcpy(content_copy, cache->content,
-			   sizeof(char) * cache->block_size);
-		V(&sem);
-        return content_copy;
+/*
+ * Write the blocks of a shard to a snapshot, return how many or
+ * -1 without memory. The lock is only held to take a reference on
+ * each block, the blocks are written without it.
+ */
+static int save_shard(FILE *fp, cache_shard *cs)
+{
+	static const char pad[8];
+	snapshot_block sb;
+	cache_block **blocks, *cb;
+	char *body, *buf;
+	int i, n = 0, err = 0;
 
+	shard_rdlock(cs);
+	if ((blocks = malloc((cs->nblocks + 1) * sizeof(cache_block *))) == NULL)
+	{
+		shard_unlock(cs);
+		return -1;
 	}
-	else
+
+	/* the small queue of S3-FIFO is the colder one */
+	for (cb = cs->small_tail->prev; cb != cs->small_head; cb = cb->prev)
 	{
-		V(&sem);
-		return NULL;
+		hold_block(cb);
+		blocks[n++] = cb;
+	}
+	for (cb = cs->tail->prev; cb != cs->head; cb = cb->prev)
+	{
+		hold_block(cb);
+		blocks[n++] = cb;
+	}
+	shard_unlock(cs);
+
+	for (i = 0; i < n; i++)
+	{
+		cb = blocks[i];
+
+		/* a gzip body is saved plain, as the blocks are loaded */
+		body = buf = NULL;
+		if (err || (cb->body != NULL && 
+					(body = plain_body(cb, &buf)) == NULL))
+		{
+			err = 1;
+			cache_release(cb);
+			continue;
+		}
+		memset(&sb, 0, sizeof(sb));
+		sb.id_len = cb->id_len;
+		sb.block_size = cb->block_size;
+		sb.freq = __atomic_load_n(&cb->freq, __ATOMIC_RELAXED);
+		sb.expires = __atomic_load_n(&cb->expires, __ATOMIC_RELAXED);
+		fwrite(&sb, sizeof(sb), 1, fp);
+		fwrite(cb->id, 1, cb->id_len + 1, fp);
+		fwrite(cb->content, 1, cb->head_size, fp);
+		if (body != NULL)
+			fwrite(body, 1, cb->body->size, fp);
+		fwrite(pad, 1, -(cb->id_len + 1 + cb->block_size) & 7, fp);
+		free(buf);
+		cache_release(cb);
 	}
+	free(blocks);
+	return err ? -1 : n;
 }
 
 /*
- * Write a new cache block to cache list
+ * Load the objects of a snapshot file at path into the cache, 
+ * those too big for it are skipped. Return the number of objects
+ * added to the cache, or -1 if there is no snapshot at path. A 
+ * snapshot cut short is loaded up to where it ends.
  */
-void modify_cache(cache_list *cl, char *id, char *content,
-		unsigned int block_size)
+int cache_load(cache_list *cl, char *path)
 {
-	cache_block *new_cb = NULL;
+	snapshot_loader loaders[MAX_CACHE_SHARDS];
+	pthread_t tids[MAX_CACHE_SHARDS];
+	snapshot_header hdr;
+	struct stat st;
+	char *map;
+	int fd, i, nthreads, n = 0;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(hdr))
+	{
+		close(fd);
+		return -1;
+	}
+
+	/* fault the whole file in at once, it is read from end to end */
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+			   fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	memcpy(&hdr, map, sizeof(hdr));
+	if (memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) ||
+		hdr.version != SNAPSHOT_VERSION)
+	{
+		munmap(map, st.st_size);
+		return -1;
+	}
 
 	/* 
-	 * Write operation should lock the cache list
-	 * for thread safety
+	 * Most of the time goes to the new blocks faulting in, so each
+	 * core loads the shards of its own, in the order of the file
 	 */
-	P(&sem);
-	new_cb = new_cache(id, content, block_size);
+	nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > cl->nshards)
+		nthreads = cl->nshards;
+	if (nthreads < 1)
+		nthreads = 1;
+	for (i = 0; i < nthreads; i++)
+	{
+		loaders[i].cl = cl;
+		loaders[i].map = map;
+		loaders[i].size = st.st_size;
+		loaders[i].nblocks = hdr.nblocks;
+		loaders[i].nthreads = nthreads;
+		loaders[i].id = i;
+		if (i > 0)
+			Pthread_create(&tids[i], NULL, load_blocks, &loaders[i]);
+	}
+	load_blocks(&loaders[0]);
+	for (i = 1; i < nthreads; i++)
+		Pthread_join(tids[i], NULL);
+	for (i = 0; i < nthreads; i++)
+		n += loaders[i].loaded;
 
-    /* 
-     * When there is enough room, insert the cache,
-	 * else replace old cache block.
-     */
-    if(cl->total_size + block_size <= MAX_CACHE_SIZE)
-    {
-    	insert_cache(cl, new_cb);
-    }
-    else
-    {
-    	replace_cache(cl, new_cb);
-    }
+	munmap(map, st.st_size);
+	return n;
+}
+
+/*
+ * Walk the blocks of a mapped snapshot up to where it ends and
+ * add those of the shards of one loader to the cache
+ */
+static void *load_blocks(void *vargp)
+{
+	snapshot_loader *sl = (snapshot_loader *)vargp;
+	cache_list *cl = sl->cl;
+	snapshot_block sb;
+	unsigned long long hash;
+	size_t off, len, id_len;
+	char *id;
 
-    V(&sem);
-    return;
+	off = sizeof(snapshot_header);
+	sl->loaded = 0;
+	for (sl->n = 0; sl->n < sl->nblocks; sl->n++)
+	{
+		/* the padding of the last block may be cut off too */
+		if (off > sl->size || sl->size - off < sizeof(sb))
+			break;
+		memcpy(&sb, sl->map + off, sizeof(sb));
+		len = sizeof(sb) + sb.id_len + 1 + (size_t)sb.block_size;
+		if (sl->size - off < len)
+			break;
+		id = sl->map + off + sizeof(sb);
+		if (id[sb.id_len] != '\0')
+			break;
+		hash = hash_id(id, &id_len);
+		if (id_len != sb.id_len)
+			break;
 
+		if ((get_shard(cl, hash) - cl->shards) % sl->nthreads == sl->id &&
+			sb.block_size < cl->max_object)
+			sl->loaded += add_cache(cl, id, id + sb.id_len + 1, sb.block_size, 
+					  sb.expires, sb.freq, 0);
+		off += (len + 7) & ~(size_t)7;
+	}
+	return NULL;
 }
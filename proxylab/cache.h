@@ -10,33 +10,196 @@
 #ifndef CACHE_H
 #define CACHE_H
 
+/* Default limits, the proxy may set others at startup */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 
+/* Most shards of the cache, each one must hold a max size object */
+#define MAX_CACHE_SHARDS 64
+
+/* Locks of the table of shared bodies, each one for some buckets */
+#define BODY_LOCKS 64
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+/* Return values of cache_fill_begin */
+#define FILL_FETCH 0	/* caller fetches the object, then cache_fill_end */
+#define FILL_WAIT 1		/* another request fetches it, caller is woken */
+#define FILL_HIT 2		/* the object is in the cache now, read it again */
+
+/* 
+ * Definition of a body shared by the cached objects that have the
+ * same one, whatever their ids. The data follows the counts.
+ */
+typedef struct cache_body
+{
+	unsigned long long hash[2];	/* 128-bit MurmurHash3 of the data */
+	unsigned int size;
+	unsigned int zsize;			/* of data if it is gzip, 0 if it is plain */
+	unsigned int charge;		/* bytes it takes in memory */
+	int refcnt;					/* one per block, under the bucket lock */
+	struct cache_bodies *table;
+	struct cache_body *next;	/* next body in the same bucket */
+	char *data;
+	unsigned int shard_refs[];	/* blocks of each shard, under its lock */
+}cache_body;
+
+/* Definition of the table of shared bodies */
+typedef struct cache_bodies
+{
+	sem_t locks[BODY_LOCKS];	/* bucket i is under lock i % BODY_LOCKS */
+	cache_body **buckets;
+	unsigned int nbuckets;		/* a power of two */
+	int nshards;
+	int compress;				/* gzip the bodies of text objects */
+
+	/* counters, written atomically */
+	unsigned long n_bodies;
+	unsigned long long n_bytes;
+	unsigned long n_adds;		/* blocks made with a body big enough */
+	unsigned long n_found;		/* of them found their body stored */
+	unsigned long n_zip_tries;	/* new bodies of text objects */
+	unsigned long n_zipped;		/* stored gzip, as they are now */
+	unsigned long long n_zip_bytes;		/* plain bytes of those */
+	unsigned long long n_zip_stored;	/* bytes they take gzip */
+	unsigned long long zip_ns;	/* CPU time of the tries */
+	unsigned long n_inflates;	/* hits sent plain */
+	unsigned long long inflate_ns;
+	unsigned long n_gzip_hits;	/* hits sent gzip as stored */
+}cache_bodies;
+
 /* Definition of cache block */
 typedef struct cacheblock
 {
 	char *id;
-    unsigned int block_size;
-    char *content;
+	size_t id_len;
+	unsigned long long hash;	/* FNV-1a of the id, mixed */
+    unsigned int block_size;	/* of the whole object */
+    unsigned int charge;		/* bytes it takes in memory */
+    char *content;				/* never changes once cached */
+    unsigned int head_size;		/* of content, body has the rest */
+    cache_body *body;			/* shared body, NULL if all in content */
+    time_t expires;				/* stale from then on, until revalidated */
+    int refcnt;					/* one for the list, one per reader */
+    unsigned int freq;			/* hits as the policy counts them */
+    unsigned long long prio;	/* GDSF: cache age when last hit */
+    int small;					/* S3-FIFO: in the small queue */
+    int evicted;				/* evicted, not deleted: goes to disk */
+    int ondisk;					/* read from the disk tier */
     struct cacheblock *next;
     struct cacheblock *prev;
+    struct cacheblock *hnext;	/* next block in the same hash bucket */
 }cache_block;
 
-/* Definition of cache list */
+/* Definition of a request waiting for an object being fetched */
+typedef struct cache_waiter
+{
+	void (*wake)(void *arg);
+	void *arg;
+	struct cache_waiter *next;
+}cache_waiter;
+
+/* Definition of an object being fetched from its server */
+typedef struct cache_fill
+{
+	char *id;
+	pid_t pid;					/* of the fetcher, its waiters are there */
+	cache_waiter *waiters;
+	struct cache_fill *next;
+}cache_fill;
+
+/* Eviction policy of the cache, defined in cache.c */
+struct cache_policy;
+
+/* 
+ * Definition of a cache shard, a list with its own lock, its
+ * own share of the cache size and the order of the policy
+ */
 typedef struct
 {
-	unsigned int total_size;
+	pthread_rwlock_t lock;		/* hits read, the rest write */
+	const struct cache_policy *policy;
+	int index;					/* in the list, its count in the bodies */
+	cache_bodies *bodies;		/* the table of the list */
+	size_t total_size;			/* bytes the blocks and bodies take */
+	size_t max_size;
 	cache_block *head;
 	cache_block *tail;
+	cache_block **buckets;		/* hash index of the list */
+	unsigned int nbuckets;		/* a power of two */
+	unsigned int nblocks;
+	cache_fill *fills;
+	cache_block *dead;			/* deleted, released after the lock */
+
+	/* S3-FIFO: the small queue and the ids evicted from it */
+	cache_block *small_head;
+	cache_block *small_tail;
+	size_t small_size;
+	unsigned long long *ghost;
+
+	/* GDSF: priority of the last evicted block */
+	unsigned long long age;
+
+	/* doorkeeper: counting Bloom filter of the ids that missed */
+	unsigned char *door;
+	unsigned int door_size;		/* counters, a power of two */
+	unsigned int door_window;	/* misses between two agings */
+	unsigned int door_adds;
+
+	/* counters, written under the lock, hits atomically */
+	unsigned long n_hits;
+	unsigned long n_misses;
+	unsigned long n_fills;
+	unsigned long n_waits;
+	unsigned long n_evictions;
+	unsigned long n_checks;		/* misses the doorkeeper saw */
+	unsigned long n_rejects;	/* of them first seen, not cached */
+	unsigned long n_stale;		/* lookups that found a stale object */
+	unsigned long n_refreshes;	/* stale objects a 304 made fresh */
+	unsigned long long n_hit_bytes;
+	unsigned long long n_fill_bytes;
+	unsigned long long n_body_bytes;	/* bodies counted in total_size */
+	unsigned long long n_ref_bytes;		/* bodies of the blocks, each time */
+}cache_shard;
+
+/* Definition of cache list, the shards are picked by the hash of the id */
+typedef struct
+{
+	int nshards;				/* a power of two */
+	cache_shard *shards;
+	size_t max_size;			/* bytes of memory for all shards */
+	size_t max_object;			/* objects must be smaller */
+	cache_bodies bodies;		/* shared by all the shards */
 }cache_list;
 
+/* Name of the default eviction policy */
+#define CACHE_POLICY "clock"
+
 /* Declaration of some method that is used in proxy.c */
-void init_cache_list(cache_list *cl);
-cache_block *find_cache(cache_list *cl, char *id);
+int init_cache_list(cache_list *cl, char *policy, size_t cache_size,
+					size_t object_size);
+void cache_admission(cache_list *cl, int window);
+void cache_compress(cache_list *cl, int on);
+int cache_admit(cache_list *cl, char *id);
+int cache_partition(char *id, int n);
 void modify_cache(cache_list *cl, char *id, char *content,  
-				  unsigned int block_size);
+				  unsigned int block_size, time_t expires);
 void free_cache_list(cache_list *cl);
-char* read_cache(cache_list *cl, char *id, int* size);
+cache_block *read_cache(cache_list *cl, char *id);
+void cache_release(cache_block *cb);
+int cache_fresh(cache_block *cb);
+void cache_refresh(cache_list *cl, cache_block *cb, time_t expires);
+int cache_inflate(cache_block *cb, char *buf);
+void cache_gzip_hit(cache_block *cb);
+int cache_fill_begin(cache_list *cl, char *id, cache_waiter *w);
+void cache_fill_end(cache_list *cl, char *id);
+void cache_fill_drop(cache_list *cl, pid_t pid);
+void cache_stats(cache_list *cl, FILE *fp);
+int cache_save(cache_list *cl, char *path);
+int cache_load(cache_list *cl, char *path);
 
 #endif
\ No newline at end of file
@@ -1,5 +1,6 @@
 /* $begin csapp.c */
 #include "csapp.h"
+#include "dns.h"
 
 /* Updated with a reentrant open_clientfd_r function */
 
@@ -574,6 +575,34 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
+/*
+ * rio_writev - robustly write a vector of buffers (unbuffered),
+ *    the iovec array is updated as the data goes out
+ */
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt) 
+{
+    size_t total = 0;
+    ssize_t nwritten;
+
+    while (iovcnt > 0) {
+	if ((nwritten = writev(fd, iov, iovcnt)) <= 0) {
+	    if (errno == EINTR)  /* interrupted by sig handler return */
+		continue;        /* and call writev() again */
+	    return -1;           /* errorno set by writev() */
+	}
+	total += nwritten;
+	while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) {
+	    nwritten -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (iovcnt > 0) {
+	    iov->iov_base = (char *)iov->iov_base + nwritten;
+	    iov->iov_len -= nwritten;
+	}
+    }
+    return total;
+}
 
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
@@ -650,6 +679,26 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 }
 /* $end rio_readnb */
 
+/*
+ * rio_readsomeb - Read whatever is available, up to n bytes (buffered).
+ *    Unlike rio_readnb, it returns as soon as one read() returns, so 
+ *    the caller can pass data on while the rest is still arriving. 
+ *    Large reads go straight to the user buffer when rio is empty.
+ */
+ssize_t rio_readsomeb(rio_t *rp, void *usrbuf, size_t n) 
+{
+    ssize_t nread;
+
+    if (rp->rio_cnt > 0 || n < sizeof(rp->rio_buf))
+	return rio_read(rp, usrbuf, n);
+
+    while ((nread = read(rp->rio_fd, usrbuf, n)) < 0) {
+	if (errno != EINTR) /* interrupted by sig handler return */
+	    return -1;
+    }
+    return nread;
+}
+
 /* 
  * rio_readlineb - robustly read a text line (buffered)
  */
@@ -757,43 +806,60 @@ int open_clientfd(char *hostname, int port)
 /* $end open_clientfd */
 
 /*
- * open_clientfd_r - thread-safe version of open_clientfd
+ * open_clientfd_r - thread-safe version of open_clientfd, the
+ *   addresses of hostname come from the DNS cache
  */
 int open_clientfd_r(char *hostname, int port) {
-    int clientfd;
-    struct addrinfo *addlist, *p;
-    char port_str[MAXLINE];
-    int rv;
+    struct in_addr addrs[DNS_MAX_ADDRS];
+    struct sockaddr_in serveraddr;
+    int clientfd, i, n;
 
-    /* Create the socket descriptor */
-    if ((clientfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    /* Get the addresses, before there is a socket to leak */
+    if ((n = dns_lookup(hostname, addrs, DNS_MAX_ADDRS)) <= 0)
         return -1;
+
+    /* Try each address in turn, a failed connect spoils its socket */
+    memset(&serveraddr, 0, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_port = htons(port);
+    for (i = 0; i < n; i++) {
+        if ((clientfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+            return -1;
+        serveraddr.sin_addr = addrs[i];
+        if (connect(clientfd, (SA *)&serveraddr, sizeof(serveraddr)) == 0)
+            return clientfd; /* success */
+        close(clientfd);
     }
+    return -1; /* all connects failed */
+}
+
+/*
+ * open_clientfd_nb - non-blocking version of open_clientfd_r, the
+ *   returned socket is non-blocking and its connect() may still be
+ *   in progress, wait for it to become writable and check SO_ERROR.
+ */
+int open_clientfd_nb(char *hostname, int port) {
+    struct in_addr addrs[DNS_MAX_ADDRS];
+    struct sockaddr_in serveraddr;
+    int clientfd, i, n;
 
-    /* Get a list of addrinfo structs */
-    sprintf(port_str, "%d", port);
-    if ((rv = getaddrinfo(hostname, port_str, NULL, &addlist)) != 0) {
+    if ((n = dns_lookup(hostname, addrs, DNS_MAX_ADDRS)) <= 0)
         return -1;
-    }
-  
-    /* Walk the list, using each addrinfo to try to connect */
-    for (p = addlist; p; p = p->ai_next) {
-        if ((p->ai_family == AF_INET)) {
-            if (connect(clientfd, p->ai_addr, p->ai_addrlen) == 0) {
-                break; /* success */
-            }
-        }
-    } 
-
-    /* Clean up */
-    freeaddrinfo(addlist);
-    if (!p) { /* all connects failed */
+
+    /* Start connecting to the first usable address */
+    memset(&serveraddr, 0, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_port = htons(port);
+    for (i = 0; i < n; i++) {
+        if ((clientfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+            return -1;
+        serveraddr.sin_addr = addrs[i];
+        if (connect(clientfd, (SA *)&serveraddr, sizeof(serveraddr)) == 0 ||
+                errno == EINPROGRESS)
+            return clientfd; /* success or in progress */
         close(clientfd);
-        return -1;
-    }
-    else { /* one of the connects succeeded */
-        return clientfd;
     }
+    return -1;
 }
 
 /*  
@@ -831,6 +897,40 @@ int open_listenfd(int port)
 }
 /* $end open_listenfd */
 
+/*
+ * open_listenfd_reuseport - open_listenfd for one of several
+ *     processes listening on port, each with a socket of its own,
+ *     the kernel spreads the connections over them.
+ *     Returns -1 and sets errno on Unix error.
+ */
+int open_listenfd_reuseport(int port)
+{
+    int listenfd, optval=1;
+    struct sockaddr_in serveraddr;
+
+    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	return -1;
+
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
+		   (const void *)&optval , sizeof(int)) < 0 ||
+	setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+		   (const void *)&optval , sizeof(int)) < 0) {
+	close(listenfd);
+	return -1;
+    }
+
+    bzero((char *) &serveraddr, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serveraddr.sin_port = htons((unsigned short)port);
+    if (bind(listenfd, (SA *)&serveraddr, sizeof(serveraddr)) < 0 ||
+	listen(listenfd, LISTENQ) < 0) {
+	close(listenfd);
+	return -1;
+    }
+    return listenfd;
+}
+
 /******************************************
  * Wrappers for the client/server helper routines 
  ******************************************/
@@ -865,6 +965,15 @@ int Open_listenfd(int port)
 	unix_error("Open_listenfd error");
     return rc;
 }
+
+int Open_listenfd_reuseport(int port)
+{
+    int rc;
+
+    if ((rc = open_listenfd_reuseport(port)) < 0)
+	unix_error("Open_listenfd_reuseport error");
+    return rc;
+}
 /* $end csapp.c */
 
 
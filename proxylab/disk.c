@@ -0,0 +1,334 @@
+/*
+ * disk.c -- Disk tier of the cache for the 15-213 proxy lab
+ *
+ * Team Member1: Cheng Zhang, Andrew ID: chengzh1
+ * Team Member2: Zhe Qian, Andrew ID: zheq
+ *
+ * Overview of the disk tier:
+ *	An object evicted from the memory cache was gone, the next
+ *	request for it went back to the server. With a disk file set,
+ *	evicted objects are appended to the file instead, a log of
+ *	fixed size segments written in turn. When the log wraps around
+ *	to a segment, whatever that segment held is dropped from the
+ *	index first, so the disk evicts whole segments in FIFO order
+ *	and never has to look for room.
+ *
+ *	The index is a hash table in memory, an entry tells where the
+ *	id and the content of an object are in the file. The file is
+ *	mapped read-only: a hit in the memory cache that missed copies
+ *	the object straight out of the mapping into a new block of the
+ *	memory cache, which serves it from then on. Appends go through
+ *	pwritev, so only clean page cache pages back the mapping and
+ *	the kernel drops them under pressure, the disk tier adds the
+ *	index to the memory of the proxy and little else.
+ *
+ *	Readers copy under the lock as readers, the appender holds it
+ *	as writer, so a segment is never reused under a reader. A hit
+ *	that is not in the page cache waits for the disk, with the
+ *	epoll engine its event loop waits too.
+ */
+
+#include "csapp.h"
+#include "disk.h"
+
+#define DISK_SEGMENTS 16		/* segments of the log */
+#define DISK_BUCKET_BYTES 4096	/* one index bucket per this many bytes */
+
+/* Definition of where an object is in the file */
+typedef struct disk_entry
+{
+	unsigned long long hash;	/* FNV-1a of the id, as the cache has it */
+	size_t off;					/* of the id, the content follows */
+	size_t id_len;
+	unsigned int size;
+	time_t expires;				/* as the cache had it */
+	int seg;
+	struct disk_entry *next;	/* next entry in the same bucket */
+	struct disk_entry *snext;	/* next entry in the same segment */
+	struct disk_entry **sprev;	/* what points to it in the segment */
+}disk_entry;
+
+static int enabled;
+static int fd;
+static char *map;
+static size_t seg_size;
+static disk_entry **buckets;
+static unsigned int nbuckets;	/* a power of two */
+static disk_entry *segs[DISK_SEGMENTS];
+static int cur;					/* segment being written */
+static size_t cur_off;			/* where the next append goes in it */
+static pthread_rwlock_t lock;	/* readers copy, the appender writes */
+
+/* Counters, written under the lock, hits atomically */
+static unsigned long n_lookups;
+static unsigned long n_hits;
+static unsigned long long n_hit_bytes;
+static unsigned long n_writes;
+static unsigned long long n_write_bytes;
+static unsigned long n_skips;
+static unsigned long n_entries;
+static unsigned long long n_bytes;
+static unsigned long n_reclaims;
+static unsigned long n_dropped;
+
+static disk_entry *find_entry(char *id, size_t id_len,
+							  unsigned long long hash);
+static void unlink_entry(disk_entry *e);
+static void reclaim_segment(int seg);
+
+
+/*
+ * Open the file at path as the disk tier, size bytes of it split
+ * in segments of at least object_size bytes. Return -1 if the file
+ * can not be used or size is too small for the segments.
+ */
+int disk_init(char *path, size_t size, size_t object_size)
+{
+	long page = sysconf(_SC_PAGESIZE);
+
+	/* whole pages per segment, each holds at least one max object */
+	seg_size = size / DISK_SEGMENTS / page * page;
+	if (seg_size == 0 || seg_size < object_size)
+		return -1;
+
+	if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0)
+		return -1;
+	if (ftruncate(fd, seg_size * DISK_SEGMENTS) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, seg_size * DISK_SEGMENTS, PROT_READ, MAP_SHARED,
+			   fd, 0);
+	if (map == MAP_FAILED)
+	{
+		close(fd);
+		return -1;
+	}
+
+	/* hits jump around the file, read ahead would be wasted */
+	madvise(map, seg_size * DISK_SEGMENTS, MADV_RANDOM);
+
+	nbuckets = 64;
+	while (nbuckets < size / DISK_BUCKET_BYTES)
+		nbuckets *= 2;
+	buckets = (disk_entry **)Calloc(nbuckets, sizeof(disk_entry *));
+	pthread_rwlock_init(&lock, NULL);
+	cur = 0;
+	cur_off = 0;
+	enabled = 1;
+	return 0;
+}
+
+/*
+ * Check if there is a disk tier at all
+ */
+int disk_enabled(void)
+{
+	return enabled;
+}
+
+/*
+ * Look for id on the disk. On a hit return where its content is
+ * mapped and its size in size, the caller copies it and must call
+ * disk_release, the file is not changed until then. Its expiry
+ * goes to expires, a stale object is revalidated. Return NULL
+ * on a miss, there is nothing to release then.
+ */
+char *disk_get(char *id, size_t id_len, unsigned long long hash,
+			   unsigned int *size, time_t *expires)
+{
+	disk_entry *e;
+
+	if (!enabled)
+		return NULL;
+
+	pthread_rwlock_rdlock(&lock);
+	__sync_fetch_and_add(&n_lookups, 1);
+	if ((e = find_entry(id, id_len, hash)) == NULL)
+	{
+		pthread_rwlock_unlock(&lock);
+		return NULL;
+	}
+	__sync_fetch_and_add(&n_hits, 1);
+	__sync_fetch_and_add(&n_hit_bytes, e->size);
+	*size = e->size;
+	*expires = e->expires;
+	return map + e->off + e->id_len;
+}
+
+/*
+ * The content disk_get found is copied, the file may change again
+ */
+void disk_release(void)
+{
+	pthread_rwlock_unlock(&lock);
+	return;
+}
+
+/*
+ * Append an object evicted from memory to the log, its head_size
+ * bytes of content and then body_size bytes of body. If known, the
+ * object was read from the disk before and is only written again
+ * if its segment was reclaimed since.
+ */
+void disk_put(char *id, size_t id_len, unsigned long long hash,
+			  char *content, unsigned int head_size, char *body, 
+			  unsigned int body_size, time_t expires, int known)
+{
+	struct iovec iov[3];
+	disk_entry *e;
+	unsigned int size = head_size + body_size;
+	size_t len = id_len + size;
+
+	if (!enabled)
+		return;
+
+	pthread_rwlock_wrlock(&lock);
+
+	/* it may have been revalidated since, keep its new expiry */
+	if (known && (e = find_entry(id, id_len, hash)) != NULL)
+	{
+		e->expires = expires;
+		pthread_rwlock_unlock(&lock);
+		return;
+	}
+
+	/* an id too long for a segment can not be kept */
+	if (len > seg_size)
+	{
+		n_skips++;
+		pthread_rwlock_unlock(&lock);
+		return;
+	}
+
+	/* the rest of the segment is too small, go on to the oldest one */
+	if (seg_size - cur_off < len)
+	{
+		cur = (cur + 1) % DISK_SEGMENTS;
+		cur_off = 0;
+		reclaim_segment(cur);
+	}
+
+	iov[0].iov_base = id;
+	iov[0].iov_len = id_len;
+	iov[1].iov_base = content;
+	iov[1].iov_len = head_size;
+	iov[2].iov_base = body;
+	iov[2].iov_len = body_size;
+	if (pwritev(fd, iov, 3, cur * seg_size + cur_off) != (ssize_t)len)
+	{
+		n_skips++;
+		pthread_rwlock_unlock(&lock);
+		return;
+	}
+
+	/* the newer object wins, an older one stays as dead space */
+	if ((e = find_entry(id, id_len, hash)) != NULL)
+		unlink_entry(e);
+	else if ((e = (disk_entry *)malloc(sizeof(disk_entry))) == NULL)
+	{
+		pthread_rwlock_unlock(&lock);
+		return;
+	}
+	else
+	{
+		e->hash = hash;
+		e->next = buckets[hash & (nbuckets - 1)];
+		buckets[hash & (nbuckets - 1)] = e;
+		n_entries++;
+	}
+	e->off = cur * seg_size + cur_off;
+	e->id_len = id_len;
+	e->size = size;
+	e->expires = expires;
+	e->seg = cur;
+	e->snext = segs[cur];
+	e->sprev = &segs[cur];
+	if (segs[cur] != NULL)
+		segs[cur]->sprev = &e->snext;
+	segs[cur] = e;
+
+	cur_off += len;
+	n_bytes += size;
+	n_writes++;
+	n_write_bytes += len;
+	pthread_rwlock_unlock(&lock);
+	return;
+}
+
+/*
+ * Print the counters of the disk tier
+ */
+void disk_stats(FILE *fp)
+{
+	if (!enabled)
+		return;
+
+	pthread_rwlock_rdlock(&lock);
+	fprintf(fp, "disk: %lu lookups, %lu hits (%.1f%%), %llu bytes read, "
+			"%lu objects of %llu bytes on a %lu byte log, %lu writes of "
+			"%llu bytes, %lu not written, %lu segments reclaimed with "
+			"%lu objects\n",
+			n_lookups, n_hits, n_lookups ? 100.0 * n_hits / n_lookups : 0.0,
+			n_hit_bytes, n_entries, n_bytes,
+			(unsigned long)(seg_size * DISK_SEGMENTS), n_writes,
+			n_write_bytes, n_skips, n_reclaims, n_dropped);
+	pthread_rwlock_unlock(&lock);
+	return;
+}
+
+/*
+ * Find the entry of id in the index. Must hold the lock.
+ */
+static disk_entry *find_entry(char *id, size_t id_len,
+							  unsigned long long hash)
+{
+	disk_entry *e;
+
+	/* the id is compared where it is in the file */
+	for (e = buckets[hash & (nbuckets - 1)]; e != NULL; e = e->next)
+	{
+		if (e->hash == hash && e->id_len == id_len &&
+			!memcmp(map + e->off, id, id_len))
+			return e;
+	}
+	return NULL;
+}
+
+/*
+ * Take an entry off the list of its segment. Must hold the lock
+ * as writer.
+ */
+static void unlink_entry(disk_entry *e)
+{
+	*e->sprev = e->snext;
+	if (e->snext != NULL)
+		e->snext->sprev = e->sprev;
+	n_bytes -= e->size;
+	return;
+}
+
+/*
+ * Drop every object of a segment from the index before it is
+ * written again. Must hold the lock as writer.
+ */
+static void reclaim_segment(int seg)
+{
+	disk_entry *e, **pp;
+
+	if (segs[seg] != NULL)
+		n_reclaims++;
+	while ((e = segs[seg]) != NULL)
+	{
+		unlink_entry(e);
+		for (pp = &buckets[e->hash & (nbuckets - 1)]; *pp != e;
+			 pp = &(*pp)->next)
+			;
+		*pp = e->next;
+		free(e);
+		n_entries--;
+		n_dropped++;
+	}
+	return;
+}
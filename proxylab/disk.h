@@ -0,0 +1,27 @@
+/*
+ * disk.h -- Declaration of the disk tier of the cache
+ *			 for 15-213 proxy lab
+ *
+ * Team Member1: Cheng Zhang, Andrew ID: chengzh1
+ * Team Member2: Zhe Qian, Andrew ID: zheq
+ *
+ */
+
+#ifndef DISK_H
+#define DISK_H
+
+#include <stdio.h>
+#include <time.h>
+
+/* Declaration of some method that is used in proxy.c and cache.c */
+int disk_init(char *path, size_t size, size_t object_size);
+int disk_enabled(void);
+char *disk_get(char *id, size_t id_len, unsigned long long hash,
+			   unsigned int *size, time_t *expires);
+void disk_release(void);
+void disk_put(char *id, size_t id_len, unsigned long long hash,
+			  char *content, unsigned int head_size, char *body, 
+			  unsigned int body_size, time_t expires, int known);
+void disk_stats(FILE *fp);
+
+#endif
@@ -0,0 +1,265 @@
+/*
+ * dns.c -- DNS resolution cache for the 15-213 proxy lab
+ *
+ * Team Member1: Cheng Zhang, Andrew ID: chengzh1
+ * Team Member2: Zhe Qian, Andrew ID: zheq
+ *
+ * Overview of the DNS cache:
+ *	Every connection to a server used to start with getaddrinfo(),
+ *	so the resolver latency was paid on each cache miss. Here the
+ *	IPv4 addresses of a name are kept in a hash table for ttl
+ *	seconds. getaddrinfo() does not tell the TTL of the records,
+ *	so one fixed ttl is used for all names. A name that failed to
+ *	resolve is remembered as well, for a shorter time, so a bad
+ *	host does not hit the resolver on every request.
+ *
+ *	Only one thread resolves a given name at a time: an entry
+ *	being resolved is marked, and the other threads that look it
+ *	up wait on the semaphore of the entry until the answer is in.
+ *	The lock of the table is never held while resolving.
+ */
+
+#include "csapp.h"
+#include "dns.h"
+
+#define DNS_BUCKETS 256
+#define DNS_NEG_TTL 5			/* seconds a failed name is remembered */
+#define DNS_MAX_ENTRIES 4096	/* expired entries are dropped beyond it */
+
+/* Definition of the cached addresses of a name */
+typedef struct dns_entry
+{
+	char *name;
+	int naddrs;					/* -1 if the name did not resolve */
+	struct in_addr addrs[DNS_MAX_ADDRS];
+	time_t expires;
+	int resolving;				/* a thread is resolving the name */
+	int nwaiters;				/* threads waiting for it on done */
+	sem_t done;
+	struct dns_entry *next;
+}dns_entry;
+
+static dns_entry *buckets[DNS_BUCKETS];
+static int nentries;
+static int enabled;
+static int pos_ttl;
+static int neg_ttl;
+static sem_t sem;
+
+/* Counters, protected by sem */
+static unsigned long n_lookups;
+static unsigned long n_hits;
+static unsigned long n_neg_hits;
+static unsigned long n_waits;
+static unsigned long n_resolves;
+static unsigned long long resolve_usecs;
+
+static int resolve(char *host, struct in_addr *addrs, int max);
+static dns_entry *find_entry(char *host);
+static void sweep_entries(time_t now);
+
+
+/*
+ * Initialize the DNS cache, names are kept for ttl seconds,
+ * ttl == 0 still collapses concurrent lookups but keeps nothing
+ */
+void dns_init(int ttl)
+{
+	pos_ttl = ttl;
+	neg_ttl = ttl < DNS_NEG_TTL ? ttl : DNS_NEG_TTL;
+	Sem_init(&sem, 0, 1);
+	enabled = 1;
+	return;
+}
+
+/*
+ * Find up to max IPv4 addresses of host, return
+ * how many were found or -1 if it did not resolve
+ */
+int dns_lookup(char *host, struct in_addr *addrs, int max)
+{
+	struct timeval start, end;
+	struct in_addr found[DNS_MAX_ADDRS];
+	dns_entry *e;
+	time_t now;
+	int i, n, waited = 0;
+
+	/* Not set up, ask the resolver directly */
+	if (!enabled)
+		return resolve(host, addrs, max);
+
+	P(&sem);
+	n_lookups++;
+	if ((e = find_entry(host)) == NULL)
+	{
+		V(&sem);
+		return resolve(host, addrs, max);
+	}
+
+	/* Somebody is resolving the name already, wait for the answer */
+	if (e->resolving)
+	{
+		n_waits++;
+		waited = 1;
+	}
+	while (e->resolving)
+	{
+		/* 
+		 * nwaiters also keeps the entry from being swept, 
+		 * a spare wake up only means one more round here
+		 */
+		e->nwaiters++;
+		V(&sem);
+		P(&e->done);
+		P(&sem);
+		e->nwaiters--;
+	}
+
+	/* The answer we waited for is good even if it is not kept */
+	now = time(NULL);
+	if (e->expires > now || waited)
+	{
+		if (!waited && e->naddrs < 0)
+			n_neg_hits++;
+		else if (!waited)
+			n_hits++;
+		n = e->naddrs < max ? e->naddrs : max;
+		if (n > 0)
+			memcpy(addrs, e->addrs, n * sizeof(struct in_addr));
+		V(&sem);
+		return n;
+	}
+
+	/* Missing or expired, resolve it without holding the lock */
+	e->resolving = 1;
+	V(&sem);
+
+	gettimeofday(&start, NULL);
+	n = resolve(host, found, DNS_MAX_ADDRS);
+	gettimeofday(&end, NULL);
+
+	P(&sem);
+	n_resolves++;
+	resolve_usecs += (end.tv_sec - start.tv_sec) * 1000000LL +
+					 (end.tv_usec - start.tv_usec);
+	e->naddrs = n;
+	if (n > 0)
+		memcpy(e->addrs, found, n * sizeof(struct in_addr));
+	e->expires = now + (n > 0 ? pos_ttl : neg_ttl);
+	e->resolving = 0;
+	for (i = 0; i < e->nwaiters; i++)
+		V(&e->done);
+	V(&sem);
+
+	n = n < max ? n : max;
+	if (n > 0)
+		memcpy(addrs, found, n * sizeof(struct in_addr));
+	return n;
+}
+
+/*
+ * Print the counters of the DNS cache
+ */
+void dns_stats(FILE *fp)
+{
+	double avg, rate;
+
+	if (!enabled)
+		return;
+
+	P(&sem);
+	avg = n_resolves ? (double)resolve_usecs / n_resolves : 0;
+	rate = n_lookups ? 100.0 * (n_hits + n_neg_hits) / n_lookups : 0;
+	fprintf(fp, "dns: %lu lookups, %lu hits, %lu negative hits (%.1f%%), "
+			"%lu waited on a lookup, %lu resolved, avg resolve %.0f us, "
+			"about %.1f ms of resolver time saved\n",
+			n_lookups, n_hits, n_neg_hits, rate, n_waits, n_resolves, avg,
+			avg * (n_hits + n_neg_hits + n_waits) / 1000);
+	V(&sem);
+	return;
+}
+
+/*
+ * Ask the resolver for the IPv4 addresses of host
+ */
+static int resolve(char *host, struct in_addr *addrs, int max)
+{
+	struct addrinfo hints, *addlist, *p;
+	int n = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, NULL, &hints, &addlist) != 0)
+		return -1;
+
+	for (p = addlist; p != NULL && n < max; p = p->ai_next)
+		addrs[n++] = ((struct sockaddr_in *)p->ai_addr)->sin_addr;
+	freeaddrinfo(addlist);
+	return n > 0 ? n : -1;
+}
+
+/*
+ * Find the entry of host in the hash table, create
+ * an expired one if there is none. Must hold sem.
+ */
+static dns_entry *find_entry(char *host)
+{
+	unsigned int h = 2166136261u;
+	dns_entry *e;
+	char *p;
+
+	/* FNV-1a over the host name, names are case-insensitive */
+	for (p = host; *p; p++)
+		h = (h ^ (unsigned char)tolower(*p)) * 16777619u;
+	h %= DNS_BUCKETS;
+
+	for (e = buckets[h]; e != NULL; e = e->next)
+	{
+		if (!strcasecmp(e->name, host))
+			return e;
+	}
+
+	if (nentries >= DNS_MAX_ENTRIES)
+		sweep_entries(time(NULL));
+
+	if ((e = calloc(1, sizeof(dns_entry))) == NULL)
+		return NULL;
+	if ((e->name = strdup(host)) == NULL)
+	{
+		free(e);
+		return NULL;
+	}
+	Sem_init(&e->done, 0, 0);
+	e->next = buckets[h];
+	buckets[h] = e;
+	nentries++;
+	return e;
+}
+
+/*
+ * Drop the expired entries nobody is using. Must hold sem.
+ */
+static void sweep_entries(time_t now)
+{
+	dns_entry **pp, *e;
+	int i;
+
+	for (i = 0; i < DNS_BUCKETS; i++)
+	{
+		for (pp = &buckets[i]; (e = *pp) != NULL; )
+		{
+			if (e->expires <= now && !e->resolving && !e->nwaiters)
+			{
+				*pp = e->next;
+				sem_destroy(&e->done);
+				free(e->name);
+				free(e);
+				nentries--;
+			}
+			else
+				pp = &e->next;
+		}
+	}
+	return;
+}
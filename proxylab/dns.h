@@ -0,0 +1,24 @@
+/*
+ * dns.h -- Declaration of the DNS resolution cache
+ *			for 15-213 proxy lab
+ *
+ * Team Member1: Cheng Zhang, Andrew ID: chengzh1
+ * Team Member2: Zhe Qian, Andrew ID: zheq
+ *
+ */
+
+#ifndef DNS_H
+#define DNS_H
+
+#include <stdio.h>
+#include <netinet/in.h>
+
+/* Most addresses kept for one name */
+#define DNS_MAX_ADDRS 4
+
+/* Declaration of some method that is used in proxy.c and csapp.c */
+void dns_init(int ttl);
+int dns_lookup(char *host, struct in_addr *addrs, int max);
+void dns_stats(FILE *fp);
+
+#endif
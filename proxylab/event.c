@@ -0,0 +1,1438 @@
+/*
+ * event.c -- Event-driven engine for the 15-213 proxy lab
+ *
+ * Team Member1: Cheng Zhang, Andrew ID: chengzh1
+ * Team Member2: Zhe Qian, Andrew ID: zheq
+ *
+ * Overview of the engine:
+ *	Instead of parking one thread on each connection, N event
+ *	loop threads share the listening socket, and each of them 
+ *	drives its own connections with epoll. All the sockets are
+ *	non-blocking, and every connection is a small state machine:
+ *
+ *	  ST_READ_REQ -> cache lookup -> ST_CONNECT -> ST_SEND_REQ 
+ *	    ^         -> ST_RECV_HEAD -> ST_RELAY_BODY -> cache fill
+ *	    |         \-> (hit or error) ST_WRITE               |
+ *	    \--------------- keep-alive ------------------------/
+ *
+ *	A step runs until the socket it needs would block, then the
+ *	connection registers interest in exactly that socket and goes
+ *	back to the loop. An idle connection only owns its ev_conn, the
+ *	request and relay buffers are allocated while a request is in 
+ *	progress and freed right after, so the memory footprint stays 
+ *	flat with many mostly-idle clients.
+ *
+ *	Connections waiting for a request sit on the idle list of 
+ *	their loop, oldest first, so the ones that timed out are 
+ *	found at the head without scanning all the connections.
+ *	Pipelined requests stay in the input buffer, or in the socket,
+ *	until the response before them is done.
+ *
+ *	A server connection that stays open after a complete response
+ *	is removed from the epoll set and handed to the pool, a later
+ *	miss on the same host picks it up in start_request. If such a
+ *	reused connection turns out to be closed before any response 
+ *	byte came back, the request is sent again on a fresh one.
+ *
+ *	A miss on an object that another connection is fetching already
+ *	parks the connection in ST_WAIT_FILL, with none of its sockets
+ *	in the epoll set. When the fetch is done, the fetcher, which may
+ *	run on another loop, queues the connection on the wake list of 
+ *	its loop and signals the eventfd of that loop.
+ *
+ *	A stale object is fetched like a missing one, but the request 
+ *	carries its validators. If the server answers 304 the object
+ *	is refreshed and sent as a hit once the 304 is read.
+ *
+ *	With a cache per loop, a loop owns the objects whose urls hash
+ *	to its cache, and only that loop ever touches them. A request
+ *	read by another loop moves its connection to the owner in 
+ *	ST_MOVE: the reader takes the client socket out of its epoll set
+ *	and puts the connection on the ring from itself to the owner.
+ *	There is a ring for each pair of loops, with one writer and one
+ *	reader, so it needs no lock. Once per pass the reader signals 
+ *	the eventfd of the loops it moved connections to, and a loop
+ *	drains its rings with its wake list. A full ring falls back to
+ *	the wake list. The connection stays with the owner until one of
+ *	its requests belongs to another loop.
+ */
+
+#define _GNU_SOURCE
+#include "csapp.h"
+#include <stdint.h>
+#include <time.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include "cache.h"
+#include "http.h"
+#include "event.h"
+#include "pool.h"
+
+#define MAXEVENTS 256
+#define RELAY_BUFSIZE MAX_RESP_HDRS
+#define CONTENT_MINSIZE 16384
+#define MOVE_RING 256		/* connections on their way between two loops */
+
+/* States of a client connection */
+enum
+{
+	ST_READ_REQ,		/* reading the request headers of the client */
+	ST_CONNECT,			/* waiting for connect() to the server */
+	ST_SEND_REQ,		/* sending the request to the server */
+	ST_RECV_HEAD,		/* reading the response headers of the server */
+	ST_RELAY_BODY,		/* relaying the response body to the client */
+	ST_WRITE,			/* writing a cached response or an error page */
+	ST_WAIT_FILL,		/* waiting for another fetch of the object */
+	ST_MOVE				/* handed to the loop that owns the object */
+};
+
+struct ev_conn;
+
+/* Definition of an event loop */
+typedef struct
+{
+	int index;
+	int epfd;
+	int listenfd;
+	cache_list *cache;			/* its own, or the one of all loops */
+	struct ev_conn *idle_head;	/* connections waiting for a request, */
+	struct ev_conn *idle_tail;	/* the oldest one first */
+	int wake_fd;				/* eventfd, signaled when wake_head is set */
+	sem_t wake_lock;
+	struct ev_conn *wake_head;	/* woken connections, filled by any loop */
+	char *notify;				/* loops to signal, moved connections to */
+
+	/* requests for the cache read here, written by the loop only */
+	unsigned long n_local;		/* looked up here */
+	unsigned long n_moved;		/* moved to their owner on a ring */
+	unsigned long n_spilled;	/* moved on the wake list, the ring was full */
+}ev_loop;
+
+/* 
+ * Definition of a ring moving connections from one loop to another,
+ * the sender writes tail and the receiver head, on lines of their own
+ */
+typedef struct
+{
+	unsigned int head;			/* next slot to take */
+	char pad1[60];
+	unsigned int tail;			/* next slot to fill */
+	char pad2[60];
+	struct ev_conn *slots[MOVE_RING];
+}ev_ring;
+
+/* Definition of a client connection */
+typedef struct ev_conn
+{
+	int state;
+	int cfd;					/* client socket */
+	int sfd;					/* server socket, -1 if none */
+	unsigned int cev;			/* events registered for cfd, 0 if none */
+	unsigned int sev;			/* events registered for sfd, 0 if none */
+	ev_loop *lp;
+	int keep_alive;
+	int gzip;					/* the client takes a gzip body */
+
+	char *host;					/* server of the request in progress */
+	int port;
+	int reused;					/* sfd came from the pool */
+	struct timespec conn_start;	/* when the fresh connect began */
+
+	cache_waiter waiter;		/* waits for a fetch of another connection */
+	int fetching;				/* the request owns the cache fill */
+	int waited;					/* the request waited for a fill once */
+	struct ev_conn *wake_next;
+
+	int idle;					/* on the idle list of the loop */
+	time_t last_active;
+	struct ev_conn *idle_prev;
+	struct ev_conn *idle_next;
+
+	char *in;					/* request bytes read from the client */
+	size_t in_len;
+
+	char *request;				/* request for the server */
+	size_t req_len;
+	char *key;					/* cache id, NULL if not for the cache */
+	size_t key_len;				/* of the url at the start of key */
+	size_t req_off;
+	char *cond;					/* request made conditional, sent instead */
+	size_t cond_len;
+	cache_block *stale;			/* stale object the request revalidates */
+
+	struct iovec out[4];		/* bytes waiting to go to the client */
+	int out_idx;
+	int out_cnt;
+	char *out_mem;				/* malloced memory behind out */
+	cache_block *hit;			/* cached object behind out */
+
+	char *hdrs;					/* response headers read so far */
+	size_t hdrs_len;
+	char *head;					/* response headers without hop-by-hop */
+	size_t head_len;
+	http_response resp;
+	http_chunked chunked;
+	unsigned long long left;	/* body bytes left with Content-Length */
+	int body_done;
+
+	char *buf;					/* relay buffer */
+	char *content;				/* copy of the body for the cache */
+	unsigned int total;
+	unsigned int content_cap;
+	int fit_size;
+	int admit;					/* the cache takes the object if it fits */
+}ev_conn;
+
+static ev_loop *loops;
+static int nloops;
+static ev_ring *rings;			/* ring i * nloops + j goes from i to j */
+static int idle_timeout;
+
+static void *loop_thread(void *vargp);
+static void accept_conns(ev_loop *lp);
+static void wake_conn(void *arg);
+static void run_woken(ev_loop *lp);
+static int move_conn(ev_conn *c, ev_loop *to);
+static void run_moved(ev_loop *lp);
+static void notify_moved(ev_loop *lp);
+static void conn_run(ev_conn *c);
+static void conn_close(ev_conn *c);
+static void conn_watch(ev_conn *c, unsigned int cev, unsigned int sev);
+static void idle_enter(ev_conn *c);
+static void idle_leave(ev_conn *c);
+static void idle_sweep(ev_loop *lp);
+static int read_request(ev_conn *c);
+static int start_request(ev_conn *c, char *end);
+static int lookup_request(ev_conn *c);
+static cache_block *lookup_object(ev_conn *c);
+static int serve_object(ev_conn *c, cache_block *cb);
+static int connect_server(ev_conn *c);
+static int retry_request(ev_conn *c);
+static int check_connect(ev_conn *c);
+static int send_request(ev_conn *c);
+static int recv_head(ev_conn *c);
+static int revalidated(ev_conn *c, size_t extra);
+static int relay_body(ev_conn *c);
+static size_t feed_body(ev_conn *c, char *data, size_t n);
+static int save_content(ev_conn *c, char *data, size_t n);
+static int finish_response(ev_conn *c);
+static void cache_object(ev_conn *c, char *obj, size_t obj_len);
+static int response_done(ev_conn *c);
+static int write_out(ev_conn *c);
+static int send_write(ev_conn *c);
+static int send_error(ev_conn *c, char *cause, char *errnum, 
+				char *shortmsg, char *longmsg);
+
+/* The low bit of epoll data tells the server socket from the client */
+#define SERVER_TAG ((uintptr_t)1)
+
+
+/*
+ * Start n event loops on listenfd, never returns. With partitioned,
+ * cl is an array of a cache for each loop, else the cache of all.
+ */
+void event_run(int listenfd, int n, int timeout, cache_list *cl, 
+			   int partitioned)
+{
+	struct rlimit rl;
+	pthread_t tid;
+	int i;
+
+	nloops = n;
+	idle_timeout = timeout;
+
+	/* Every connection costs up to two descriptors, allow as many as we can */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+	{
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	if (fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK) < 0)
+		unix_error("fcntl error");
+
+	loops = Calloc(nloops, sizeof(ev_loop));
+	if (partitioned)
+		rings = Calloc(nloops * nloops, sizeof(ev_ring));
+	for (i = 0; i < nloops; i++)
+	{
+		struct epoll_event ev;
+
+		if ((loops[i].epfd = epoll_create1(0)) < 0)
+			unix_error("epoll_create1 error");
+		loops[i].index = i;
+		loops[i].listenfd = listenfd;
+		loops[i].cache = partitioned ? &cl[i] : cl;
+		loops[i].notify = Calloc(nloops, 1);
+
+		/* Wake only one loop per incoming connection */
+		ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+		ev.data.ptr = NULL;
+		if (epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+			unix_error("epoll_ctl error");
+
+		/* Other loops wake our connections through the eventfd */
+		if ((loops[i].wake_fd = eventfd(0, EFD_NONBLOCK)) < 0)
+			unix_error("eventfd error");
+		Sem_init(&loops[i].wake_lock, 0, 1);
+		ev.events = EPOLLIN;
+		ev.data.ptr = &loops[i];
+		if (epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, loops[i].wake_fd, &ev) < 0)
+			unix_error("epoll_ctl error");
+	}
+
+	for (i = 1; i < nloops; i++)
+		Pthread_create(&tid, NULL, loop_thread, &loops[i]);
+	loop_thread(&loops[0]);
+}
+
+/*
+ * Event loop, dispatch the ready sockets to their connections
+ */
+static void *loop_thread(void *vargp)
+{
+	ev_loop *lp = (ev_loop *)vargp;
+	struct epoll_event evs[MAXEVENTS];
+	ev_conn *c;
+	int i, n;
+
+	while (1)
+	{
+		/* wake up once a second to close the idle connections */
+		n = epoll_wait(lp->epfd, evs, MAXEVENTS, idle_timeout > 0 ? 1000 : -1);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			unix_error("epoll_wait error");
+		}
+
+		for (i = 0; i < n; i++)
+		{
+			if (evs[i].data.ptr == NULL)
+			{
+				accept_conns(lp);
+				continue;
+			}
+			if (evs[i].data.ptr == lp)
+			{
+				run_woken(lp);
+				continue;
+			}
+
+			c = (ev_conn *)((uintptr_t)evs[i].data.ptr & ~SERVER_TAG);
+
+			/* 
+			 * The client hung up while we were waiting 
+			 * on the server, nobody is left to answer
+			 */
+			if (!((uintptr_t)evs[i].data.ptr & SERVER_TAG) && 
+				(evs[i].events & (EPOLLERR | EPOLLHUP)) &&
+				c->state != ST_READ_REQ)
+			{
+				conn_close(c);
+				continue;
+			}
+			conn_run(c);
+		}
+
+		if (rings != NULL)
+			notify_moved(lp);
+		if (idle_timeout > 0)
+			idle_sweep(lp);
+	}
+	return NULL;
+}
+
+/*
+ * Accept all the pending connections on the listening socket
+ */
+static void accept_conns(ev_loop *lp)
+{
+	ev_conn *c;
+	int fd, one = 1;
+
+	while ((fd = accept4(lp->listenfd, NULL, NULL, SOCK_NONBLOCK)) >= 0)
+	{
+		if ((c = calloc(1, sizeof(ev_conn))) == NULL)
+		{
+			close(fd);
+			continue;
+		}
+
+		/* Our responses go out in pieces, do not let Nagle hold them */
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		c->state = ST_READ_REQ;
+		c->cfd = fd;
+		c->sfd = -1;
+		c->lp = lp;
+		conn_watch(c, EPOLLIN, 0);
+		idle_enter(c);
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		printf("accept error: %s\n", strerror(errno));
+	return;
+}
+
+/*
+ * A fetch this connection waited for is done, queue it on
+ * its loop, may be called from any loop
+ */
+static void wake_conn(void *arg)
+{
+	ev_conn *c = (ev_conn *)arg;
+	ev_loop *lp = c->lp;
+	uint64_t one = 1;
+
+	P(&lp->wake_lock);
+	c->wake_next = lp->wake_head;
+	lp->wake_head = c;
+	V(&lp->wake_lock);
+
+	if (write(lp->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		printf("eventfd write error: %s\n", strerror(errno));
+	return;
+}
+
+/*
+ * Resume the connections woken by wake_conn, and those moved here
+ */
+static void run_woken(ev_loop *lp)
+{
+	ev_conn *c, *next;
+	uint64_t n;
+
+	if (read(lp->wake_fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+		printf("eventfd read error: %s\n", strerror(errno));
+	if (rings != NULL)
+		run_moved(lp);
+
+	P(&lp->wake_lock);
+	c = lp->wake_head;
+	lp->wake_head = NULL;
+	V(&lp->wake_lock);
+
+	for (; c != NULL; c = next)
+	{
+		next = c->wake_next;
+		conn_run(c);
+	}
+	return;
+}
+
+/*
+ * Move a connection that read a request to the loop that owns its
+ * object, it is not run here any more
+ */
+static int move_conn(ev_conn *c, ev_loop *to)
+{
+	ev_ring *r = &rings[c->lp->index * nloops + to->index];
+	unsigned int tail = r->tail;
+	ev_loop *from = c->lp;
+
+	/* no events of ours for it, the owner watches its socket */
+	conn_watch(c, 0, 0);
+	c->state = ST_MOVE;
+	c->lp = to;
+
+	/* full, the receiver is far behind: take the locked way */
+	if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == MOVE_RING)
+	{
+		from->n_spilled++;
+		wake_conn(c);
+		return 0;
+	}
+
+	/* the connection is written before the slot is published */
+	r->slots[tail % MOVE_RING] = c;
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	from->notify[to->index] = 1;
+	from->n_moved++;
+	return 0;
+}
+
+/*
+ * Run the connections the other loops moved to this one
+ */
+static void run_moved(ev_loop *lp)
+{
+	unsigned int head, tail;
+	ev_conn *c;
+	ev_ring *r;
+	int i;
+
+	for (i = 0; i < nloops; i++)
+	{
+		r = &rings[i * nloops + lp->index];
+		head = r->head;
+		tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+		/* a slot is free again once it is read */
+		for (; head != tail; head++)
+		{
+			c = r->slots[head % MOVE_RING];
+			__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+			conn_run(c);
+		}
+	}
+	return;
+}
+
+/*
+ * Signal the loops this one moved connections to in its last pass,
+ * once each
+ */
+static void notify_moved(ev_loop *lp)
+{
+	uint64_t one = 1;
+	int i;
+
+	for (i = 0; i < nloops; i++)
+	{
+		if (!lp->notify[i])
+			continue;
+		lp->notify[i] = 0;
+		if (write(loops[i].wake_fd, &one, sizeof(one)) < 0 && 
+			errno != EAGAIN)
+			printf("eventfd write error: %s\n", strerror(errno));
+	}
+	return;
+}
+
+/*
+ * Print how the requests for the cache were spread over the loops
+ */
+void event_stats(FILE *fp)
+{
+	unsigned long local = 0, moved = 0, spilled = 0;
+	int i;
+
+	if (rings == NULL)
+		return;
+
+	for (i = 0; i < nloops; i++)
+	{
+		local += loops[i].n_local;
+		moved += loops[i].n_moved;
+		spilled += loops[i].n_spilled;
+	}
+	fprintf(fp, "event: %d loops with a cache each, %lu requests looked up "
+			"on the loop that read them, %lu moved to their owner on a "
+			"ring, %lu on the wake list as the ring was full\n",
+			nloops, local, moved, spilled);
+	return;
+}
+
+/*
+ * Run the state machine of a connection until it has 
+ * to wait for a socket, or until it is finished
+ */
+static void conn_run(ev_conn *c)
+{
+	int rc;
+
+	do
+	{
+		switch (c->state)
+		{
+		case ST_READ_REQ:
+			rc = read_request(c);
+			break;
+		case ST_CONNECT:
+			rc = check_connect(c);
+			break;
+		case ST_SEND_REQ:
+			rc = send_request(c);
+			break;
+		case ST_RECV_HEAD:
+			rc = recv_head(c);
+			break;
+		case ST_RELAY_BODY:
+			rc = relay_body(c);
+			break;
+		case ST_WAIT_FILL:
+			c->waited = 1;
+			rc = lookup_request(c);
+			break;
+		case ST_MOVE:
+			rc = lookup_request(c);
+			break;
+		default:
+			rc = send_write(c);
+			break;
+		}
+	} while (rc > 0);
+
+	if (rc < 0)
+		conn_close(c);
+	return;
+}
+
+/*
+ * Free what a request needs, keep the connection itself
+ */
+static void conn_reset(ev_conn *c)
+{
+	if (c->sfd >= 0)
+	{
+		/* closing a descriptor also removes it from the epoll set */
+		close(c->sfd);
+		c->sfd = -1;
+		c->sev = 0;
+	}
+
+	/* the waiters of our fetch read the cache or fetch on their own */
+	if (c->fetching)
+	{
+		cache_fill_end(c->lp->cache, c->key);
+		c->fetching = 0;
+	}
+	c->waited = 0;
+
+	if (c->hit != NULL)
+	{
+		cache_release(c->hit);
+		c->hit = NULL;
+	}
+	if (c->stale != NULL)
+	{
+		cache_release(c->stale);
+		c->stale = NULL;
+	}
+
+	free(c->host);
+	free(c->request);
+	free(c->key);
+	free(c->out_mem);
+	free(c->hdrs);
+	free(c->head);
+	free(c->buf);
+	free(c->content);
+	free(c->cond);
+	c->host = c->request = c->out_mem = c->hdrs = c->head = c->buf = c->content = NULL;
+	c->cond = c->key = NULL;
+	c->out_idx = c->out_cnt = 0;
+	c->hdrs_len = c->head_len = 0;
+	c->total = c->content_cap = 0;
+	return;
+}
+
+/*
+ * Close both sockets of a connection and free it
+ */
+static void conn_close(ev_conn *c)
+{
+	idle_leave(c);
+	conn_reset(c);
+	close(c->cfd);
+	free(c->in);
+	free(c);
+	return;
+}
+
+/*
+ * Register interest in cev on the client socket and sev on the 
+ * server socket. A socket we are not interested in is removed from
+ * the epoll set, so its hang up can not wake the loop over and over.
+ */
+static void conn_watch(ev_conn *c, unsigned int cev, unsigned int sev)
+{
+	struct epoll_event ev;
+	int op;
+
+	if (cev != c->cev)
+	{
+		op = !c->cev ? EPOLL_CTL_ADD : (!cev ? EPOLL_CTL_DEL : EPOLL_CTL_MOD);
+		ev.events = cev;
+		ev.data.ptr = c;
+		if (epoll_ctl(c->lp->epfd, op, c->cfd, &ev) < 0)
+			printf("epoll_ctl error: %s\n", strerror(errno));
+		c->cev = cev;
+	}
+
+	if (sev != c->sev && c->sfd >= 0)
+	{
+		op = !c->sev ? EPOLL_CTL_ADD : (!sev ? EPOLL_CTL_DEL : EPOLL_CTL_MOD);
+		ev.events = sev;
+		ev.data.ptr = (void *)((uintptr_t)c | SERVER_TAG);
+		if (epoll_ctl(c->lp->epfd, op, c->sfd, &ev) < 0)
+			printf("epoll_ctl error: %s\n", strerror(errno));
+		c->sev = sev;
+	}
+	return;
+}
+
+/*
+ * Put a connection at the tail of the idle list of its loop
+ */
+static void idle_enter(ev_conn *c)
+{
+	ev_loop *lp = c->lp;
+
+	c->last_active = time(NULL);
+	c->idle = 1;
+	c->idle_next = NULL;
+	c->idle_prev = lp->idle_tail;
+	if (lp->idle_tail)
+		lp->idle_tail->idle_next = c;
+	else
+		lp->idle_head = c;
+	lp->idle_tail = c;
+	return;
+}
+
+/*
+ * Take a connection off the idle list of its loop
+ */
+static void idle_leave(ev_conn *c)
+{
+	ev_loop *lp = c->lp;
+
+	if (!c->idle)
+		return;
+
+	if (c->idle_prev)
+		c->idle_prev->idle_next = c->idle_next;
+	else
+		lp->idle_head = c->idle_next;
+	if (c->idle_next)
+		c->idle_next->idle_prev = c->idle_prev;
+	else
+		lp->idle_tail = c->idle_prev;
+	c->idle = 0;
+	return;
+}
+
+/*
+ * Close the connections that have been idle for too long
+ */
+static void idle_sweep(ev_loop *lp)
+{
+	time_t now = time(NULL);
+
+	while (lp->idle_head && now - lp->idle_head->last_active >= idle_timeout)
+		conn_close(lp->idle_head);
+	return;
+}
+
+/*
+ * The return value of the state functions below:
+ *	1 - made progress, run the next step
+ *	0 - waiting for a socket, interest is registered
+ *	-1 - done or failed, close the connection
+ */
+
+/*
+ * Read the request headers of the client
+ */
+static int read_request(ev_conn *c)
+{
+	char *end;
+	ssize_t n;
+
+	/* A pipelined request may be complete already */
+	if (c->in && (end = http_hdrs_end(c->in, c->in_len)) != NULL)
+		return start_request(c, end);
+
+	if (c->in == NULL && (c->in = malloc(MAX_REQ_HDRS)) == NULL)
+		return -1;
+
+	n = read(c->cfd, c->in + c->in_len, MAX_REQ_HDRS - 1 - c->in_len);
+	if (n < 0)
+	{
+		if (errno == EINTR)
+			return 1;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+
+		/* nothing buffered, do not hold the buffer while idle */
+		if (c->in_len == 0)
+		{
+			free(c->in);
+			c->in = NULL;
+		}
+		conn_watch(c, EPOLLIN, 0);
+		return 0;
+	}
+	if (n == 0)
+		return -1;
+	c->in_len += n;
+
+	/* activity moves the connection to the tail of the idle list */
+	idle_leave(c);
+	idle_enter(c);
+
+	/* request headers are too large */
+	if (http_hdrs_end(c->in, c->in_len) == NULL &&
+		c->in_len == MAX_REQ_HDRS - 1)
+		return -1;
+	return 1;
+}
+
+/*
+ * The request headers end at end: rewrite the request
+ * and look it up
+ */
+static int start_request(ev_conn *c, char *end)
+{
+	http_request req;
+	struct iovec iov[HTTP_REQ_IOV];
+	ev_loop *owner;
+	int niov, rc;
+
+	idle_leave(c);
+	rc = http_parse_request(c->in, end - c->in, &req);
+	if (rc < 0)
+		return -1;
+	c->keep_alive = idle_timeout > 0 ? req.keep_alive : 0;
+	c->gzip = req.gzip;
+
+	/* 
+	 * Flatten the request for the server into a buffer of its own
+	 * before the slices of c->in move. The cache id is the url, a
+	 * request with credentials has none and skips the cache.
+	 */
+	if (rc > 0)
+	{
+		niov = http_request_iov(&req, iov);
+		if ((c->request = malloc(req.len + 1)) == NULL ||
+			http_flatten(iov, niov, c->request, req.len + 1) < 0 ||
+			(c->host = strdup(req.host)) == NULL ||
+			(c->key = malloc(HTTP_MAX_KEY)) == NULL)
+			return -1;
+		c->req_len = req.len;
+		c->req_off = 0;
+		c->port = req.port;
+		if ((c->key_len = http_cache_key(&req, c->key, HTTP_MAX_KEY)) == 0)
+		{
+			free(c->key);
+			c->key = NULL;
+		}
+	}
+
+	/* Keep the pipelined bytes after this request for the next one */
+	c->in_len -= end - c->in;
+	memmove(c->in, end, c->in_len);
+
+	if (rc == 0)
+		return send_error(c, "method", "501", "Not Implemented",
+				"Proxy does not implement this method");
+
+	/* With a cache per loop, the loop owning the url looks it up */
+	if (rings != NULL && c->key != NULL)
+	{
+		owner = &loops[cache_partition(c->key, nloops)];
+		if (owner != c->lp)
+			return move_conn(c, owner);
+		c->lp->n_local++;
+	}
+	return lookup_request(c);
+}
+
+/*
+ * Serve the request from the cache, or wait for the fetch of 
+ * another connection, or start a fetch from the server
+ */
+static int lookup_request(ev_conn *c)
+{
+	cache_block *hit = NULL;
+	size_t len;
+	int fill;
+
+	/* First: read in cache, a stale object is kept to revalidate */
+	while (c->key != NULL && 
+		   ((hit = lookup_object(c)) == NULL || !cache_fresh(hit)))
+	{
+		if (c->stale != NULL)
+			cache_release(c->stale);
+		c->stale = hit;
+		if (c->waited)
+			break;
+
+		c->waiter.wake = wake_conn;
+		c->waiter.arg = c;
+		fill = cache_fill_begin(c->lp->cache, c->key, &c->waiter);
+		if (fill == FILL_FETCH)
+		{
+			c->fetching = 1;
+			break;
+		}
+		if (fill == FILL_WAIT)
+		{
+			c->state = ST_WAIT_FILL;
+			conn_watch(c, 0, 0);
+			return 0;
+		}
+	}
+
+	if (hit != NULL && cache_fresh(hit))
+		return serve_object(c, hit);
+
+	/* 
+	 * Cache miss: reuse a pooled connection or connect to the server.
+	 * A stale object was cached before, it is taken again if it has
+	 * changed, and without validators it can only be fetched again.
+	 */
+	if (c->stale != NULL)
+	{
+		c->admit = 1;
+		len = c->req_len + 2 * MAXLINE;
+		if ((c->cond = malloc(len)) == NULL)
+			return -1;
+		if ((c->cond_len = http_revalidate(c->request, c->req_len, 
+						c->stale->content, c->stale->head_size, c->cond, 
+						len)) == 0)
+		{
+			free(c->cond);
+			c->cond = NULL;
+			cache_release(c->stale);
+			c->stale = NULL;
+		}
+	}
+	else
+		c->admit = c->key != NULL ? cache_admit(c->lp->cache, c->key) : 0;
+	if ((c->sfd = pool_get(c->host, c->port)) >= 0)
+	{
+		c->reused = 1;
+		c->state = ST_SEND_REQ;
+		return 1;
+	}
+	return connect_server(c);
+}
+
+/*
+ * Look up the object of the request. If a Vary marker is cached
+ * under its url, the headers it names are added to c->key from the
+ * request and the variant of this request is looked up, c->key is
+ * its id afterwards.
+ */
+static cache_block *lookup_object(ev_conn *c)
+{
+	cache_block *cb;
+	const char *vary;
+	int len;
+
+	c->key[c->key_len] = '\0';
+	cb = read_cache(c->lp->cache, c->key);
+	if (cb != NULL && (vary = http_vary(cb->content, cb->head_size)))
+	{
+		len = http_vary_key(c->request, c->req_len, vary, c->key, 
+							c->key_len, HTTP_MAX_KEY);
+		cache_release(cb);
+		cb = len > 0 ? read_cache(c->lp->cache, c->key) : NULL;
+	}
+	return cb;
+}
+
+/*
+ * Send a cached object to the client, its shared body if it has 
+ * one after the rest of its content. A gzip body is sent as it is
+ * if the client takes gzip, else decompressed into c->out_mem. The
+ * reference on it is dropped in conn_reset once it is written.
+ */
+static int serve_object(ev_conn *c, cache_block *cb)
+{
+	size_t head_len, len;
+	const char *conn_hdr;
+
+	c->hit = cb;
+	head_len = http_object_head(cb->content, cb->head_size);
+	if (head_len == cb->block_size)
+	{
+		c->keep_alive = 0;
+		c->out[0].iov_base = cb->content;
+		c->out[0].iov_len = cb->block_size;
+		c->out_cnt = 1;
+	}
+	else
+	{
+		conn_hdr = http_conn_hdr(c->keep_alive);
+		c->out[0].iov_base = cb->content;
+		c->out[0].iov_len = head_len;
+		c->out[1].iov_base = (char *)conn_hdr;
+		c->out[1].iov_len = strlen(conn_hdr);
+		c->out[2].iov_base = cb->content + head_len + 2;
+		c->out[2].iov_len = cb->head_size - head_len - 2;
+		c->out[3].iov_base = cb->body != NULL ? cb->body->data : NULL;
+		c->out[3].iov_len = cb->block_size - cb->head_size;
+		c->out_cnt = 4;
+	}
+
+	if (cb->body != NULL && cb->body->zsize > 0)
+	{
+		len = cb->head_size + MAXLINE;
+		if ((c->out_mem = malloc(len > cb->body->size ? len : 
+								 cb->body->size)) == NULL)
+			return -1;
+		if (c->gzip && (len = http_gzip_head(cb->content, head_len, 
+								cb->body->zsize, c->out_mem, len)) > 0)
+		{
+			c->out[0].iov_base = c->out_mem;
+			c->out[0].iov_len = len;
+			c->out[3].iov_len = cb->body->zsize;
+			cache_gzip_hit(cb);
+		}
+		else if (cache_inflate(cb, c->out_mem) == 0)
+			c->out[3].iov_base = c->out_mem;
+		else
+			return -1;
+	}
+	c->out_idx = 0;
+	c->state = ST_WRITE;
+	return 1;
+}
+
+/*
+ * Start a non-blocking connect to the server of the request
+ */
+static int connect_server(ev_conn *c)
+{
+	c->reused = 0;
+	clock_gettime(CLOCK_MONOTONIC, &c->conn_start);
+	if ((c->sfd = open_clientfd_nb(c->host, c->port)) < 0)
+		return send_error(c, c->host, "404", "Not found",
+				"Proxy couldn't connect to this server");
+
+	c->state = ST_CONNECT;
+	conn_watch(c, 0, EPOLLOUT);
+	return 0;
+}
+
+/*
+ * A pooled connection was closed by the server before it answered,
+ * send the request again on a fresh connection
+ */
+static int retry_request(ev_conn *c)
+{
+	close(c->sfd);
+	c->sfd = -1;
+	c->sev = 0;
+	free(c->hdrs);
+	c->hdrs = NULL;
+	c->hdrs_len = 0;
+	c->req_off = 0;
+	return connect_server(c);
+}
+
+/*
+ * The server socket became writable, see if connect() succeeded
+ */
+static int check_connect(ev_conn *c)
+{
+	struct timespec now;
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	if (getsockopt(c->sfd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err)
+		return send_error(c, "server", "404", "Not found",
+				"Proxy couldn't connect to this server");
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pool_connected((now.tv_sec - c->conn_start.tv_sec) * 1000000L +
+				(now.tv_nsec - c->conn_start.tv_nsec) / 1000);
+
+	c->state = ST_SEND_REQ;
+	return 1;
+}
+
+/*
+ * Send the rewritten request to the server
+ */
+static int send_request(ev_conn *c)
+{
+	char *req = c->cond != NULL ? c->cond : c->request;
+	size_t len = c->cond != NULL ? c->cond_len : c->req_len;
+	ssize_t n;
+
+	while (c->req_off < len)
+	{
+		n = write(c->sfd, req + c->req_off, len - c->req_off);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return c->reused ? retry_request(c) : -1;
+			conn_watch(c, 0, EPOLLOUT);
+			return 0;
+		}
+		c->req_off += n;
+	}
+
+	if ((c->hdrs = malloc(MAX_RESP_HDRS)) == NULL)
+		return -1;
+	c->hdrs_len = 0;
+	c->state = ST_RECV_HEAD;
+	return 1;
+}
+
+/*
+ * Read the response headers of the server, then send our
+ * version of them along with the body bytes read so far
+ */
+static int recv_head(ev_conn *c)
+{
+	const char *conn_hdr;
+	char *end, saved;
+	size_t extra;
+	ssize_t n;
+
+	n = read(c->sfd, c->hdrs + c->hdrs_len, MAX_RESP_HDRS - 1 - c->hdrs_len);
+	if (n < 0)
+	{
+		if (errno == EINTR)
+			return 1;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return (c->reused && c->hdrs_len == 0) ? retry_request(c) : -1;
+		conn_watch(c, 0, EPOLLIN);
+		return 0;
+	}
+	if (n == 0)
+	{
+		/* the server closed an idle pooled connection, try a fresh one */
+		if (c->reused && c->hdrs_len == 0)
+			return retry_request(c);
+		return send_error(c, "server", "502", "Bad Gateway",
+				"Proxy got no response from this server");
+	}
+	c->hdrs_len += n;
+
+	if ((end = http_hdrs_end(c->hdrs, c->hdrs_len)) == NULL)
+	{
+		if (c->hdrs_len == MAX_RESP_HDRS - 1)
+			return send_error(c, "server", "502", "Bad Gateway",
+					"Response headers from this server are too large");
+		return 1;
+	}
+
+	if ((c->head = malloc(end - c->hdrs + 1)) == NULL ||
+		(c->buf = malloc(RELAY_BUFSIZE)) == NULL)
+		return -1;
+	saved = *end;
+	*end = '\0';
+	n = http_parse_response(c->hdrs, c->head, &c->resp);
+	*end = saved;
+	if (n < 0)
+		return send_error(c, "server", "502", "Bad Gateway",
+				"Proxy got a malformed response from this server");
+	c->head_len = n;
+
+	/* Not changed: refresh the stored object and send it instead */
+	if (c->stale != NULL && c->resp.status == 304)
+		return revalidated(c, c->hdrs_len - (end - c->hdrs));
+
+	/* Without a length the client can only see the end if we close */
+	if (c->resp.framing == BODY_CLOSE)
+		c->keep_alive = 0;
+	c->left = c->resp.content_length;
+	http_chunked_init(&c->chunked);
+	c->body_done = (c->resp.framing == BODY_NONE);
+	c->total = 0;
+	c->fit_size = c->admit && http_cacheable(&c->resp);
+
+	/* The body bytes that came along with the headers */
+	extra = c->hdrs_len - (end - c->hdrs);
+	memcpy(c->buf, end, extra);
+	free(c->hdrs);
+	c->hdrs = NULL;
+	extra = feed_body(c, c->buf, extra);
+
+	conn_hdr = http_conn_hdr(c->keep_alive);
+	c->out[0].iov_base = c->head;
+	c->out[0].iov_len = c->head_len;
+	c->out[1].iov_base = (char *)conn_hdr;
+	c->out[1].iov_len = strlen(conn_hdr);
+	c->out[2].iov_base = c->buf;
+	c->out[2].iov_len = extra;
+	c->out_idx = 0;
+	c->out_cnt = 3;
+	c->state = ST_RELAY_BODY;
+	return 1;
+}
+
+/*
+ * The server answered 304 to a revalidation, with extra bytes 
+ * after it: the stored object is fresh again with the headers 
+ * of the 304 over its own, pool the server connection and send 
+ * the object as a hit
+ */
+static int revalidated(ev_conn *c, size_t extra)
+{
+	http_freshness fresh;
+
+	http_object_freshness(c->stale->content, c->stale->head_size, &fresh);
+	http_freshness_update(&fresh, &c->resp.fresh);
+	cache_refresh(c->lp->cache, c->stale, http_expires(&fresh, time(NULL)));
+
+	if (c->resp.keep_alive && extra == 0)
+	{
+		conn_watch(c, c->cev, 0);
+		pool_put(c->host, c->port, c->sfd);
+	}
+	else
+		close(c->sfd);
+	c->sfd = -1;
+	c->sev = 0;
+
+	c->hit = c->stale;
+	c->stale = NULL;
+	return serve_object(c, c->hit);
+}
+
+/*
+ * Relay the response body: write out what we have, then read more
+ */
+static int relay_body(ev_conn *c)
+{
+	ssize_t n;
+	int rc;
+
+	if ((rc = write_out(c)) <= 0)
+		return rc;
+
+	if (c->body_done)
+		return finish_response(c);
+
+	n = read(c->sfd, c->buf, RELAY_BUFSIZE);
+	if (n < 0)
+	{
+		if (errno == EINTR)
+			return 1;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		conn_watch(c, 0, EPOLLIN);
+		return 0;
+	}
+	if (n == 0)
+	{
+		/* a body without a length ends here, any other is cut short */
+		if (c->resp.framing != BODY_CLOSE)
+			return -1;
+		c->body_done = 1;
+		return 1;
+	}
+
+	c->out[0].iov_base = c->buf;
+	c->out[0].iov_len = feed_body(c, c->buf, n);
+	c->out_idx = 0;
+	c->out_cnt = 1;
+	return 1;
+}
+
+/*
+ * Find out how many of the n bytes read belong to the body,
+ * keep a copy of them for the cache and check for the end
+ */
+static size_t feed_body(ev_conn *c, char *data, size_t n)
+{
+	size_t got = n;
+
+	switch (c->resp.framing)
+	{
+	case BODY_LENGTH:
+		if (n > c->left)
+			n = c->left;
+		c->left -= n;
+		c->body_done = (c->left == 0);
+		break;
+	case BODY_CHUNKED:
+		n = http_chunked_feed(&c->chunked, data, n);
+		c->body_done = (c->chunked.state == CH_DONE);
+		break;
+	case BODY_CLOSE:
+		break;
+	default:
+		n = 0;
+		break;
+	}
+
+	/* bytes past the body would confuse the next request on sfd */
+	if (n < got)
+		c->resp.keep_alive = 0;
+
+	save_content(c, data, n);
+	return n;
+}
+
+/*
+ * Keep a copy of the body as long as it fits the max object size
+ */
+static int save_content(ev_conn *c, char *data, size_t n)
+{
+	unsigned int cap;
+	char *p;
+
+	if (!c->fit_size || n == 0)
+		return 0;
+
+	if (c->total + n >= c->lp->cache->max_object)
+	{
+		c->fit_size = 0;
+		free(c->content);
+		c->content = NULL;
+		return 0;
+	}
+
+	/* grow the copy geometrically */
+	if (c->total + n > c->content_cap)
+	{
+		cap = c->content_cap ? c->content_cap : CONTENT_MINSIZE;
+		while (cap < c->total + n)
+			cap *= 2;
+		if ((p = realloc(c->content, cap)) == NULL)
+		{
+			c->fit_size = 0;
+			return 0;
+		}
+		c->content = p;
+		c->content_cap = cap;
+	}
+
+	memcpy(c->content + c->total, data, n);
+	c->total += n;
+	return 1;
+}
+
+/*
+ * The whole response went to the client, pool the server 
+ * connection if it stays open and cache the response if it fits
+ */
+static int finish_response(ev_conn *c)
+{
+	size_t obj_len;
+	char *obj;
+
+	if (c->resp.keep_alive)
+	{
+		conn_watch(c, c->cev, 0);
+		pool_put(c->host, c->port, c->sfd);
+	}
+	else
+		close(c->sfd);
+	c->sfd = -1;
+	c->sev = 0;
+
+	/* Cache the response object if it fit the max object size */
+	if (c->fit_size)
+	{
+		obj = http_cache_object(c->head, c->head_len, c->resp.framing,
+					c->content, c->total, &obj_len);
+		if (obj != NULL && obj_len < c->lp->cache->max_object)
+			cache_object(c, obj, obj_len);
+		free(obj);
+	}
+	return response_done(c);
+}
+
+/*
+ * Cache the response under the url of the request. If it varies on
+ * request headers, a marker with their names goes under the url and
+ * the response under the url and their values.
+ */
+static void cache_object(ev_conn *c, char *obj, size_t obj_len)
+{
+	char id[HTTP_MAX_KEY];
+	char marker[HTTP_MAX_VARY + 8];
+	size_t marker_len;
+	time_t expires = http_expires(&c->resp.fresh, time(NULL));
+
+	memcpy(id, c->key, c->key_len);
+	id[c->key_len] = '\0';
+	if (c->resp.vary[0] != '\0')
+	{
+		if ((marker_len = http_vary_marker(c->resp.vary, marker, 
+										   sizeof(marker))) == 0)
+			return;
+		modify_cache(c->lp->cache, id, marker, marker_len, expires);
+		if (http_vary_key(c->request, c->req_len, c->resp.vary, id, 
+						  c->key_len, sizeof(id)) == 0)
+			return;
+	}
+	modify_cache(c->lp->cache, id, obj, obj_len, expires);
+	return;
+}
+
+/*
+ * The response is complete, wait for the next request 
+ * if the client keeps the connection open
+ */
+static int response_done(ev_conn *c)
+{
+	conn_reset(c);
+	if (!c->keep_alive)
+		return -1;
+
+	c->state = ST_READ_REQ;
+	idle_enter(c);
+	return 1;
+}
+
+/*
+ * Write the pending output to the client. Return 1 when it is all 
+ * out, 0 if the client can not take more now, -1 on error
+ */
+static int write_out(ev_conn *c)
+{
+	ssize_t n;
+
+	while (c->out_idx < c->out_cnt)
+	{
+		n = writev(c->cfd, c->out + c->out_idx, c->out_cnt - c->out_idx);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+			conn_watch(c, EPOLLOUT, 0);
+			return 0;
+		}
+
+		while (c->out_idx < c->out_cnt && 
+			   (size_t)n >= c->out[c->out_idx].iov_len)
+			n -= c->out[c->out_idx++].iov_len;
+		if (c->out_idx < c->out_cnt)
+		{
+			c->out[c->out_idx].iov_base = 
+				(char *)c->out[c->out_idx].iov_base + n;
+			c->out[c->out_idx].iov_len -= n;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Write a cached response or an error page to the client
+ */
+static int send_write(ev_conn *c)
+{
+	int rc;
+
+	if ((rc = write_out(c)) <= 0)
+		return rc;
+	return response_done(c);
+}
+
+/*
+ * Answer the client with an error page and close
+ */
+static int send_error(ev_conn *c, char *cause, char *errnum, 
+				char *shortmsg, char *longmsg)
+{
+	conn_reset(c);
+	if ((c->out_mem = malloc(2 * MAXLINE)) == NULL)
+		return -1;
+
+	c->out[0].iov_base = c->out_mem;
+	c->out[0].iov_len = http_error_page(c->out_mem, 2 * MAXLINE, cause, 
+				errnum, shortmsg, longmsg);
+	c->out_idx = 0;
+	c->out_cnt = 1;
+	c->keep_alive = 0;
+	c->state = ST_WRITE;
+	return 1;
+}
@@ -0,0 +1,20 @@
+/*
+ * event.h -- Declaration of the event-driven engine 
+ *			  for 15-213 proxy lab
+ *
+ * Team Member1: Cheng Zhang, Andrew ID: chengzh1
+ * Team Member2: Zhe Qian, Andrew ID: zheq
+ *
+ */
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#include "cache.h"
+
+/* Declaration of some method that is used in proxy.c */
+void event_run(int listenfd, int n, int timeout, cache_list *cl, 
+			   int partitioned);
+void event_stats(FILE *fp);
+
+#endif
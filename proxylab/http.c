@@ -0,0 +1,1197 @@
+/*
+ * http.c -- HTTP request rewriting for the 15-213 proxy lab
+ *
+ * Team Member1: Cheng Zhang, Andrew ID: chengzh1
+ * Team Member2: Zhe Qian, Andrew ID: zheq
+ *
+ * Both proxy engines collect the request line and the request
+ * headers of a client into one buffer, then call
+ * http_parse_request() to parse them in place and 
+ * http_request_iov() to lay out the request for the server as a
+ * list of pieces, written with one writev().
+ *
+ * The id of a response in the cache is the url it answers, normalized
+ * so that clients writing it differently share the object, and none
+ * of the request headers, which differ from client to client. If the
+ * response has a Vary header, a small marker object with the header
+ * names is cached under the url, and the response under the url plus
+ * the values of those headers in the request. A lookup that finds a
+ * marker builds the longer key and looks again. Requests with
+ * credentials are not served from the cache at all.
+ *
+ * On the way back, the response headers of the server are parsed 
+ * to find out how the body ends (Content-Length, chunked or the
+ * server closing the connection), so that the client connection
+ * can stay open for the next request. The hop-by-hop headers are
+ * stripped and every response gets our own Connection header.
+ *
+ * The headers that tell how long a response stays fresh are parsed
+ * too (Cache-Control, Expires, Date, Age and Last-Modified) and so 
+ * are the validators (ETag and Last-Modified). A cached object that 
+ * became stale is asked for again with If-None-Match and 
+ * If-Modified-Since, a 304 answer makes it fresh again without its
+ * body being sent. Without any of these headers an object stays
+ * fresh for the default ttl.
+ */
+
+#define _GNU_SOURCE
+#include "csapp.h"
+#include "http.h"
+
+/* You won't lose style points for including these long lines in your code */
+static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
+static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
+static const char *accept_encoding_hdr = "Accept-Encoding: gzip, deflate\r\n";
+static const char *connection_hdr = "Connection: close\r\n";
+static const char *proxy_connection_hdr = "Proxy-Connection: close\r\n";
+static const char *server_keep_alive_hdr = "Connection: keep-alive\r\n";
+static const char *proxy_keep_alive_hdr = "Proxy-Connection: keep-alive\r\n";
+static const char *default_http_version = "HTTP/1.0\r\n";
+static const char *keep_alive_hdr = "Connection: keep-alive\r\n\r\n";
+static const char *close_hdr = "Connection: close\r\n\r\n";
+
+/* Freshness of a response that does not tell, in seconds */
+static long default_ttl;
+
+/* Most a response is kept fresh for by its Last-Modified alone */
+#define HEURISTIC_MAX_TTL 86400
+
+/*
+ * Ask the servers to keep their connections open for the pool,
+ * by default every request tells them to close. Responses that 
+ * do not tell how long they are fresh are for default_ttl seconds.
+ */
+void http_init(int server_keep_alive, int default_ttl_secs) {
+    default_ttl = default_ttl_secs;
+    if (server_keep_alive) {
+        connection_hdr = server_keep_alive_hdr;
+        proxy_connection_hdr = proxy_keep_alive_hdr;
+    }
+}
+
+/*
+ * Check if the comma separated header value of len bytes has 
+ * the given token
+ */
+static int has_token(const char *value, size_t len, const char *token) {
+    size_t tlen = strlen(token);
+    const char *p = value, *end = value + len;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        if ((size_t)(end - p) >= tlen && !strncasecmp(p, token, tlen) &&
+                (p + tlen == end || p[tlen] == ',' || p[tlen] == ' ' ||
+                 p[tlen] == ';' || p[tlen] == '\t'))
+            return 1;
+        while (p < end && *p != ',')
+            p++;
+    }
+    return 0;
+}
+
+/*
+ * Check if the header name of len bytes at key is name
+ */
+static int key_is(const char *key, size_t len, const char *name) {
+    return len == strlen(name) && !strncasecmp(key, name, len);
+}
+
+/*
+ * Check if an Accept-Encoding value of len bytes takes gzip, by
+ * name or as "*", with a q-value other than 0
+ */
+static int accepts_gzip(const char *value, size_t len) {
+    const char *p = value, *end = value + len, *tok, *q;
+    size_t tok_len;
+    double qvalue;
+    int star = 0;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        for (tok = p; p < end && *p != ',' && *p != ';' && *p != ' ' &&
+                *p != '\t'; p++)
+            ;
+        tok_len = p - tok;
+
+        /* the parameters up to the next coding, only q counts */
+        qvalue = 1;
+        for (; p < end && *p != ','; p++) {
+            if (*p != ';')
+                continue;
+            for (q = p + 1; q < end && (*q == ' ' || *q == '\t'); q++)
+                ;
+            if (end - q > 2 && (*q == 'q' || *q == 'Q') && q[1] == '=')
+                qvalue = strtod(q + 2, NULL);
+        }
+
+        if (key_is(tok, tok_len, "gzip") || key_is(tok, tok_len, "x-gzip"))
+            return qvalue > 0;
+        if (key_is(tok, tok_len, "*"))
+            star = qvalue > 0;
+    }
+    return star;
+}
+
+/* 
+ * Copy the next "\n" terminated line of hdrs into buf,
+ * return the start of the line after it
+ */
+static char *next_line(char *hdrs, char *buf) {
+    char *eol = strchr(hdrs, '\n');
+    size_t len = eol ? (size_t)(eol - hdrs + 1) : strlen(hdrs);
+
+    if (len > MAXLINE - 1)
+        len = MAXLINE - 1;
+    memcpy(buf, hdrs, len);
+    buf[len] = '\0';
+    return hdrs + len;
+}
+
+/*
+ * Get key value pair from a header line
+ */
+static void get_key_value(char *header_line, char *key, char *value) {
+    char *key_tail, *value_tail;
+
+    /* Split the given header line by ":" */
+    key_tail = strstr(header_line, ":");
+    if (key_tail != NULL) {
+        /* Get the key part */
+        *key_tail = 0;
+        strcpy(key, header_line);
+        *key_tail = ':';
+
+        /* Find the "\r\n" and get the value accordingly */
+        value_tail = strpbrk(key_tail, "\r\n");
+        if (value_tail == NULL) 
+            value_tail = key_tail + strlen(key_tail);
+        key_tail++;
+        while (*key_tail == ' ')
+            key_tail++;
+        memcpy(value, key_tail, value_tail - key_tail);
+        value[value_tail - key_tail] = 0;
+    } 
+    return;
+}
+
+/*
+ * Nothing is known about the freshness of a response yet
+ */
+static void fresh_init(http_freshness *f) {
+    memset(f, 0, sizeof(*f));
+    f->max_age = -1;
+}
+
+/*
+ * Parse an HTTP date in any of its three formats, return 1 if
+ * it is not a date, which counts as a time long past
+ */
+static time_t parse_date(const char *value) {
+    static const char *formats[] = {
+        "%a, %d %b %Y %H:%M:%S GMT",    /* RFC 1123 */
+        "%A, %d-%b-%y %H:%M:%S GMT",    /* RFC 850 */
+        "%a %b %d %H:%M:%S %Y"          /* asctime() */
+    };
+    struct tm tm;
+    char *end;
+    time_t t;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        memset(&tm, 0, sizeof(tm));
+        if ((end = strptime(value, formats[i], &tm)) == NULL)
+            continue;
+        while (*end == ' ' || *end == '\t')
+            end++;
+        if (*end == '\0')
+            return (t = timegm(&tm)) > 1 ? t : 1;
+    }
+    return 1;
+}
+
+/*
+ * Find the number of the directive name=N in a Cache-Control 
+ * value, return -1 if it is not there
+ */
+static long cc_number(const char *value, const char *name) {
+    size_t nlen = strlen(name);
+    const char *p = value;
+    long n;
+
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        if (!strncasecmp(p, name, nlen) && p[nlen] == '=') {
+            p += nlen + 1;
+            n = strtol(p + (*p == '"'), NULL, 10);
+            return n > 0 ? n : 0;
+        }
+        while (*p && *p != ',')
+            p++;
+    }
+    return -1;
+}
+
+/*
+ * Note what the response header key: value says about caching
+ */
+static void parse_fresh_hdr(char *key, char *value, http_freshness *f) {
+    size_t len = strlen(value);
+    long n;
+
+    if (!strcasecmp(key, "Cache-Control")) {
+        f->has_cc = 1;
+        if (has_token(value, len, "no-store") || 
+                has_token(value, len, "private"))
+            f->no_store = 1;
+        if (has_token(value, len, "no-cache"))
+            f->no_cache = 1;
+        /* a shared cache goes by s-maxage first */
+        if ((n = cc_number(value, "s-maxage")) >= 0 ||
+                (n = cc_number(value, "max-age")) >= 0)
+            f->max_age = n;
+    } else if (!strcasecmp(key, "Pragma")) {
+        if (has_token(value, len, "no-cache"))
+            f->no_cache = 1;
+    } else if (!strcasecmp(key, "Expires")) {
+        f->expires = parse_date(value);
+    } else if (!strcasecmp(key, "Date")) {
+        if ((f->date = parse_date(value)) == 1)
+            f->date = 0;
+    } else if (!strcasecmp(key, "Age")) {
+        f->age = strtol(value, NULL, 10);
+        if (f->age < 0)
+            f->age = 0;
+    } else if (!strcasecmp(key, "Last-Modified")) {
+        if ((f->last_modified = parse_date(value)) == 1)
+            f->last_modified = 0;
+        f->has_validator = 1;
+    } else if (!strcasecmp(key, "ETag")) {
+        f->has_validator = 1;
+    }
+}
+
+/*
+ * Split "host[:port]" of len bytes into req->host and req->port,
+ * return -1 if the host does not fit or the port is bad
+ */
+static int set_host_port(http_request *req, const char *hp, size_t len) {
+    const char *colon = memchr(hp, ':', len);
+    size_t host_len = colon ? (size_t)(colon - hp) : len;
+
+    if (host_len >= sizeof(req->host))
+        return -1;
+    memcpy(req->host, hp, host_len);
+    req->host[host_len] = '\0';
+
+    req->port = 80;
+    if (colon != NULL) {
+        req->port = atoi(colon + 1);
+        if (req->port <= 0 || req->port > 65535)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Find the end of the line that starts at p, return the first byte
+ * of the next line and set *line_end to the "\r\n" or "\n"
+ */
+static const char *line_end(const char *p, const char *end, 
+            const char **eol) {
+    const char *nl = memchr(p, '\n', end - p);
+
+    if (nl == NULL) {
+        *eol = end;
+        return end;
+    }
+    *eol = (nl > p && nl[-1] == '\r') ? nl - 1 : nl;
+    return nl + 1;
+}
+
+/* 
+ * Parse the request headers of a client in one pass over the len 
+ * bytes at hdrs, the request line and all the header lines up to 
+ * and including the empty line. Nothing is copied: the method, the
+ * uri and the header lines that go on to the server are slices of
+ * hdrs, so hdrs must stay put until the request is sent. Only the
+ * host is copied, the resolver needs it '\0' terminated.
+ * Return 1 for a GET request, 0 for other methods and -1 for a
+ * malformed request. req->keep_alive tells if the client wants to
+ * send more requests on this connection.
+ */
+int http_parse_request(const char *hdrs, size_t len, http_request *req) {
+    const char *p = hdrs, *end = hdrs + len;
+    const char *eol, *next, *tok, *colon, *value, *authority;
+    size_t key_len, value_len;
+
+    req->keep_alive = 0;
+    req->has_host = 0;
+    req->auth = 0;
+    req->gzip = 0;
+    req->nhdrs = 0;
+    req->host[0] = '\0';
+    req->port = 80;
+
+    /* Request line: method, uri and version separated by spaces */
+    next = line_end(p, end, &eol);
+    tok = p;
+    while (p < eol && *p != ' ')
+        p++;
+    req->method.p = tok;
+    req->method.len = p - tok;
+    while (p < eol && *p == ' ')
+        p++;
+    tok = p;
+    while (p < eol && *p != ' ')
+        p++;
+    req->uri.p = tok;
+    req->uri.len = p - tok;
+    while (p < eol && *p == ' ')
+        p++;
+    if (req->method.len == 0 || req->uri.len == 0 || p == eol)
+        return -1;
+
+    /* HTTP/1.1 connections are persistent unless told otherwise */
+    req->keep_alive = (eol - p >= 8 && !strncmp(p, "HTTP/1.1", 8));
+
+    if (!key_is(req->method.p, req->method.len, "GET"))
+        return 0;
+
+    /* An absolute uri names the server, the path goes on to it */
+    req->path = req->uri;
+    if (req->uri.len >= 7 && !strncasecmp(req->uri.p, "http://", 7)) {
+        authority = req->uri.p + 7;
+        tok = memchr(authority, '/', req->uri.p + req->uri.len - authority);
+        if (tok == NULL) {
+            /* "http://host" asks for the root of the server */
+            req->path.p = "/";
+            req->path.len = 1;
+            tok = req->uri.p + req->uri.len;
+        } else {
+            req->path.p = tok;
+            req->path.len = req->uri.p + req->uri.len - tok;
+        }
+        if (set_host_port(req, authority, tok - authority) < 0)
+            return -1;
+    }
+
+    /* Go through the header lines up to the empty one */
+    for (p = next; p < end; p = next) {
+        next = line_end(p, end, &eol);
+        if (eol == p)
+            break;
+
+        /* Lines without a key or a value are dropped */
+        if ((colon = memchr(p, ':', eol - p)) == NULL)
+            continue;
+        key_len = colon - p;
+        for (value = colon + 1; value < eol && 
+                (*value == ' ' || *value == '\t'); value++)
+            ;
+        value_len = eol - value;
+        if (key_len == 0 || value_len == 0)
+            continue;
+
+        /* Connection options are for us, not for the server */
+        if (key_is(p, key_len, "Connection") || 
+                key_is(p, key_len, "Proxy-Connection")) {
+            if (has_token(value, value_len, "close"))
+                req->keep_alive = 0;
+            else if (has_token(value, value_len, "keep-alive"))
+                req->keep_alive = 1;
+            continue;
+        }
+
+        /* 
+         * We never read a request body, so the next request 
+         * could not be found after one, close after answering
+         */
+        if ((key_is(p, key_len, "Content-Length") && atol(value) != 0) ||
+                key_is(p, key_len, "Transfer-Encoding"))
+            req->keep_alive = 0;
+
+        /* If the request has a Host header itself, use it */
+        if (key_is(p, key_len, "Host")) {
+            if (set_host_port(req, value, value_len) < 0)
+                return -1;
+            req->has_host = 1;
+        }
+
+        /* The response is for this client only */
+        if (key_is(p, key_len, "Authorization"))
+            req->auth = 1;
+
+        /* A hit may be sent gzip as the cache has it */
+        if (key_is(p, key_len, "Accept-Encoding"))
+            req->gzip = accepts_gzip(value, value_len);
+
+        /* We send our own version of these */
+        if (key_is(p, key_len, "User-Agent") || 
+                key_is(p, key_len, "Accept") ||
+                key_is(p, key_len, "Accept-Encoding"))
+            continue;
+
+        if (req->nhdrs == HTTP_MAX_HDRS)
+            return -1;
+        req->hdrs[req->nhdrs].p = p;
+        req->hdrs[req->nhdrs].len = eol - p;
+        req->nhdrs++;
+    }
+    return 1;
+}
+
+/*
+ * Point iov at the pieces of the request for the server: the
+ * request line, our own headers, the headers of the client that 
+ * go on, a Host header if the client had none and the empty line.
+ * Return the number of iovecs, at most HTTP_REQ_IOV, and set 
+ * req->len to the length of the whole request.
+ */
+int http_request_iov(http_request *req, struct iovec *iov) {
+    int i, n = 0;
+
+    req->len = 0;
+#define IOV_ADD(base, size) do { \
+        iov[n].iov_base = (char *)(base); \
+        iov[n].iov_len = (size); \
+        req->len += iov[n++].iov_len; \
+    } while (0)
+
+    IOV_ADD(req->method.p, req->method.len);
+    IOV_ADD(" ", 1);
+    IOV_ADD(req->path.p, req->path.len);
+    IOV_ADD(" ", 1);
+    IOV_ADD(default_http_version, strlen(default_http_version));
+    IOV_ADD(user_agent_hdr, strlen(user_agent_hdr));
+    IOV_ADD(accept_hdr, strlen(accept_hdr));
+    IOV_ADD(accept_encoding_hdr, strlen(accept_encoding_hdr));
+    IOV_ADD(connection_hdr, strlen(connection_hdr));
+    IOV_ADD(proxy_connection_hdr, strlen(proxy_connection_hdr));
+
+    for (i = 0; i < req->nhdrs; i++) {
+        IOV_ADD(req->hdrs[i].p, req->hdrs[i].len);
+        IOV_ADD("\r\n", 2);
+    }
+
+    /*
+     * If request doesn't have a Host header, 
+     * combine the host and port from the 
+     * first request line as the Host header
+     */
+    if (!req->has_host) {
+        if (req->port != 80)
+            snprintf(req->host_hdr, sizeof(req->host_hdr), 
+                "Host: %s:%d\r\n", req->host, req->port);
+        else 
+            snprintf(req->host_hdr, sizeof(req->host_hdr), 
+                "Host: %s\r\n", req->host);
+        IOV_ADD(req->host_hdr, strlen(req->host_hdr));
+    }
+
+    /* End the request with "\r\n" */
+    IOV_ADD("\r\n", 2);
+#undef IOV_ADD
+    return n;
+}
+
+/*
+ * Copy the pieces in iov into buf one after the other and '\0' 
+ * terminate it, return the length or -1 if they do not fit
+ */
+int http_flatten(struct iovec *iov, int cnt, char *buf, size_t size) {
+    size_t len = 0;
+    int i;
+
+    for (i = 0; i < cnt; i++) {
+        if (len + iov[i].iov_len >= size)
+            return -1;
+        memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+/*
+ * Return the first byte after the "\r\n\r\n" that ends the
+ * request headers in buf, or NULL if they are not complete yet
+ */
+char *http_hdrs_end(char *buf, size_t len) {
+    size_t i;
+
+    for (i = 0; i + 1 < len; i++) {
+        if (buf[i] != '\n')
+            continue;
+        if (buf[i + 1] == '\n')
+            return buf + i + 2;
+        if (buf[i + 1] == '\r' && i + 2 < len && buf[i + 2] == '\n')
+            return buf + i + 3;
+    }
+    return NULL;
+}
+
+/*
+ * Add the header names of a Vary value to the list vary, in lower
+ * case and separated by commas. A "*" or a list too long to keep
+ * makes the list "*", the response can not be cached then.
+ */
+static void add_vary(char *vary, const char *value) {
+    size_t len = strlen(vary);
+    const char *p = value, *tok;
+
+    while (*p && strcmp(vary, "*")) {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        for (tok = p; *p && *p != ',' && *p != ' ' && *p != '\t'; p++)
+            ;
+        if (p == tok)
+            break;
+        if ((p - tok == 1 && *tok == '*') || 
+                len + (p - tok) + 2 > HTTP_MAX_VARY) {
+            strcpy(vary, "*");
+            break;
+        }
+        if (len > 0)
+            vary[len++] = ',';
+        while (tok < p)
+            vary[len++] = tolower((unsigned char)*tok++);
+        vary[len] = '\0';
+    }
+}
+
+/*
+ * Parse the response headers hdrs of the server and copy them to
+ * head, without the hop-by-hop headers and without the empty line
+ * at the end. Return the length of head, or -1 if the response is 
+ * malformed. head must have room for strlen(hdrs) + 1 bytes.
+ * resp->keep_alive tells if the server connection can be reused
+ * once the body is read.
+ */
+int http_parse_response(char *hdrs, char *head, http_response *resp) {
+    char buf[MAXLINE]; 
+    char key[MAXLINE];
+    char value[MAXLINE];
+    char *h = head;
+    size_t len;
+    int chunked = 0, has_length = 0;
+
+    resp->content_length = 0;
+    resp->vary[0] = '\0';
+    fresh_init(&resp->fresh);
+
+    /* Status line */
+    hdrs = next_line(hdrs, buf);
+    if (strncmp(buf, "HTTP/", 5) || 
+            sscanf(buf, "%*s %d", &resp->status) != 1)
+        return -1;
+
+    /* HTTP/1.1 servers keep the connection open unless told otherwise */
+    resp->keep_alive = !strncmp(buf, "HTTP/1.1", 8);
+    len = strlen(buf);
+    memcpy(h, buf, len);
+    h += len;
+
+    /* Go through the response line by line */
+    while (*hdrs != '\0') {
+        *key = '\0';
+        *value = '\0';
+        hdrs = next_line(hdrs, buf);
+
+        if (!strcmp(buf, "\r\n") || !strcmp(buf, "\n"))
+            break;
+
+        get_key_value(buf, key, value);
+        if (!strcasecmp(key, "Connection") || 
+                !strcasecmp(key, "Proxy-Connection")) {
+            if (has_token(value, strlen(value), "close"))
+                resp->keep_alive = 0;
+            else if (has_token(value, strlen(value), "keep-alive"))
+                resp->keep_alive = 1;
+            continue;
+        }
+        if (!strcasecmp(key, "Keep-Alive"))
+            continue;
+        if (!strcasecmp(key, "Content-Length")) {
+            resp->content_length = strtoull(value, NULL, 10);
+            has_length = 1;
+        }
+        if (!strcasecmp(key, "Transfer-Encoding") && 
+                has_token(value, strlen(value), "chunked"))
+            chunked = 1;
+        if (!strcasecmp(key, "Vary"))
+            add_vary(resp->vary, value);
+        parse_fresh_hdr(key, value, &resp->fresh);
+
+        len = strlen(buf);
+        memcpy(h, buf, len);
+        h += len;
+    }
+    *h = '\0';
+
+    /* Find out how the body ends */
+    if (resp->status / 100 == 1 || resp->status == 204 || 
+            resp->status == 304)
+        resp->framing = BODY_NONE;
+    else if (chunked)
+        resp->framing = BODY_CHUNKED;
+    else if (has_length)
+        resp->framing = resp->content_length ? BODY_LENGTH : BODY_NONE;
+    else
+        resp->framing = BODY_CLOSE;
+
+    if (resp->framing == BODY_CLOSE)
+        resp->keep_alive = 0;
+
+    return h - head;
+}
+
+/*
+ * The Connection header and the empty line that end our responses
+ */
+const char *http_conn_hdr(int keep_alive) {
+    return keep_alive ? keep_alive_hdr : close_hdr;
+}
+
+/*
+ * Check if a response may be cached: not no-store or private, not
+ * revalidated on each use without a validator to do it with, not
+ * varying on anything, and of a status that is cacheable by default 
+ * or with explicit freshness
+ */
+int http_cacheable(http_response *resp) {
+    http_freshness *f = &resp->fresh;
+
+    if (f->no_store || !strcmp(resp->vary, "*"))
+        return 0;
+    if ((f->no_cache || f->max_age == 0) && !f->has_validator)
+        return 0;
+
+    switch (resp->status) {
+    case 200: case 203: case 204: case 300: case 301: 
+    case 404: case 405: case 410: case 414: case 501:
+        return 1;
+    case 206: case 304:
+        return 0;
+    }
+    return resp->status / 100 != 1 && (f->max_age >= 0 || f->expires);
+}
+
+/*
+ * When a response with freshness f received at now becomes stale
+ */
+time_t http_expires(http_freshness *f, time_t now) {
+    time_t date = f->date ? f->date : now;
+    long lifetime, age = f->age;
+
+    if (f->no_cache)
+        return now;
+
+    if (f->max_age >= 0) {
+        lifetime = f->max_age;
+    } else if (f->expires) {
+        lifetime = f->expires - date;
+    } else if (f->last_modified && f->last_modified < date) {
+        /* a tenth of the time since it last changed, as caches do */
+        lifetime = (date - f->last_modified) / 10;
+        if (lifetime > HEURISTIC_MAX_TTL)
+            lifetime = HEURISTIC_MAX_TTL;
+    } else {
+        lifetime = default_ttl;
+    }
+
+    /* it may have been on its way or in other caches for a while */
+    if (now - date > age)
+        age = now - date;
+    return now + lifetime - age;
+}
+
+/*
+ * Get the freshness headers of a cached object
+ */
+void http_object_freshness(char *obj, size_t obj_len, http_freshness *f) {
+    char buf[MAXLINE];
+    char key[MAXLINE];
+    char value[MAXLINE];
+    size_t head_len = http_object_head(obj, obj_len);
+    char *p = obj, *eol, *end = obj + head_len;
+    size_t len;
+
+    fresh_init(f);
+    while (p < end && (eol = memchr(p, '\n', end - p)) != NULL) {
+        len = eol - p + 1 < MAXLINE ? eol - p + 1 : MAXLINE - 1;
+        memcpy(buf, p, len);
+        buf[len] = '\0';
+        *key = '\0';
+        *value = '\0';
+        /* the status line has no key */
+        if (p != obj) {
+            get_key_value(buf, key, value);
+            parse_fresh_hdr(key, value, f);
+        }
+        p = eol + 1;
+    }
+}
+
+/*
+ * A 304 came with headers upd for a stored object with headers f, 
+ * the new ones replace the stored ones
+ */
+void http_freshness_update(http_freshness *f, http_freshness *upd) {
+    if (upd->has_cc) {
+        f->has_cc = 1;
+        f->no_store = upd->no_store;
+        f->no_cache = upd->no_cache;
+        f->max_age = upd->max_age;
+    }
+    if (upd->expires)
+        f->expires = upd->expires;
+    if (upd->last_modified)
+        f->last_modified = upd->last_modified;
+
+    /* the date and age of the stored response are those of the 304 now */
+    f->date = upd->date;
+    f->age = upd->age;
+}
+
+/*
+ * Copy the value of the header name of a cached object into value,
+ * return 0 if the object has no such header
+ */
+static int object_header(char *obj, size_t head_len, const char *name,
+            char *value) {
+    char buf[MAXLINE];
+    char key[MAXLINE];
+    char *p = obj, *eol, *end = obj + head_len;
+    size_t len;
+
+    while (p < end && (eol = memchr(p, '\n', end - p)) != NULL) {
+        len = eol - p + 1 < MAXLINE ? eol - p + 1 : MAXLINE - 1;
+        memcpy(buf, p, len);
+        buf[len] = '\0';
+        *key = '\0';
+        if (p != obj) {
+            get_key_value(buf, key, value);
+            if (!strcasecmp(key, name))
+                return 1;
+        }
+        p = eol + 1;
+    }
+    return 0;
+}
+
+/*
+ * Make a request of req_len bytes conditional on the validators of
+ * a cached object, into buf of size bytes. Return the length of the
+ * new request, or 0 if it can not be made: the object has no 
+ * validator, the client sent a conditional request itself, or it 
+ * does not fit.
+ */
+int http_revalidate(const char *request, size_t req_len, char *obj, 
+        size_t obj_len, char *buf, size_t size) {
+    char etag[MAXLINE];
+    char modified[MAXLINE];
+    size_t head_len = http_object_head(obj, obj_len);
+    int has_etag, has_modified, n;
+
+    if (strcasestr(request, "\nIf-None-Match:") != NULL || 
+            strcasestr(request, "\nIf-Modified-Since:") != NULL ||
+            req_len < 2)
+        return 0;
+
+    has_etag = object_header(obj, head_len, "ETag", etag);
+    has_modified = object_header(obj, head_len, "Last-Modified", modified);
+    if (!has_etag && !has_modified)
+        return 0;
+
+    /* the validators go in before the empty line */
+    n = snprintf(buf, size, "%.*s%s%s%s%s%s%s\r\n", (int)(req_len - 2), 
+            request, has_etag ? "If-None-Match: " : "", 
+            has_etag ? etag : "", has_etag ? "\r\n" : "",
+            has_modified ? "If-Modified-Since: " : "", 
+            has_modified ? modified : "", has_modified ? "\r\n" : "");
+    if (n < 0 || (size_t)n >= size)
+        return 0;
+    return n;
+}
+
+/*
+ * Value of the hex digit c
+ */
+static int hex_value(int c) {
+    return isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+}
+
+/*
+ * Check if c never needs to be escaped in a uri
+ */
+static int unreserved(int c) {
+    return isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+/*
+ * Write the cache key of a request into key of size bytes: the url
+ * it asks for, written the same way however the client wrote it. 
+ * The host is in lower case and the default port is left out, the
+ * escapes of characters that need none are undone and the others 
+ * are in upper case, a fragment is dropped. Return the length of 
+ * the key, or 0 if the request is not for the cache or its key 
+ * does not fit.
+ */
+int http_cache_key(http_request *req, char *key, size_t size) {
+    const char *p = req->path.p, *end = req->path.p + req->path.len;
+    size_t len, i;
+    int n, c;
+
+    if (req->auth)
+        return 0;
+
+    if (req->port != 80)
+        n = snprintf(key, size, "http://%s:%d", req->host, req->port);
+    else
+        n = snprintf(key, size, "http://%s", req->host);
+    if (n < 0 || (size_t)n >= size)
+        return 0;
+    for (i = 7; key[i] != '\0' && key[i] != ':'; i++)
+        key[i] = tolower((unsigned char)key[i]);
+    len = n;
+
+    for (; p < end && *p != '#'; p++) {
+        if (len + 3 >= size)
+            return 0;
+        if (*p == '%' && end - p >= 3 && isxdigit((unsigned char)p[1]) &&
+                isxdigit((unsigned char)p[2])) {
+            c = hex_value(p[1]) * 16 + hex_value(p[2]);
+            if (unreserved(c)) {
+                key[len++] = c;
+            } else {
+                key[len++] = '%';
+                key[len++] = toupper(p[1]);
+                key[len++] = toupper(p[2]);
+            }
+            p += 2;
+        } else {
+            key[len++] = *p;
+        }
+    }
+    key[len] = '\0';
+    return len;
+}
+
+/*
+ * Add the request headers named in the Vary list vary to the key of
+ * key_len bytes in key of size bytes: "\nname:value" for each, the
+ * values of a header sent more than once joined by commas, without
+ * the white space around them. The request is the one the server
+ * got, so the headers we send our own version of count with ours.
+ * Return the new length of the key, or 0 if it does not fit, the
+ * key is cut back to key_len bytes then.
+ */
+int http_vary_key(const char *request, size_t req_len, const char *vary,
+        char *key, size_t key_len, size_t size) {
+    const char *end = request + req_len, *name, *p, *next, *eol;
+    const char *colon, *v, *v_end;
+    size_t len = key_len, name_len;
+    int found;
+
+    for (name = vary; *name != '\0'; name += name_len + 
+            (name[name_len] == ',')) {
+        name_len = strcspn(name, ",");
+        if (len + name_len + 2 >= size) {
+            key[key_len] = '\0';
+            return 0;
+        }
+        key[len++] = '\n';
+        memcpy(key + len, name, name_len);
+        len += name_len;
+        key[len++] = ':';
+
+        /* the header lines come after the request line */
+        found = 0;
+        for (p = line_end(request, end, &eol); p < end; p = next) {
+            next = line_end(p, end, &eol);
+            if (eol == p)
+                break;
+            if ((colon = memchr(p, ':', eol - p)) == NULL || 
+                    (size_t)(colon - p) != name_len ||
+                    strncasecmp(p, name, name_len))
+                continue;
+            for (v = colon + 1; v < eol && (*v == ' ' || *v == '\t'); v++)
+                ;
+            for (v_end = eol; v_end > v && 
+                    (v_end[-1] == ' ' || v_end[-1] == '\t'); v_end--)
+                ;
+            if (len + (v_end - v) + 2 >= size) {
+                key[key_len] = '\0';
+                return 0;
+            }
+            if (found++)
+                key[len++] = ',';
+            memcpy(key + len, v, v_end - v);
+            len += v_end - v;
+        }
+    }
+    key[len] = '\0';
+    return len;
+}
+
+/*
+ * Build the object cached under the url of a response that varies
+ * on the headers in vary into buf of size bytes: "VARY " and the
+ * list, '\0' terminated. Return its length with the '\0', or 0 if 
+ * it does not fit.
+ */
+size_t http_vary_marker(const char *vary, char *buf, size_t size) {
+    int n = snprintf(buf, size, "VARY %s", vary);
+
+    if (n < 0 || (size_t)n >= size)
+        return 0;
+    return n + 1;
+}
+
+/*
+ * Return the Vary list of a cached object that http_vary_marker 
+ * built, or NULL if it is a response
+ */
+const char *http_vary(char *obj, size_t obj_len) {
+    if (obj_len > 5 && !memcmp(obj, "VARY ", 5) && obj[obj_len - 1] == '\0')
+        return obj + 5;
+    return NULL;
+}
+
+/*
+ * Initialize a chunked body decoder
+ */
+void http_chunked_init(http_chunked *ch) {
+    ch->state = CH_SIZE;
+    ch->left = 0;
+    ch->line_len = 0;
+}
+
+/*
+ * Feed len bytes of a chunked body to the decoder, return how many 
+ * of them belong to the body. The body is complete once ch->state 
+ * is CH_DONE, the bytes after it are not consumed.
+ */
+size_t http_chunked_feed(http_chunked *ch, const char *buf, size_t len) {
+    size_t i = 0, n;
+    char c;
+
+    while (i < len && ch->state != CH_DONE) {
+        /* Skip over the chunk data in one step */
+        if (ch->state == CH_DATA) {
+            n = len - i;
+            if (n > ch->left)
+                n = ch->left;
+            ch->left -= n;
+            i += n;
+            if (ch->left == 0)
+                ch->state = CH_DATA_END;
+            continue;
+        }
+
+        c = buf[i++];
+        switch (ch->state) {
+        case CH_SIZE:
+            if (isxdigit((unsigned char)c)) {
+                ch->left = ch->left * 16 + 
+                    (isdigit((unsigned char)c) ? c - '0' 
+                                               : (tolower(c) - 'a' + 10));
+                break;
+            }
+            if (c != '\n') {
+                /* chunk extension or the "\r", ignore the rest */
+                ch->state = CH_EXT;
+                break;
+            }
+            /* fall through */
+        case CH_EXT:
+            if (c == '\n') {
+                ch->state = ch->left ? CH_DATA : CH_TRAILER;
+                ch->line_len = 0;
+            }
+            break;
+        case CH_DATA_END:
+            if (c == '\n') {
+                ch->state = CH_SIZE;
+                ch->left = 0;
+            }
+            break;
+        case CH_TRAILER:
+            if (c == '\n') {
+                if (ch->line_len == 0)
+                    ch->state = CH_DONE;
+                ch->line_len = 0;
+            } else if (c != '\r') {
+                ch->line_len++;
+            }
+            break;
+        }
+    }
+    return i;
+}
+
+/*
+ * Build the object that goes into the cache: the stripped response
+ * headers, a Content-Length if the server did not send one, the 
+ * empty line and the body. The result is malloced and '\0' terminated.
+ */
+char *http_cache_object(char *head, size_t head_len, int framing, 
+            char *body, size_t body_len, size_t *obj_len) {
+    char length_hdr[64];
+    size_t length_len = 0;
+    char *obj, *p;
+
+    if (framing == BODY_CLOSE)
+        length_len = sprintf(length_hdr, "Content-Length: %lu\r\n", 
+                (unsigned long)body_len);
+
+    if ((obj = malloc(head_len + length_len + 2 + body_len + 1)) == NULL)
+        return NULL;
+
+    p = obj;
+    memcpy(p, head, head_len);
+    p += head_len;
+    memcpy(p, length_hdr, length_len);
+    p += length_len;
+    memcpy(p, "\r\n", 2);
+    p += 2;
+    memcpy(p, body, body_len);
+    p += body_len;
+    *p = '\0';
+
+    *obj_len = p - obj;
+    return obj;
+}
+
+/*
+ * Return the offset of the empty line in a cached object, our
+ * Connection header goes right before it. Return obj_len if the 
+ * object has no headers, then it is sent as it is.
+ */
+size_t http_object_head(char *obj, size_t obj_len) {
+    char *end = http_hdrs_end(obj, obj_len);
+
+    if (end == NULL || end - obj < 4 || memcmp(end - 4, "\r\n\r\n", 4))
+        return obj_len;
+    return end - obj - 2;
+}
+
+/*
+ * Check if a Content-Type value is text, which compresses well
+ */
+static int compressible_type(const char *type) {
+    static const char *types[] = {
+        "application/javascript", "application/x-javascript",
+        "application/json", "application/xml", "application/xhtml+xml",
+        "image/svg+xml"
+    };
+    size_t i, len = strcspn(type, "; \t");
+
+    if (len > 5 && !strncasecmp(type, "text/", 5))
+        return 1;
+    for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if (key_is(type, len, types[i]))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Check if the body of a cached object with headers of head_len 
+ * bytes is worth compressing: the whole text of a 200 response,
+ * with a Content-Length and no content or transfer coding yet
+ */
+int http_compressible(char *obj, size_t head_len) {
+    char value[MAXLINE];
+    int status;
+
+    if (sscanf(obj, "HTTP/%*s %d", &status) != 1 || status != 200)
+        return 0;
+    if (object_header(obj, head_len, "Content-Encoding", value) ||
+            object_header(obj, head_len, "Transfer-Encoding", value) ||
+            object_header(obj, head_len, "Content-Range", value) ||
+            !object_header(obj, head_len, "Content-Length", value) ||
+            !object_header(obj, head_len, "Content-Type", value))
+        return 0;
+    return compressible_type(value);
+}
+
+/*
+ * Copy the headers of a cached object up to head_len, where 
+ * http_object_head says they end, into buf of size bytes for a gzip
+ * body of body_len bytes: the Content-Length is that of the gzip 
+ * bytes, a strong ETag is made weak, as the bytes are not those it
+ * was given to, and Content-Encoding and Vary are added. Return 
+ * the length, or 0 if it does not fit.
+ */
+size_t http_gzip_head(char *obj, size_t head_len, size_t body_len, 
+            char *buf, size_t size) {
+    char *p = obj, *eol, *end = obj + head_len, *colon;
+    size_t len, n = 0;
+    int rc;
+
+    while (p < end && (eol = memchr(p, '\n', end - p)) != NULL) {
+        len = eol + 1 - p;
+        colon = memchr(p, ':', len);
+        if (p != obj && colon != NULL && 
+                key_is(p, colon - p, "Content-Length")) {
+            p = eol + 1;
+            continue;
+        }
+        if (n + len + 2 > size)
+            return 0;
+        if (p != obj && colon != NULL && key_is(p, colon - p, "ETag")) {
+            /* "ETag: " then W/ before the quote */
+            for (colon++; *colon == ' '; colon++)
+                ;
+            if (*colon == '"') {
+                memcpy(buf + n, p, colon - p);
+                memcpy(buf + n + (colon - p), "W/", 2);
+                memcpy(buf + n + (colon - p) + 2, colon, eol + 1 - colon);
+                n += len + 2;
+                p = eol + 1;
+                continue;
+            }
+        }
+        memcpy(buf + n, p, len);
+        n += len;
+        p = eol + 1;
+    }
+
+    rc = snprintf(buf + n, size - n, "Content-Length: %lu\r\n"
+            "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n",
+            (unsigned long)body_len);
+    if (rc < 0 || (size_t)rc >= size - n)
+        return 0;
+    return n + rc;
+}
+
+/* 
+ * Build a simple website for cannot connect to server errors 
+ */
+int http_error_page(char *page, size_t size, char *cause, char *errnum, 
+            char *shortmsg, char *longmsg) {
+    char body[MAXLINE];
+    int body_len, len;
+
+    /* Build the HTTP response body */
+    body_len = snprintf(body, MAXLINE, "<html><title>Request Error</title>"
+        "<body bgcolor=""ffffff"">\r\n"
+        "%s: %s\r\n"
+        "<p>%s: %s\r\n"
+        "<hr><em>The proxy</em>\r\n", errnum, shortmsg, longmsg, cause);
+    if (body_len >= MAXLINE)
+        body_len = MAXLINE - 1;
+
+    /* Print the HTTP response */
+    len = snprintf(page, size, "HTTP/1.0 %s %s\r\n"
+        "Content-type: text/html\r\n"
+        "Content-length: %d\r\n\r\n%s", 
+        errnum, shortmsg, body_len, body);
+    if (len >= size)
+        len = size - 1;
+    return len;
+}
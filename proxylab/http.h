@@ -0,0 +1,161 @@
+/*
+ * http.h -- Declaration of the HTTP request rewriting and response
+ *           framing helpers shared by the proxy engines 
+ *           for 15-213 proxy lab
+ *
+ * Team Member1: Cheng Zhang, Andrew ID: chengzh1
+ * Team Member2: Zhe Qian, Andrew ID: zheq
+ *
+ */
+
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/uio.h>
+
+/* Max size of the client's request headers and of the rewritten request */
+#define MAX_REQ_HDRS MAXLINE
+#define MAX_REQUEST (2 * MAXLINE)
+
+/* Max size of the server's response headers */
+#define MAX_RESP_HDRS (2 * MAXLINE)
+
+/* Most header lines of a request that go on to the server */
+#define HTTP_MAX_HDRS 128
+
+/* Longest host name, as in NI_MAXHOST */
+#define HTTP_MAX_HOST 1025
+
+/* Longest cache key, a request with a longer one is not cached */
+#define HTTP_MAX_KEY MAXLINE
+
+/* Longest list of Vary header names, a longer one is like "*" */
+#define HTTP_MAX_VARY 256
+
+/* 
+ * Pieces of a rewritten request: the request line, our own headers,
+ * each header of the client and its "\r\n", Host and the empty line
+ */
+#define HTTP_REQ_IOV (10 + 2 * HTTP_MAX_HDRS + 2)
+
+/* Definition of a piece of a buffer */
+typedef struct
+{
+	const char *p;
+	size_t len;
+}http_slice;
+
+/* Definition of a parsed request, the slices point into its headers */
+typedef struct
+{
+	http_slice method;
+	http_slice uri;
+	http_slice path;			/* uri without "http://host:port" */
+	char host[HTTP_MAX_HOST];	/* '\0' terminated for the resolver */
+	int port;
+	int keep_alive;				/* the client keeps the connection open */
+	int has_host;				/* the client sent a Host header */
+	int auth;					/* it has Authorization, not for the cache */
+	int gzip;					/* a gzip body is taken as it is */
+	int nhdrs;
+	http_slice hdrs[HTTP_MAX_HDRS];	/* header lines for the server */
+	char host_hdr[HTTP_MAX_HOST + 32];	/* Host line if the client had none */
+	size_t len;					/* length of the rewritten request */
+}http_request;
+
+/* How the end of a response body is found */
+#define BODY_NONE 0			/* no body at all, e.g. 204 and 304 */
+#define BODY_LENGTH 1		/* Content-Length bytes */
+#define BODY_CHUNKED 2		/* chunked transfer coding */
+#define BODY_CLOSE 3		/* until the server closes the connection */
+
+/* Definition of what the headers of a response say about caching it */
+typedef struct
+{
+	int has_cc;					/* there is a Cache-Control header */
+	int no_store;				/* no-store or private */
+	int no_cache;				/* revalidate before each use */
+	long max_age;				/* s-maxage or max-age, -1 if none */
+	time_t expires;				/* Expires, 0 if none, 1 if invalid */
+	time_t date;				/* Date, 0 if none */
+	time_t last_modified;		/* Last-Modified, 0 if none */
+	long age;					/* Age, 0 if none */
+	int has_validator;			/* ETag or Last-Modified */
+}http_freshness;
+
+/* Definition of a parsed response header */
+typedef struct
+{
+	int status;
+	int framing;
+	unsigned long long content_length;
+	int keep_alive;				/* the server keeps the connection open */
+	http_freshness fresh;
+	char vary[HTTP_MAX_VARY];	/* Vary names, lower case, "" if none */
+}http_response;
+
+/* States of the chunked body decoder */
+#define CH_SIZE 0
+#define CH_EXT 1
+#define CH_DATA 2
+#define CH_DATA_END 3
+#define CH_TRAILER 4
+#define CH_DONE 5
+
+/* Definition of the chunked body decoder */
+typedef struct
+{
+	int state;
+	unsigned long long left;	/* bytes left in the current chunk */
+	size_t line_len;			/* length of the current trailer line */
+}http_chunked;
+
+/* Build the request for the server from the client's request headers */
+void http_init(int server_keep_alive, int default_ttl);
+int http_parse_request(const char *hdrs, size_t len, http_request *req);
+int http_request_iov(http_request *req, struct iovec *iov);
+int http_flatten(struct iovec *iov, int cnt, char *buf, size_t size);
+
+/* Find the end of the request or response headers in a buffer */
+char *http_hdrs_end(char *buf, size_t len);
+
+/* Parse the response headers and strip the hop-by-hop ones */
+int http_parse_response(char *hdrs, char *head, http_response *resp);
+const char *http_conn_hdr(int keep_alive);
+
+/* Freshness of responses and cached objects, and revalidation */
+int http_cacheable(http_response *resp);
+time_t http_expires(http_freshness *f, time_t now);
+void http_object_freshness(char *obj, size_t obj_len, http_freshness *f);
+void http_freshness_update(http_freshness *f, http_freshness *upd);
+int http_revalidate(const char *request, size_t req_len, char *obj, 
+        size_t obj_len, char *buf, size_t size);
+
+/* Cache keys: the normalized url, with the headers the response varies on */
+int http_cache_key(http_request *req, char *key, size_t size);
+int http_vary_key(const char *request, size_t req_len, const char *vary,
+        char *key, size_t key_len, size_t size);
+size_t http_vary_marker(const char *vary, char *buf, size_t size);
+const char *http_vary(char *obj, size_t obj_len);
+
+/* Find the end of a chunked body */
+void http_chunked_init(http_chunked *ch);
+size_t http_chunked_feed(http_chunked *ch, const char *buf, size_t len);
+
+/* Cached objects: the response headers without Connection, then the body */
+char *http_cache_object(char *head, size_t head_len, int framing, 
+        char *body, size_t body_len, size_t *obj_len);
+size_t http_object_head(char *obj, size_t obj_len);
+
+/* Bodies of cached objects the cache may keep gzip, and their headers */
+int http_compressible(char *obj, size_t head_len);
+size_t http_gzip_head(char *obj, size_t head_len, size_t body_len, 
+        char *buf, size_t size);
+
+/* Build a complete error response, return its length */
+int http_error_page(char *page, size_t size, char *cause, char *errnum, 
+        char *shortmsg, char *longmsg);
+
+#endif
@@ -0,0 +1,285 @@
+/*
+ * pool.c -- Pool of idle keep-alive server connections 
+ *			 for the 15-213 proxy lab
+ *
+ * Team Member1: Cheng Zhang, Andrew ID: chengzh1
+ * Team Member2: Zhe Qian, Andrew ID: zheq
+ *
+ * Overview of the pool:
+ *	When a server answers with a response that keeps its connection
+ *	open, the connection is put back here instead of being closed, 
+ *	so the next miss on the same (host, port) skips the DNS lookup 
+ *	and the TCP handshake. The pool is a hash table of hosts, each
+ *	host keeps a small stack of idle connections, the most recently
+ *	used one on top. At most max_per_host connections are kept per
+ *	host, the oldest one is closed to make room. Connections idle
+ *	for idle_secs are closed, and a connection is checked with a 
+ *	non-blocking peek before reuse, as the server may have closed 
+ *	it in the meantime. One lock protects the whole pool, it is 
+ *	only held for a few pointer updates.
+ */
+
+#include "csapp.h"
+#include "pool.h"
+
+#define POOL_BUCKETS 256
+
+/* Definition of an idle connection */
+typedef struct
+{
+	int fd;
+	time_t since;
+}pool_conn;
+
+/* Definition of the idle connections of a host */
+typedef struct pool_host
+{
+	char *host;
+	int port;
+	int nidle;
+	pool_conn *idle;			/* idle[nidle - 1] is the newest */
+	struct pool_host *next;
+}pool_host;
+
+static pool_host *buckets[POOL_BUCKETS];
+static int max_per_host;
+static int idle_timeout;
+static time_t last_sweep;
+static sem_t sem;
+
+/* Counters, protected by sem */
+static unsigned long n_gets;
+static unsigned long n_reuses;
+static unsigned long n_stale;
+static unsigned long n_connects;
+static unsigned long long connect_usecs;
+
+static pool_host *find_host(char *host, int port, int create);
+static void expire_host(pool_host *ph, time_t now);
+static void sweep_pool(time_t now);
+static int conn_alive(int fd);
+
+
+/*
+ * Initialize the pool, max_per_host == 0 disables it
+ */
+void pool_init(int max_per_host_arg, int idle_secs)
+{
+	max_per_host = max_per_host_arg;
+	idle_timeout = idle_secs;
+	last_sweep = time(NULL);
+	Sem_init(&sem, 0, 1);
+	return;
+}
+
+/*
+ * Check if server connections are kept open at all
+ */
+int pool_enabled(void)
+{
+	return max_per_host > 0;
+}
+
+/*
+ * Take an idle connection to host:port out of the pool,
+ * return -1 if there is no usable one
+ */
+int pool_get(char *host, int port)
+{
+	pool_host *ph;
+	pool_conn pc;
+	time_t now;
+
+	if (max_per_host <= 0)
+		return -1;
+
+	now = time(NULL);
+	P(&sem);
+	n_gets++;
+	sweep_pool(now);
+	ph = find_host(host, port, 0);
+	while (ph != NULL && ph->nidle > 0)
+	{
+		pc = ph->idle[--ph->nidle];
+		V(&sem);
+
+		/* the server may have closed it while it was idle */
+		if (now - pc.since < idle_timeout && conn_alive(pc.fd))
+		{
+			P(&sem);
+			n_reuses++;
+			V(&sem);
+			return pc.fd;
+		}
+		close(pc.fd);
+
+		P(&sem);
+		n_stale++;
+	}
+	V(&sem);
+	return -1;
+}
+
+/*
+ * Put a connection to host:port that finished a 
+ * response back into the pool
+ */
+void pool_put(char *host, int port, int fd)
+{
+	pool_host *ph;
+	time_t now;
+
+	if (max_per_host <= 0)
+	{
+		close(fd);
+		return;
+	}
+
+	now = time(NULL);
+	P(&sem);
+	if ((ph = find_host(host, port, 1)) == NULL)
+	{
+		V(&sem);
+		close(fd);
+		return;
+	}
+
+	/* make room by closing the oldest connection */
+	if (ph->nidle == max_per_host)
+	{
+		close(ph->idle[0].fd);
+		memmove(ph->idle, ph->idle + 1, (ph->nidle - 1) * sizeof(pool_conn));
+		ph->nidle--;
+	}
+	ph->idle[ph->nidle].fd = fd;
+	ph->idle[ph->nidle].since = now;
+	ph->nidle++;
+	V(&sem);
+	return;
+}
+
+/*
+ * Record the latency of a new connection to a server
+ */
+void pool_connected(long usecs)
+{
+	P(&sem);
+	n_connects++;
+	connect_usecs += usecs;
+	V(&sem);
+	return;
+}
+
+/*
+ * Print the counters of the pool
+ */
+void pool_stats(FILE *fp)
+{
+	double avg, rate;
+
+	P(&sem);
+	avg = n_connects ? (double)connect_usecs / n_connects : 0;
+	rate = n_gets ? 100.0 * n_reuses / n_gets : 0;
+	fprintf(fp, "pool: %lu lookups, %lu reused (%.1f%%), %lu stale, "
+			"%lu new connections, avg connect %.0f us, "
+			"about %.1f ms of connect time saved\n",
+			n_gets, n_reuses, rate, n_stale, n_connects, avg,
+			avg * n_reuses / 1000);
+	V(&sem);
+	return;
+}
+
+/*
+ * Find the entry of host:port in the hash table, 
+ * create it if asked to. Must hold sem.
+ */
+static pool_host *find_host(char *host, int port, int create)
+{
+	unsigned int h = 2166136261u;
+	pool_host *ph;
+	char *p;
+
+	/* FNV-1a over the host name and the port */
+	for (p = host; *p; p++)
+		h = (h ^ (unsigned char)tolower(*p)) * 16777619u;
+	h = (h ^ (unsigned int)port) * 16777619u;
+	h %= POOL_BUCKETS;
+
+	for (ph = buckets[h]; ph != NULL; ph = ph->next)
+	{
+		if (ph->port == port && !strcasecmp(ph->host, host))
+			return ph;
+	}
+	if (!create)
+		return NULL;
+
+	if ((ph = calloc(1, sizeof(pool_host))) == NULL)
+		return NULL;
+	ph->idle = calloc(max_per_host, sizeof(pool_conn));
+	ph->host = strdup(host);
+	if (ph->idle == NULL || ph->host == NULL)
+	{
+		free(ph->idle);
+		free(ph->host);
+		free(ph);
+		return NULL;
+	}
+	ph->port = port;
+	ph->next = buckets[h];
+	buckets[h] = ph;
+	return ph;
+}
+
+/*
+ * Close the connections of a host that have been idle
+ * for too long, they are the oldest ones. Must hold sem.
+ */
+static void expire_host(pool_host *ph, time_t now)
+{
+	int i, n = 0;
+
+	while (n < ph->nidle && now - ph->idle[n].since >= idle_timeout)
+		n++;
+	if (n == 0)
+		return;
+
+	for (i = 0; i < n; i++)
+		close(ph->idle[i].fd);
+	memmove(ph->idle, ph->idle + n, (ph->nidle - n) * sizeof(pool_conn));
+	ph->nidle -= n;
+	n_stale += n;
+	return;
+}
+
+/*
+ * Expire idle connections of all hosts, at most
+ * once a second. Must hold sem.
+ */
+static void sweep_pool(time_t now)
+{
+	pool_host *ph;
+	int i;
+
+	if (now == last_sweep)
+		return;
+	last_sweep = now;
+
+	for (i = 0; i < POOL_BUCKETS; i++)
+	{
+		for (ph = buckets[i]; ph != NULL; ph = ph->next)
+			expire_host(ph, now);
+	}
+	return;
+}
+
+/*
+ * Health check before reuse: an idle connection must have
+ * nothing to read, EOF or stray bytes mean it is unusable
+ */
+static int conn_alive(int fd)
+{
+	char c;
+	ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+	return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
@@ -0,0 +1,23 @@
+/*
+ * pool.h -- Declaration of the pool of idle server connections
+ *			 for 15-213 proxy lab
+ *
+ * Team Member1: Cheng Zhang, Andrew ID: chengzh1
+ * Team Member2: Zhe Qian, Andrew ID: zheq
+ *
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdio.h>
+
+/* Declaration of some method that is used in proxy.c and event.c */
+void pool_init(int max_per_host, int idle_secs);
+int pool_enabled(void);
+int pool_get(char *host, int port);
+void pool_put(char *host, int port, int fd);
+void pool_connected(long usecs);
+void pool_stats(FILE *fp);
+
+#endif
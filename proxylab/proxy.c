@@ -4,30 +4,128 @@
  * Name: Zhe Qian, Andrew ID: zheq
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <sys/prctl.h>
 #include "csapp.h"
 #include "cache.h"
+#include "sbuf.h"
+#include "http.h"
+#include "event.h"
+#include "pool.h"
+#include "dns.h"
+#include "disk.h"
+#include "shm.h"
 
-/* You won't lose style points for including these long lines in your code */
-static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
-static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
-static const char *accept_encoding_hdr = "Accept-Encoding: gzip, deflate\r\n";
-static const char *connection_hdr = "Connection: close\r\n";
-static const char *proxy_connection_hdr = "Proxy-Connection: close\r\n";
-static const char *default_http_version = "HTTP/1.0\r\n";
-
-static cache_list *cache_inst;
-
-void doit(int fd);
-int generate_request(rio_t *rp, char *i_request, char *i_host, 
-        char *i_uri, int *i_port);
-int parse_reqline(char *new_request, char *reqline, 
-        char *host, char *uri, int *port);
-int parse_uri(char *uri, char *host, int *port, char *uri_nohost);
-void get_key_value(char *header_line, char *key, char *value);
-void get_host_port(char *value, char *host, int *port);
+/* Default size of the worker pool and of the connection queue */
+#define DEFAULT_NTHREADS 16
+#define DEFAULT_QUEUE_SIZE 64
+
+/* Default seconds an idle client connection is kept open */
+#define DEFAULT_IDLE_TIMEOUT 5
+
+/* Default size of the server connection pool */
+#define DEFAULT_POOL_PER_HOST 8
+#define DEFAULT_POOL_IDLE 15
+
+/* Default seconds a resolved server name is kept */
+#define DEFAULT_DNS_TTL 60
+
+/* Default seconds a response that does not tell stays fresh */
+#define DEFAULT_TTL 600
+
+/* Default size of the disk tier of the cache, if it has a file */
+#define DEFAULT_DISK_SIZE (1UL << 30)
+
+/* 
+ * Room of the shared memory of the workers besides twice the cache
+ * size, for the tables and the blocks not counted yet or any more.
+ * Pages are only taken once they are used.
+ */
+#define SHM_SLACK (64UL << 20)
+
+/* relay_response() found a reused server connection closed */
+#define RELAY_RETRY (-1)
+
+/* Idle keep-alive clients of the thread engine look at the queue this often */
+#define IDLE_POLL_MS 100
+
+/* Bytes moved by one splice() call, the default pipe capacity */
+#define SPLICE_CHUNK 65536
+
+static cache_list *cache_inst;	/* with partitions, one per event loop */
+static int ncaches = 1;
+static sbuf_t sbuf;
+static int idle_timeout = DEFAULT_IDLE_TIMEOUT;
+static sigset_t stats_mask;
+static char *snapshot_path;
+static int is_worker;
+
+/* The cache as the options ask, the master of the workers remakes it */
+static char *cache_policy = CACHE_POLICY;
+static size_t cache_size = MAX_CACHE_SIZE;
+static size_t object_size = MAX_OBJECT_SIZE;
+static int admission = 0;
+static int compress = 0;
+
+/* Bytes read from the server at once, also the copy fallback of splice */
+#define RELAY_BUFSIZE SPLICE_CHUNK
+
+/* Pipe of each worker for splice(), created on first use */
+static __thread int splice_pipe[2] = {-1, -1};
+
+/* 
+ * Buffers of each worker for relay_response, on the heap so a big
+ * max object size does not need a big stack. The copy of the body
+ * for the cache grows up to the largest object the worker cached.
+ */
+static __thread char *relay_buf;
+static __thread char *copy_buf;
+static __thread size_t copy_cap;
+
+/* Buffer of each worker for hits with a gzip body sent plain */
+static __thread char *plain_buf;
+static __thread size_t plain_cap;
+
+/* Relay counters, written atomically */
+static unsigned long n_relayed;
+static unsigned long n_spliced;
+static unsigned long long splice_bytes;
+
+void serve_client(int fd);
+int wait_client(int fd, rio_t *client_rio);
+int doit(int fd, rio_t *client_rio);
+int send_cached(int fd, cache_block *cb, int keep_alive, int gzip);
+cache_block *lookup(char *key, size_t key_len, char *request, 
+        size_t req_len);
+int fetch(int fd, http_request *req, char *request, char *key, 
+        size_t key_len, int keep_alive, cache_block *stale);
+void wake_worker(void *arg);
+int connect_server(int fd, char *host, int port, int *reused);
+int relay_response(int fd, int server_fd, http_request *req, 
+        char *request, char *key, size_t key_len, int keep_alive, 
+        int reused, int admit, cache_block *stale, int *server_keep);
+void cache_object(char *key, size_t key_len, char *request, 
+        size_t req_len, http_response *resp, char *obj, size_t obj_len);
+long long relay_splice(int fd, rio_t *rp, long long n, char *buf);
+void relay_stats(FILE *fp);
+int relay_chunk(int fd, char *buf, size_t n, unsigned int *total, 
+        int *fit_size);
+int parse_size(char *s, size_t *size);
+int generate_request(rio_t *rp, char *hdrs, http_request *req);
 void *thread(void *vargp);
+void *stats_thread(void *vargp);
+int init_caches(void);
+void save_cache(void);
+void start_workers(int nworkers);
+pid_t fork_worker(pid_t master, sigset_t *mask, int slot);
+void stop_workers(pid_t *pids, int n);
+void usage(char *prog);
 
 /* Customized response func */
 void client_error(int fd, char *cause, char *errnum, 
@@ -35,390 +133,1254 @@ void client_error(int fd, char *cause, char *errnum,
 
 /* Customized r/w func and error handler wrapper */
 int iOpen_clientfd_r(int fd, char *hostname, int port);
-ssize_t iRio_readnb(int fd, char *hostname, rio_t *rp, 
-        void *usrbuf, size_t n);
 int iRio_writen(int fd, void *usrbuf, size_t n);
 void iClose(int fd);
 
 
 int main(int argc, char **argv) {
-    int listenfd, port, clientlen;
-    int *connfdp;
+    int listenfd, connfd, port, clientlen;
+    int nthreads = 0;
+    int queue_size = DEFAULT_QUEUE_SIZE;
+    int shed = 0;
+    int use_epoll = 0;
+    int pool_per_host = DEFAULT_POOL_PER_HOST;
+    int pool_idle = DEFAULT_POOL_IDLE;
+    int dns_ttl = DEFAULT_DNS_TTL;
+    int default_ttl = DEFAULT_TTL;
+    int nworkers = 0;
+    int partition = 0;
+    char *disk_path = NULL;
+    size_t disk_size = DEFAULT_DISK_SIZE;
+    int i, opt;
     struct sockaddr_in clientaddr;
     pthread_t tid;
+    static struct option long_opts[] = {
+        {"threads", required_argument, NULL, 't'},
+        {"queue", required_argument, NULL, 'q'},
+        {"shed", no_argument, NULL, 's'},
+        {"engine", required_argument, NULL, 'e'},
+        {"idle-timeout", required_argument, NULL, 'i'},
+        {"pool", required_argument, NULL, 'p'},
+        {"pool-idle", required_argument, NULL, 'I'},
+        {"dns-ttl", required_argument, NULL, 'D'},
+        {"cache-policy", required_argument, NULL, 'C'},
+        {"admission", required_argument, NULL, 'A'},
+        {"cache-size", required_argument, NULL, 'S'},
+        {"object-size", required_argument, NULL, 'O'},
+        {"disk-cache", required_argument, NULL, 'F'},
+        {"disk-size", required_argument, NULL, 'Z'},
+        {"snapshot", required_argument, NULL, 'P'},
+        {"default-ttl", required_argument, NULL, 'T'},
+        {"compress", no_argument, NULL, 'z'},
+        {"workers", required_argument, NULL, 'W'},
+        {"partition", no_argument, NULL, 'N'},
+        {0, 0, 0, 0}
+    };
+
+    /* Parse command line options */
+    while ((opt = getopt_long(argc, argv, "t:q:se:i:p:", long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'q':
+            queue_size = atoi(optarg);
+            break;
+        case 's':
+            shed = 1;
+            break;
+        case 'e':
+            if (!strcmp(optarg, "epoll"))
+                use_epoll = 1;
+            else if (strcmp(optarg, "thread"))
+                usage(argv[0]);
+            break;
+        case 'i':
+            idle_timeout = atoi(optarg);
+            break;
+        case 'p':
+            pool_per_host = atoi(optarg);
+            break;
+        case 'I':
+            pool_idle = atoi(optarg);
+            break;
+        case 'D':
+            dns_ttl = atoi(optarg);
+            break;
+        case 'C':
+            cache_policy = optarg;
+            break;
+        case 'A':
+            admission = atoi(optarg);
+            break;
+        case 'S':
+            if (parse_size(optarg, &cache_size) < 0)
+                usage(argv[0]);
+            break;
+        case 'O':
+            if (parse_size(optarg, &object_size) < 0)
+                usage(argv[0]);
+            break;
+        case 'F':
+            disk_path = optarg;
+            break;
+        case 'Z':
+            if (parse_size(optarg, &disk_size) < 0)
+                usage(argv[0]);
+            break;
+        case 'P':
+            snapshot_path = optarg;
+            break;
+        case 'T':
+            default_ttl = atoi(optarg);
+            break;
+        case 'z':
+            compress = 1;
+            break;
+        case 'W':
+            nworkers = atoi(optarg);
+            break;
+        case 'N':
+            partition = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    /* Check command line args number */
+    if (optind != argc - 1 || nthreads < 0 || queue_size <= 0 ||
+            nworkers < 0 || nworkers >= SHM_WORKERS)
+        usage(argv[0]);
+
+    /* One event loop per core, split over the processes, or a fixed pool */
+    if (nthreads == 0 && use_epoll) {
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (nworkers > 0 && (nthreads /= nworkers) == 0)
+            nthreads = 1;
+    } else if (nthreads == 0) {
+        nthreads = DEFAULT_NTHREADS;
+    }
+
+    port = atoi(argv[optind]);
+
+    /* 
+     * Worker processes share the cache, it goes in shared memory.
+     * The index of the disk tier is in the memory of one process.
+     */
+    if (nworkers > 0) {
+        if (disk_path != NULL)
+            app_error("The disk cache can not be used with workers");
+        if (cache_size > (SIZE_MAX - SHM_SLACK) / 2)
+            app_error("The cache is too big for the shared memory");
+        if (shm_init(2 * cache_size + SHM_SLACK) < 0)
+            unix_error("Can not map the shared memory of the cache");
+    }
+
+    /* 
+     * With partitions, each event loop has a cache of its own with a
+     * share of the cache size. The snapshot and the workers need the
+     * one cache of all.
+     */
+    if (partition) {
+        if (!use_epoll)
+            app_error("Partitions of the cache need the epoll engine");
+        if (snapshot_path != NULL || nworkers > 0)
+            app_error("Partitions of the cache can not be used with "
+                "a snapshot or with workers");
+        ncaches = nthreads;
+    }
 
     /* Cache list initiation */
-    cache_inst = (cache_list *)malloc(sizeof(cache_list));
-    init_cache_list(cache_inst);
+    if (init_caches() < 0) {
+        if (ncaches > 1)
+            app_error("A partition of the cache can not hold an "
+                "object, raise --cache-size");
+        usage(argv[0]);
+    }
 
-    /* Check command line args number */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        exit(1);
+    /* Objects evicted from memory go to the disk tier, if any */
+    if (disk_path != NULL && disk_init(disk_path, disk_size, 
+                object_size) < 0)
+        app_error("Can not use the disk cache file, or it is too small");
+
+    /* Start with what the cache held when the last proxy stopped */
+    if (snapshot_path != NULL && 
+            (i = cache_load(cache_inst, snapshot_path)) >= 0) {
+        printf("cache: %d objects loaded from %s\n", i, snapshot_path);
+        fflush(stdout);
     }
 
-    port = atoi(argv[1]);
+    /* Server connection pool, servers keep connections open for it */
+    pool_init(pool_per_host, pool_idle);
+
+    /* Resolved server names are kept for dns_ttl seconds */
+    dns_init(dns_ttl);
+    http_init(pool_enabled(), default_ttl);
 
     /* Ignore SIGPIPE signal */
     Signal(SIGPIPE, SIG_IGN);
 
-    /* Open listening port */
-    listenfd = Open_listenfd(port);
+    /* The master process stays in there, workers go on from here */
+    if (nworkers > 0)
+        start_workers(nworkers);
+
+    /* 
+     * Block SIGUSR1 in every thread, the stats thread waits for it,
+     * and with a snapshot file SIGUSR2 and SIGTERM to save the cache.
+     * The master of the workers saves it.
+     */
+    Sigemptyset(&stats_mask);
+    Sigaddset(&stats_mask, SIGUSR1);
+    if (snapshot_path != NULL && !is_worker) {
+        Sigaddset(&stats_mask, SIGUSR2);
+        Sigaddset(&stats_mask, SIGTERM);
+    }
+    pthread_sigmask(SIG_BLOCK, &stats_mask, NULL);
+    Pthread_create(&tid, NULL, stats_thread, NULL);
+
+    /* Open listening port, each worker has a socket of its own */
+    listenfd = is_worker ? Open_listenfd_reuseport(port) 
+                         : Open_listenfd(port);
+
+    /* Event-driven engine, never returns */
+    if (use_epoll)
+        event_run(listenfd, nthreads, idle_timeout, cache_inst, ncaches > 1);
+
+    /* Prethread the worker pool */
+    sbuf_init(&sbuf, queue_size);
+    for (i = 0; i < nthreads; i++)
+        Pthread_create(&tid, NULL, thread, NULL);
 
     while (1) {
         clientlen = sizeof(clientaddr);
-        connfdp = (int *)malloc(sizeof(int));
-        *connfdp = Accept(listenfd, (SA *)&clientaddr, 
+        connfd = Accept(listenfd, (SA *)&clientaddr, 
                     (socklen_t *)&clientlen);
-        Pthread_create(&tid, NULL, thread, connfdp);
+
+        /* 
+         * When every worker is busy and the queue is full,
+         * either wait for a free slot or turn the client away
+         */
+        if (!shed) {
+            sbuf_insert(&sbuf, connfd);
+        } else if (!sbuf_tryinsert(&sbuf, connfd)) {
+            client_error(connfd, "connection queue", "503", 
+                "Service Unavailable", "Proxy is overloaded, try again later");
+            iClose(connfd);
+        }
     }
     
     return 0;
 }
 
-/* 
- * Process the request 
+/*
+ * Print the usage message and exit
+ */
+void usage(char *prog) {
+    fprintf(stderr, "usage: %s [-e engine] [-t threads] [-q queue_size] [-s] "
+        "[-i secs] [-p conns] <port>\n", prog);
+    fprintf(stderr, "  -e, --engine   thread (default) or epoll\n");
+    fprintf(stderr, "  -t, --threads  number of worker threads (default %d), "
+        "or event loops (default one per core)\n", DEFAULT_NTHREADS);
+    fprintf(stderr, "  -q, --queue    connection queue size (default %d)\n",
+        DEFAULT_QUEUE_SIZE);
+    fprintf(stderr, "  -s, --shed     reply 503 instead of blocking "
+        "when the queue is full\n");
+    fprintf(stderr, "  -i, --idle-timeout  seconds to keep an idle client "
+        "connection (default %d, 0 closes after each response, the "
+        "thread engine closes it sooner when connections wait)\n",
+        DEFAULT_IDLE_TIMEOUT);
+    fprintf(stderr, "  -p, --pool     idle server connections kept per host "
+        "(default %d, 0 closes them)\n", DEFAULT_POOL_PER_HOST);
+    fprintf(stderr, "      --pool-idle  seconds an idle server connection "
+        "is kept (default %d)\n", DEFAULT_POOL_IDLE);
+    fprintf(stderr, "      --dns-ttl    seconds a resolved server name "
+        "is kept (default %d, 0 keeps none)\n", DEFAULT_DNS_TTL);
+    fprintf(stderr, "      --cache-policy  eviction policy: clock (default), "
+        "lru, lfu, gdsf or s3fifo\n");
+    fprintf(stderr, "      --cache-size  bytes of memory for the cache, "
+        "k, m or g may follow (default %d)\n", MAX_CACHE_SIZE);
+    fprintf(stderr, "      --object-size  responses from this size on "
+        "are not cached (default %d)\n", MAX_OBJECT_SIZE);
+    fprintf(stderr, "      --default-ttl  seconds a response that does "
+        "not tell how long it is fresh stays fresh (default %d)\n", 
+        DEFAULT_TTL);
+    fprintf(stderr, "      --admission  cache an object only on its second "
+        "miss within about this many misses (default 0, always cache)\n");
+    fprintf(stderr, "      --compress  keep the bodies of text objects "
+        "gzip in memory\n");
+    fprintf(stderr, "      --disk-cache  file that keeps objects evicted "
+        "from memory (default none)\n");
+    fprintf(stderr, "      --disk-size  bytes of the disk cache file, "
+        "k, m or g may follow (default %lu)\n", DEFAULT_DISK_SIZE);
+    fprintf(stderr, "      --snapshot  file the cache is loaded from at "
+        "startup and saved to on SIGUSR2 and SIGTERM\n");
+    fprintf(stderr, "      --workers  processes that accept on the port "
+        "and share the cache (default 0, one process, at most %d)\n",
+        SHM_WORKERS - 1);
+    fprintf(stderr, "      --partition  with epoll, a share of the cache "
+        "for each event loop, a request moves to the loop owning its "
+        "url\n");
+    fprintf(stderr, "Send SIGUSR1 to print the statistics.\n");
+    exit(1);
+}
+
+/*
+ * Serve the requests of a client until it closes the connection,
+ * or is idle while other clients wait, see wait_client. Pipelined
+ * requests are already waiting in client_rio and they are answered
+ * in the order they came
  */
-void doit(int fd) {
+void serve_client(int fd) {
     rio_t client_rio;
-    rio_t server_rio;
-    unsigned int total = 0;
-    int fit_size = 1;
-    char* content_copy = NULL;
-    int content_size = 0;
-
-    char *uri = (char *)malloc(MAXLINE * sizeof(char));
-    char *request = (char *)malloc(MAXLINE * sizeof(char));
-    char *host = (char *)malloc(MAXLINE * sizeof(char));
-    int port;
-    int server_fd;
+    struct timeval tv;
+    int one = 1;
 
     Rio_readinitb(&client_rio, fd);
 
+    /* Our responses go out in pieces, do not let Nagle hold them back */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    /* Give up on a client that stays idle for too long */
+    if (idle_timeout > 0) {
+        tv.tv_sec = idle_timeout;
+        tv.tv_usec = 0;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+
+    while (doit(fd, &client_rio) && wait_client(fd, &client_rio))
+        ;
+}
+
+/*
+ * Wait for the next request of a keep-alive client, return 0 to
+ * close the connection. A worker thread keeps an idle client only
+ * while no new connection waits in the queue for a thread, and at
+ * most for the idle timeout.
+ */
+int wait_client(int fd, rio_t *client_rio) {
+    struct pollfd pfd;
+    int waited = 0;
+
+    /* pipelined requests are answered first */
+    if (client_rio->rio_cnt > 0)
+        return 1;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (poll(&pfd, 1, IDLE_POLL_MS) == 0) {
+        waited += IDLE_POLL_MS;
+        if (sbuf_waiting(&sbuf) > 0 || waited >= idle_timeout * 1000)
+            return 0;
+    }
+    return 1;
+}
+
+/* 
+ * Process one request, return 1 if the connection 
+ * should stay open for the next request
+ */
+int doit(int fd, rio_t *client_rio) {
+    cache_block *hit, *stale = NULL;
+    int keep_alive;
+
+    char hdrs[MAX_REQ_HDRS];
+    char request[MAX_REQUEST];
+    char key[HTTP_MAX_KEY];
+    size_t key_len;
+    http_request req;
+    struct iovec iov[HTTP_REQ_IOV];
+    int niov;
+    int rc, fill = FILL_FETCH, waited = 0;
+    cache_waiter waiter;
+    sem_t wake_sem;
+
     /* Check if the request is a GET request */
-    int is_get = generate_request(&client_rio, request, host, uri, &port);   
-    if(!is_get) {
-        free(request);
-        free(host);
-        free(uri);
-        return;
-    }
-
-    /* First: read in cache */
-    content_copy = read_cache(cache_inst, request, &content_size);
-    /* Cache hit: send cached response back to client */
-    if (content_size > 0){ 
-        if (content_copy == NULL){
-            printf("content in cache error\n");
-            return;
+    int is_get = generate_request(client_rio, hdrs, &req);
+    if(is_get <= 0) {
+        if (is_get == 0)
+            client_error(fd, "method", "501", "Not Implemented",
+                "Proxy does not implement this method");
+        return 0;
+    }
+    keep_alive = idle_timeout > 0 ? req.keep_alive : 0;
+
+    /* The request for the server, flattened for the Vary headers */
+    niov = http_request_iov(&req, iov);
+    if (http_flatten(iov, niov, request, MAX_REQUEST) < 0)
+        return 0;
+
+    /* The cache id is the url, a request with credentials skips the cache */
+    if ((key_len = http_cache_key(&req, key, sizeof(key))) == 0)
+        return fetch(fd, &req, request, NULL, 0, keep_alive, NULL);
+
+    waiter.wake = wake_worker;
+    waiter.arg = &wake_sem;
+
+    /* 
+     * First: read in cache. On a miss, fetch the object unless 
+     * another request fetches it already, then wait for that one.
+     * A stale object is a miss too, the fetch revalidates it.
+     */
+    while (1) {
+        hit = lookup(key, key_len, request, req.len);
+        /* Cache hit: send cached response straight from the cache */
+        if (hit != NULL && cache_fresh(hit)) { 
+            keep_alive = send_cached(fd, hit, keep_alive, req.gzip);
+            cache_release(hit);
+            if (stale != NULL)
+                cache_release(stale);
+            return keep_alive;
         }
+        if (stale != NULL)
+            cache_release(stale);
+        stale = hit;
+        if (waited)
+            break;
 
-        iRio_writen(fd, content_copy, content_size);
-        free(content_copy);
-        free(request);
-        free(host);
-        free(uri);
-        return;
-    }  
+        Sem_init(&wake_sem, 0, 0);
+        fill = cache_fill_begin(cache_inst, key, &waiter);
+        if (fill == FILL_FETCH)
+            break;
+        if (fill == FILL_WAIT) {
+            P(&wake_sem);
+            waited = 1;
+        }
+    }
 
     /* Cache miss: connect to server to get response */
-    server_fd = iOpen_clientfd_r(fd, host, port);
-    /* Open connection error */
-    if (server_fd < 0) {   
-        free(request);
-        free(host);
-        free(uri);
-        return;
-    }
-        
-    Rio_readinitb(&server_rio, server_fd);
-    int server_connect = 0;
-    /* Send request to server */
-    server_connect = iRio_writen(server_fd, request, strlen(request));
-    if (server_connect < 0) {
-        iClose(server_fd);
-        free(request);
-        free(host);
-        free(uri);
-        return;
+    rc = fetch(fd, &req, request, key, key_len, keep_alive, stale);
+    if (fill == FILL_FETCH)
+        cache_fill_end(cache_inst, key);
+    if (stale != NULL)
+        cache_release(stale);
+    return rc;
+}
+
+/*
+ * Look up the object with the cache id key, the url of key_len 
+ * bytes. If a Vary marker is cached under the url, the headers it
+ * names are added to key from request and the variant of this
+ * request is looked up, key is its id afterwards.
+ */
+cache_block *lookup(char *key, size_t key_len, char *request, 
+        size_t req_len) {
+    cache_block *cb;
+    const char *vary;
+    int len;
+
+    key[key_len] = '\0';
+    cb = read_cache(cache_inst, key);
+    if (cb != NULL && (vary = http_vary(cb->content, cb->head_size))) {
+        len = http_vary_key(request, req_len, vary, key, key_len, 
+                HTTP_MAX_KEY);
+        cache_release(cb);
+        cb = len > 0 ? read_cache(cache_inst, key) : NULL;
     }
+    return cb;
+}
 
-    /* Forward response from the server to the client through connfd */
-    ssize_t nread;
-    char buf[MAX_OBJECT_SIZE];
-    char content[MAX_OBJECT_SIZE];
-
-    /* Keep reading until the end of response */
-    while ((nread = iRio_readnb(fd, host, &server_rio, 
-                buf, MAX_OBJECT_SIZE)) != 0) {
-        if(nread < 0) {
-            free(request);
-            free(host);
-            free(uri);
-            return;
-        }
+/*
+ * Fetch the response to request from the server and relay 
+ * it to the client, return 1 if the client stays connected.
+ * It is cached under the url key of key_len bytes, not at all 
+ * if key is NULL. If there is a stale object, ask the server 
+ * if it changed.
+ */
+int fetch(int fd, http_request *req, char *request, char *key, 
+        size_t key_len, int keep_alive, cache_block *stale) {
+    struct iovec iov[HTTP_REQ_IOV];
+    char cond[MAX_REQUEST + 2 * MAXLINE];
+    int server_fd, niov, cond_len = 0;
+    int reused, server_keep, rc;
+    int admit = stale != NULL ? 1 : 
+        key != NULL ? cache_admit(cache_inst, key) : 0;
+
+    /* Without validators a stale object can only be fetched again */
+    if (stale != NULL && (cond_len = http_revalidate(request, req->len, 
+                    stale->content, stale->head_size, cond, 
+                    sizeof(cond))) == 0)
+        stale = NULL;
+
+    while (1) {
+        server_fd = connect_server(fd, req->host, req->port, &reused);
+        /* Open connection error */
+        if (server_fd < 0)
+            return 0;
 
-        /* store the response and check if it extends the max object size*/
-        if ((total + nread) < MAX_OBJECT_SIZE){
-            memcpy(content + total, buf, sizeof(char) * nread);
-            total += nread;
-        }else{
-            printf("web content object is too lage!\n");
-            fit_size = 0;
+        /* Send request to server, the pieces go out in one writev */
+        niov = http_request_iov(req, iov);
+        if ((cond_len > 0 ? rio_writen(server_fd, cond, cond_len) : 
+                    rio_writev(server_fd, iov, niov)) < 0) {
+            iClose(server_fd);
+            /* the pooled connection went stale, try another one */
+            if (reused)
+                continue;
+            return 0;
         }
-        /* Forward response back to client */
-        iRio_writen(fd, buf, nread);
+
+        /* Forward response from the server to the client through connfd */
+        rc = relay_response(fd, server_fd, req, request, key, key_len,
+                keep_alive, reused, admit, stale, &server_keep);
+        if (rc != RELAY_RETRY)
+            break;
+        iClose(server_fd);
     }
 
-    /* Close proxy-server connection */
-    iClose(server_fd);
+    /* Keep the proxy-server connection for the next miss, or close it */
+    if (server_keep)
+        pool_put(req->host, req->port, server_fd);
+    else
+        iClose(server_fd);
+    return rc;
+}
+
+/*
+ * Wake a worker waiting for an object being fetched
+ */
+void wake_worker(void *arg) {
+    V((sem_t *)arg);
+}
 
-    /* Cache the response object if it fit the max object size */
-    if (fit_size == 1){
-        if (strstr(content, "no-cache") != NULL){
-            printf("cache control is no cache, do not cache\n");
-        }else{
-            printf("cache the web content object uri: %s\n", uri);
-            modify_cache(cache_inst, request, content, total);
-        }
-    } 
- 
-    free(request);
-    free(host);
-    free(uri);
-    return;
+/*
+ * Get a connection to the server, reuse an idle one from 
+ * the pool if possible, *reused tells which one we got
+ */
+int connect_server(int fd, char *host, int port, int *reused) {
+    struct timeval start, end;
+    int server_fd;
+
+    if ((server_fd = pool_get(host, port)) >= 0) {
+        *reused = 1;
+        return server_fd;
+    }
+
+    *reused = 0;
+    gettimeofday(&start, NULL);
+    if ((server_fd = iOpen_clientfd_r(fd, host, port)) >= 0) {
+        gettimeofday(&end, NULL);
+        pool_connected((end.tv_sec - start.tv_sec) * 1000000L + 
+                (end.tv_usec - start.tv_usec));
+    }
+    return server_fd;
 }
 
-/* 
- * Generate a new request for server according to the request from clinet
+/*
+ * Send a cached object with our own Connection header, its
+ * shared body if it has one after the rest of its content. A gzip
+ * body is sent as it is if the client takes gzip, else plain.
+ * Return 1 if the connection can stay open.
  */
-int generate_request(rio_t *rp, char *i_request, char *i_host, 
-            char *i_uri, int *i_port) {
-    char buf[MAXLINE]; 
-    char key[MAXLINE];
-    char value[MAXLINE];
-    char raw[MAXLINE]; 
-    int port = 80;
-    int host_in_reqbody = 0; 
-    char* request = i_request;
-    char* host = i_host;
-    char* uri = i_uri;
-
-    *buf = 0;
-    *key = 0;
-    *value = 0;
-    *raw = 0;
-    *request = 0;
-    *host = 0;
-
-    if (rio_readlineb(rp, buf, MAXLINE) < 0){
-        printf("rio_readlineb error\n");
+int send_cached(int fd, cache_block *cb, int keep_alive, int gzip) {
+    struct iovec iov[4];
+    char zip_head[MAX_RESP_HDRS + MAXLINE];
+    const char *conn_hdr = http_conn_hdr(keep_alive);
+    size_t head_len = http_object_head(cb->content, cb->head_size);
+    size_t zip_len = 0, cap;
+    char *p;
+
+    if (head_len == cb->block_size) {
+        iRio_writen(fd, cb->content, cb->block_size);
         return 0;
     }
 
-    /* Store the raw request, for debugging */
-    strcat(raw, buf);
+    iov[0].iov_base = cb->content;
+    iov[0].iov_len = head_len;
+    iov[1].iov_base = (char *)conn_hdr;
+    iov[1].iov_len = strlen(conn_hdr);
+    iov[2].iov_base = cb->content + head_len + 2;
+    iov[2].iov_len = cb->head_size - head_len - 2;
+    iov[3].iov_base = cb->body != NULL ? cb->body->data : NULL;
+    iov[3].iov_len = cb->block_size - cb->head_size;
+
+    if (cb->body != NULL && cb->body->zsize > 0) {
+        if (gzip && (zip_len = http_gzip_head(cb->content, head_len, 
+                        cb->body->zsize, zip_head, sizeof(zip_head))) > 0) {
+            iov[0].iov_base = zip_head;
+            iov[0].iov_len = zip_len;
+            iov[3].iov_len = cb->body->zsize;
+            cache_gzip_hit(cb);
+        } else {
+            /* the buffer grows up to the largest body sent plain */
+            if (plain_cap < cb->body->size) {
+                for (cap = plain_cap ? plain_cap : RELAY_BUFSIZE; 
+                        cap < cb->body->size; )
+                    cap *= 2;
+                if ((p = realloc(plain_buf, cap)) == NULL)
+                    return 0;
+                plain_buf = p;
+                plain_cap = cap;
+            }
+            if (cache_inflate(cb, plain_buf) < 0)
+                return 0;
+            iov[3].iov_base = plain_buf;
+        }
+    }
+
+    if (rio_writev(fd, iov, 4) < 0)
+        return 0;
+    return keep_alive;
+}
 
-    /* Parse the request line to get the host, uri and port */
-    int is_get = parse_reqline(request, buf, host, uri, &port);
+/*
+ * Forward the response of the server to the client, and cache it
+ * if it fits and admit allows it. The body is relayed according to
+ * its framing, so the client connection can stay open afterwards.
+ * Return 1 if it can, or RELAY_RETRY if a reused server connection
+ * turned out to be closed before anything was sent. *server_keep
+ * tells if the server connection can go back to the pool. If the
+ * request was to revalidate stale and the server answers 304, 
+ * stale is sent instead.
+ */
+int relay_response(int fd, int server_fd, http_request *req, 
+            char *request, char *key, size_t key_len, int keep_alive, 
+            int reused, int admit, cache_block *stale, int *server_keep) {
+    http_freshness fresh;
+    rio_t server_rio;
+    http_response resp;
+    char line[MAXLINE];
+    char hdrs[MAX_RESP_HDRS];
+    char head[MAX_RESP_HDRS];
+    char *buf;
+    size_t hdrs_len = 0;
+    int head_len;
+    struct iovec iov[2];
+    const char *conn_hdr;
+    unsigned long long left;
+    unsigned int total = 0;
+    int fit_size = admit;
+    long long spliced = 0, moved;
+    ssize_t nread;
 
-    if(!is_get)
+    *server_keep = 0;
+    if (relay_buf == NULL && (relay_buf = malloc(RELAY_BUFSIZE)) == NULL) {
+        client_error(fd, req->host, "502", "Bad Gateway",
+            "Proxy is out of memory");
         return 0;
+    }
+    buf = relay_buf;
+    Rio_readinitb(&server_rio, server_fd);
 
-    /* Concat the specified request header */
-    strcat(request, user_agent_hdr);
-    strcat(request, accept_hdr);
-    strcat(request, accept_encoding_hdr);
-    strcat(request, connection_hdr);
-    strcat(request, proxy_connection_hdr);
-
-    /* Go through the request line by line */
-    while (strcmp(buf, "\r\n")) {
-        *key = '\0';
-        *value = '\0';
-        if (rio_readlineb(rp, buf, MAXLINE) < 0){
-            printf("rio_readlineb error\n");
+    /* Read the response headers up to the empty line */
+    do {
+        if ((nread = rio_readlineb(&server_rio, line, MAXLINE)) <= 0) {
+            if (reused && hdrs_len == 0)
+                return RELAY_RETRY;
+            client_error(fd, req->host, "502", "Bad Gateway",
+                "Proxy got no response from this server");
             return 0;
         }
-        strcat(raw, buf);
+        if (hdrs_len + nread >= MAX_RESP_HDRS) {
+            client_error(fd, req->host, "502", "Bad Gateway",
+                "Response headers from this server are too large");
+            return 0;
+        }
+        memcpy(hdrs + hdrs_len, line, nread);
+        hdrs_len += nread;
+    } while (strcmp(line, "\r\n") && strcmp(line, "\n"));
+    hdrs[hdrs_len] = '\0';
+
+    if ((head_len = http_parse_response(hdrs, head, &resp)) < 0) {
+        client_error(fd, req->host, "502", "Bad Gateway",
+            "Proxy got a malformed response from this server");
+        return 0;
+    }
 
-        if (!strcmp(buf, "\r\n"))
-            break;
+    /* 
+     * Not changed: the stored object is fresh again with the 
+     * headers of the 304 over its own, and it is what we send
+     */
+    if (stale != NULL && resp.status == 304) {
+        *server_keep = resp.keep_alive && server_rio.rio_cnt == 0;
+        http_object_freshness(stale->content, stale->head_size, &fresh);
+        http_freshness_update(&fresh, &resp.fresh);
+        cache_refresh(cache_inst, stale, http_expires(&fresh, time(NULL)));
+        return send_cached(fd, stale, keep_alive, req->gzip);
+    }
+
+    /* Without a length the client can only see the end if we close */
+    if (resp.framing == BODY_CLOSE)
+        keep_alive = 0;
 
-        /* Extract one key-value pair from one header line */
-        get_key_value(buf, key, value);
-        if (*key != '\0' && *value!='\0') {
-            /* If the request body has Host header itself, use it */
-            if (!strcmp(key, "Host")) {
-                get_host_port(value, host, &port);
-                host_in_reqbody = 1;
+    /* 
+     * A response that will not be cached needs no copy at all,
+     * its body goes from socket to socket through relay_splice
+     */
+    if (!http_cacheable(&resp) || (resp.framing == BODY_LENGTH &&
+            resp.content_length + head_len >= cache_inst->max_object))
+        fit_size = 0;
+
+    conn_hdr = http_conn_hdr(keep_alive);
+    iov[0].iov_base = head;
+    iov[0].iov_len = head_len;
+    iov[1].iov_base = (char *)conn_hdr;
+    iov[1].iov_len = strlen(conn_hdr);
+    if (rio_writev(fd, iov, 2) < 0)
+        return 0;
+
+    /* 
+     * Keep reading until the end of response, each piece goes to 
+     * the client as soon as it arrives, not once the buffer is full
+     */
+    switch (resp.framing) {
+    case BODY_LENGTH:
+        left = resp.content_length;
+        while (left > 0) {
+            if (!fit_size) {
+                if ((moved = relay_splice(fd, &server_rio, left, buf)) < 0)
+                    return 0;
+                spliced += moved;
+                break;
+            }
+            nread = rio_readsomeb(&server_rio, buf, 
+                        left < RELAY_BUFSIZE ? left : RELAY_BUFSIZE);
+            if (nread <= 0 || 
+                    relay_chunk(fd, buf, nread, &total, &fit_size) < 0)
+                return 0;
+            left -= nread;
+        }
+        break;
+
+    case BODY_CHUNKED:
+        while (1) {
+            /* Chunk size line, then the chunk data and its "\r\n" */
+            if ((nread = rio_readlineb(&server_rio, line, MAXLINE)) <= 0 ||
+                    relay_chunk(fd, line, nread, &total, &fit_size) < 0)
+                return 0;
+            if ((left = strtoull(line, NULL, 16)) == 0)
+                break;
+            left += 2;
+            while (left > 0) {
+                if (!fit_size) {
+                    if ((moved = relay_splice(fd, &server_rio, left, 
+                                    buf)) < 0)
+                        return 0;
+                    spliced += moved;
+                    break;
+                }
+                nread = rio_readsomeb(&server_rio, buf, 
+                            left < RELAY_BUFSIZE ? left : RELAY_BUFSIZE);
+                if (nread <= 0 || 
+                        relay_chunk(fd, buf, nread, &total, &fit_size) < 0)
+                    return 0;
+                left -= nread;
             }
-            /* If the key-value pair is not specified, add it */
-            if (strcmp(key, "User-Agent") && 
-                    strcmp(key, "Accept") && 
-                    strcmp(key, "Accept-Encoding") &&
-                    strcmp(key, "Connection") &&
-                    strcmp(key, "Proxy-Connection")) {
-
-                char hdrline[MAXLINE];
-                sprintf(hdrline, "%s: %s\r\n", key, value);
-                strcat(request, hdrline);
+        }
+        /* Trailer lines up to the empty line */
+        do {
+            if ((nread = rio_readlineb(&server_rio, line, MAXLINE)) <= 0 ||
+                    relay_chunk(fd, line, nread, &total, &fit_size) < 0)
+                return 0;
+        } while (strcmp(line, "\r\n") && strcmp(line, "\n"));
+        break;
+
+    case BODY_CLOSE:
+        while (1) {
+            if (!fit_size) {
+                if ((moved = relay_splice(fd, &server_rio, -1, buf)) < 0)
+                    return 0;
+                spliced += moved;
+                break;
             }
+            nread = rio_readsomeb(&server_rio, buf, RELAY_BUFSIZE);
+            if (nread == 0)
+                break;
+            if (nread < 0 || 
+                    relay_chunk(fd, buf, nread, &total, &fit_size) < 0)
+                return 0;
         }
-    }
-    /*
-     * If request doesn't have a Host header, 
-     * combine the host and port from the 
-     * first request line as the Host header
-     */
-    if (!host_in_reqbody) {
-        char host_hdr[MAXLINE];
-        if (port != 80)
-            sprintf(host_hdr, "Host: %s:%d\r\n", host, port);
-        else 
-            sprintf(host_hdr, "Host: %s\r\n", host);
-
-        strcat(request, host_hdr);
+        break;
     }
 
-    *i_port = port;
+    /* The whole response is read, nothing more may be buffered */
+    *server_keep = resp.keep_alive && server_rio.rio_cnt == 0;
 
-    /* End the request with "\r\n" */
-    strcat(request, "\r\n");
+    __sync_fetch_and_add(&n_relayed, 1);
+    if (spliced > 0) {
+        __sync_fetch_and_add(&n_spliced, 1);
+        __sync_fetch_and_add(&splice_bytes, spliced);
+    }
 
-    return 1;
+    /* Cache the response object if it fit the max object size */
+    if (fit_size == 1){
+        size_t obj_len;
+        char *obj = http_cache_object(head, head_len, resp.framing, 
+                        copy_buf, total, &obj_len);
+
+        if (obj == NULL) {
+            printf("no memory to cache the web content object uri: %.*s\n",
+                (int)req->uri.len, req->uri.p);
+        } else if (obj_len >= cache_inst->max_object) {
+            printf("web content object is too large!\n");
+        } else {
+            printf("cache the web content object uri: %.*s\n", 
+                (int)req->uri.len, req->uri.p);
+            cache_object(key, key_len, request, req->len, &resp, 
+                obj, obj_len);
+        }
+        free(obj);
+    } 
+    return keep_alive;
 }
 
-/* 
- * Process the request line 
+/*
+ * Cache the response to request under the url key of key_len bytes.
+ * If it varies on request headers, a marker with their names goes 
+ * under the url and the response under the url and their values.
  */
-int parse_reqline(char *new_request, char *reqline, char *host, 
-            char *uri, int *port) {
-    char method[MAXLINE], version[MAXLINE];
-    char uri_nohost[MAXLINE];
-    char new_req[MAXLINE];
-    
-    /* Get method, uri, and version from the request line */
-    sscanf(reqline, "%s %s %s", method, uri, version);
-
-    /* Check if the method is GET */
-    if(strcasecmp(method, "GET"))
-        return 0;
-
-    /* Parse the uri accordingly */
-    parse_uri(uri, host, port, uri_nohost);
-
-    /* Generate a new request line as required */
-    sprintf(new_req, "%s %s %s", method, uri_nohost, default_http_version);
-    strcat(new_request, new_req);
-    return 1;
+void cache_object(char *key, size_t key_len, char *request, 
+        size_t req_len, http_response *resp, char *obj, size_t obj_len) {
+    char id[HTTP_MAX_KEY];
+    char marker[HTTP_MAX_VARY + 8];
+    size_t marker_len;
+    time_t expires = http_expires(&resp->fresh, time(NULL));
+
+    memcpy(id, key, key_len);
+    id[key_len] = '\0';
+    if (resp->vary[0] != '\0') {
+        if ((marker_len = http_vary_marker(resp->vary, marker, 
+                        sizeof(marker))) == 0)
+            return;
+        modify_cache(cache_inst, id, marker, marker_len, expires);
+        if (http_vary_key(request, req_len, resp->vary, id, key_len, 
+                    sizeof(id)) == 0)
+            return;
+    }
+    modify_cache(cache_inst, id, obj, obj_len, expires);
 }
 
 /*
- * Process the uri string
+ * Relay n body bytes from the server to the client, or all of them
+ * up to EOF if n < 0, without copying them through user space: the
+ * bytes rio buffered already are written out, the rest moves from 
+ * socket to pipe to socket. Falls back to copying through buf where
+ * splice() is not supported. Return the bytes spliced, -1 on error.
  */
-int parse_uri(char *uri, char *host, int *port, char *uri_nohost) {
-    char *uri_ptr, *first_slash_ptr;
-    char host_str[MAXLINE], port_str[MAXLINE];
-    *host = 0;
-    *port = 80;
-
-    /* Find the start of "http://" */
-    uri_ptr = strstr(uri, "http://");        
-
-    /* If not start with "http://", just return with the uri */
-    if (uri_ptr == NULL) {
-        strcpy(uri_nohost, uri);
-        return 0;
-    } else {
-        /* Get to the start of the Host string */
-        uri_ptr += 7;
+long long relay_splice(int fd, rio_t *rp, long long n, char *buf) {
+    long long spliced = 0;
+    ssize_t in, out;
+    size_t want;
+
+    /* What the header reads pulled in already */
+    if (rp->rio_cnt > 0) {
+        want = (n >= 0 && n < rp->rio_cnt) ? n : rp->rio_cnt;
+        if (iRio_writen(fd, rp->rio_bufptr, want) < 0)
+            return -1;
+        rp->rio_bufptr += want;
+        rp->rio_cnt -= want;
+        if (n >= 0)
+            n -= want;
+    }
 
-        /* Find the end of the Host string */
-        first_slash_ptr = strchr(uri_ptr,'/');
-        *first_slash_ptr = 0;
+    if (splice_pipe[0] < 0 && pipe(splice_pipe) < 0)
+        splice_pipe[0] = splice_pipe[1] = -1;
+
+    while (n != 0) {
+        want = (n < 0 || n > SPLICE_CHUNK) ? SPLICE_CHUNK : n;
+        if (splice_pipe[0] < 0) {
+            in = -1;
+            errno = EINVAL;
+        } else
+            in = splice(rp->rio_fd, NULL, splice_pipe[1], NULL, want, 
+                    SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EINVAL)
+                return -1;
+
+            /* no splice() for these descriptors, copy instead */
+            if ((in = read(rp->rio_fd, buf, want)) < 0) {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            if (in > 0 && iRio_writen(fd, buf, in) < 0)
+                return -1;
+        } else {
+            for (out = 0; out < in; ) {
+                ssize_t rc = splice(splice_pipe[0], NULL, fd, NULL, 
+                                in - out, SPLICE_F_MOVE | SPLICE_F_MORE);
+                if (rc <= 0) {
+                    if (rc < 0 && errno == EINTR)
+                        continue;
+                    /* the pipe holds bytes now, start over with a new one */
+                    close(splice_pipe[0]);
+                    close(splice_pipe[1]);
+                    splice_pipe[0] = splice_pipe[1] = -1;
+                    return -1;
+                }
+                out += rc;
+            }
+            spliced += in;
+        }
 
-        /* Get the Host string */
-        strcpy(host_str, uri_ptr);
+        /* a body without a length ends at EOF, any other is cut short */
+        if (in == 0)
+            return n < 0 ? spliced : -1;
+        if (n > 0)
+            n -= in;
+    }
+    return spliced;
+}
 
-        *first_slash_ptr = '/';
-        strcpy(uri_nohost, first_slash_ptr);
+/*
+ * Print how many responses were relayed, and how many bytes 
+ * went through splice() without a copy
+ */
+void relay_stats(FILE *fp) {
+    fprintf(fp, "relay: %lu responses, %lu spliced, "
+            "%llu bytes relayed zero-copy\n", 
+            n_relayed, n_spliced, splice_bytes);
+}
 
-        char *port_ptr;
+/*
+ * Forward a piece of the response back to client, and store it 
+ * in copy_buf as long as the response fits the max object size
+ */
+int relay_chunk(int fd, char *buf, size_t n, unsigned int *total, 
+            int *fit_size) {
+    size_t cap;
+    char *p;
+
+    if (*fit_size && (*total + n) >= cache_inst->max_object) {
+        printf("web content object is too large!\n");
+        *fit_size = 0;
+    }
 
-        /* Get to the start of the Port string */
-        port_ptr = strstr(host_str, ":");
-        if (port_ptr != NULL) {
-                *port_ptr = 0;
-                strcpy(port_str, port_ptr + 1);
-                *port = atoi(port_str);
+    /* grow the copy geometrically, without memory it is not cached */
+    if (*fit_size && *total + n > copy_cap) {
+        for (cap = copy_cap ? copy_cap : RELAY_BUFSIZE; cap < *total + n; )
+            cap *= 2;
+        if ((p = realloc(copy_buf, cap)) == NULL) {
+            *fit_size = 0;
+        } else {
+            copy_buf = p;
+            copy_cap = cap;
         }
+    }
 
-        /* Copy the Host string back to the given pointer */
-        strcpy(host, host_str);
-        return 1;
+    if (*fit_size) {
+        memcpy(copy_buf + *total, buf, sizeof(char) * n);
+        *total += n;
     }
+    return iRio_writen(fd, buf, n);
 }
 
 /*
- * Get key value pair from request header line
+ * Parse a size in bytes into size, k, m or g may follow the number.
+ * Return -1 if s is anything else or the size does not fit.
  */
-void get_key_value(char *header_line, char *key, char *value) {
-    char *key_tail, *value_tail;
-
-    /* Split the given header line by ":" */
-    key_tail = strstr(header_line, ":");
-    if (key_tail != NULL) {
-        /* Get the key part */
-        *key_tail = 0;
-        strcpy(key, header_line);
-        *key_tail = ':';
-
-        /* Find the "\r\n" and get the value accordingly */
-        value_tail = strstr(header_line, "\r");
-        *value_tail = 0; 
-        strcpy(value, key_tail + 2);
-        *value_tail = '\r'; 
-    } 
-    return;
+int parse_size(char *s, size_t *size) {
+    char *end;
+    unsigned long long n, unit = 1;
+
+    /* strtoull would take a sign and wrap a negative number */
+    if (!isdigit((unsigned char)*s))
+        return -1;
+    errno = 0;
+    n = strtoull(s, &end, 10);
+    if (errno == ERANGE)
+        return -1;
+
+    switch (tolower(*end)) {
+    case 'g':
+        unit = 1ULL << 30;
+        end++;
+        break;
+    case 'm':
+        unit = 1ULL << 20;
+        end++;
+        break;
+    case 'k':
+        unit = 1ULL << 10;
+        end++;
+        break;
+    }
+    if (*end != '\0' || n > SIZE_MAX / unit)
+        return -1;
+    *size = n * unit;
+    return 0;
 }
 
 /* 
- * Get Host and Port from the "Host:" request header line
+ * Read the request headers of the client into hdrs and parse them
  */
-void get_host_port(char *value, char *host, int *port) {
-    char *host_tail;
-    *port = 80;
-
-    /* Split the given header line by ":" */
-    host_tail = strstr(value, ":");
-    if (host_tail != NULL) {
-        *host_tail = 0;
-        strcpy(host, value);
-        *port = atoi(host_tail + 1);
-        *host_tail = ':';
-    }
-    return;
+int generate_request(rio_t *rp, char *hdrs, http_request *req) {
+    size_t len = 0;
+    ssize_t n;
+
+    /* Collect the request line and headers up to the empty line */
+    do {
+        if ((n = rio_readlineb(rp, hdrs + len, MAX_REQ_HDRS - len)) <= 0) {
+            /* the client closed or idled out between requests */
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+                printf("rio_readlineb error\n");
+            return -1;
+        }
+        len += n;
+        if (len >= MAX_REQ_HDRS - 1) {
+            printf("request headers are too large\n");
+            return -1;
+        }
+    } while (strcmp(hdrs + len - n, "\r\n") && strcmp(hdrs + len - n, "\n"));
+
+    return http_parse_request(hdrs, len, req);
 }
 
 /* 
- * New thread to process the request 
+ * Worker thread, serve the connections from the queue one by one 
  */
 void *thread(void* vargp) {
-    int connfd = *((int *)vargp);
-    free(vargp);
+    int connfd;
     /* 
      * Detach the new thread so that 
      * it can be handled automatically
      * after it finishes
      */
     Pthread_detach(Pthread_self());
-    doit(connfd);
-    /* Close the connection*/
-    iClose(connfd);
+    while (1) {
+        connfd = sbuf_remove(&sbuf);
+        serve_client(connfd);
+        /* Close the connection*/
+        iClose(connfd);
+    }
     return NULL;
 }
 
+/*
+ * Print the statistics of the proxy each time SIGUSR1 arrives,
+ * save the cache on SIGUSR2, and save it and exit on SIGTERM.
+ * A worker prints its own counters, the master those of the cache.
+ */
+void *stats_thread(void *vargp) {
+    int sig, i;
+
+    Pthread_detach(Pthread_self());
+    while (1) {
+        if (sigwait(&stats_mask, &sig) != 0)
+            continue;
+        if (sig != SIGUSR1) {
+            save_cache();
+            if (sig == SIGTERM)
+                exit(0);
+            continue;
+        }
+        if (is_worker)
+            printf("worker %d:\n", (int)getpid());
+        for (i = 0; i < ncaches && !is_worker; i++) {
+            if (ncaches > 1)
+                printf("partition %d:\n", i);
+            cache_stats(&cache_inst[i], stdout);
+        }
+        event_stats(stdout);
+        pool_stats(stdout);
+        dns_stats(stdout);
+        disk_stats(stdout);
+        relay_stats(stdout);
+        fflush(stdout);
+    }
+    return NULL;
+}
+
+/*
+ * Make the caches of the options, in shared memory with workers,
+ * return -1 if one can not hold an object
+ */
+int init_caches(void) {
+    int i;
+
+    cache_inst = (cache_list *)shm_calloc(ncaches, sizeof(cache_list));
+    for (i = 0; i < ncaches; i++) {
+        if (init_cache_list(&cache_inst[i], cache_policy, 
+                    cache_size / ncaches, object_size) < 0)
+            return -1;
+        cache_admission(&cache_inst[i], admission);
+        cache_compress(&cache_inst[i], compress);
+    }
+    return 0;
+}
+
+/*
+ * Save the cache to the snapshot file
+ */
+void save_cache(void) {
+    int n = cache_save(cache_inst, snapshot_path);
+
+    if (n < 0)
+        fprintf(stderr, "Can not save the cache to %s: %s\n",
+            snapshot_path, strerror(errno));
+    else
+        printf("cache: %d objects saved to %s\n", n, snapshot_path);
+    fflush(stdout);
+}
+
+/*
+ * Fork nworkers processes that serve the clients with the cache, 
+ * in shared memory already, and return in each of them. The master
+ * serves no client and stays here: on SIGUSR1 it has the cache
+ * counters printed and passes the signal on to the workers for
+ * theirs, with a snapshot file it has the cache saved on SIGUSR2
+ * and SIGTERM. A reader process of its own does that, the master
+ * never takes a lock of the cache, so it never waits for one that
+ * a killed process left held.
+ *
+ * A killed worker is forked again into the cache. If it was killed
+ * holding a lock or a block of the cache, see shm.c, the cache may
+ * be locked, half changed or keep blocks nobody frees: the master
+ * kills the other processes, makes an empty cache and forks all the
+ * workers again. SIGTERM stops the workers
+ * too, and so does a worker that exits: it hit an error that the
+ * next one would hit as well.
+ */
+void start_workers(int nworkers) {
+    pid_t master = getpid(), pid, *pids;
+    sigset_t mask, worker_mask;
+    int i, sig, status, rc = 0;
+    int print = 0, save = 0, stop = 0, broken = 0;
+
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGUSR1);
+    Sigaddset(&mask, SIGUSR2);
+    Sigaddset(&mask, SIGTERM);
+    Sigaddset(&mask, SIGCHLD);
+    Sigprocmask(SIG_BLOCK, &mask, &worker_mask);
+
+    /* a worker gets SIGUSR1 before its stats thread waits for it */
+    Sigaddset(&worker_mask, SIGUSR1);
+
+    /* the workers, then the reader */
+    pids = (pid_t *)Calloc(nworkers + 1, sizeof(pid_t));
+    for (i = 0; i < nworkers; i++) {
+        if ((pids[i] = fork_worker(master, &worker_mask, i)) == 0) {
+            free(pids);
+            return;
+        }
+    }
+
+    while (1) {
+        if (sigwait(&mask, &sig) != 0)
+            continue;
+        if (sig == SIGUSR1) {
+            print = 1;
+            for (i = 0; i < nworkers; i++) {
+                if (pids[i] > 0)
+                    kill(pids[i], SIGUSR1);
+            }
+        } else if (sig != SIGCHLD) {
+            save = snapshot_path != NULL;
+            stop |= sig == SIGTERM;
+        }
+
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (i = 0; i <= nworkers && pids[i] != pid; i++)
+                ;
+            if (i > nworkers)
+                continue;
+            pids[i] = 0;
+            if (!WIFSIGNALED(status)) {
+                if (i == nworkers)
+                    continue;
+                fprintf(stderr, "Worker %d exited, stopping\n", (int)pid);
+                save = 0;
+                stop = 1;
+                rc = 1;
+            } else if (shm_busy(i)) {
+                fprintf(stderr, "Process %d killed by signal %d holding "
+                    "part of the cache, making the cache anew\n", (int)pid,
+                    WTERMSIG(status));
+                broken = 1;
+            } else if (i < nworkers && !broken && !stop) {
+                fprintf(stderr, "Worker %d killed by signal %d, "
+                    "forking another\n", (int)pid, WTERMSIG(status));
+                if ((pids[i] = fork_worker(master, &worker_mask, i)) == 0) {
+                    cache_fill_drop(cache_inst, pid);
+                    free(pids);
+                    return;
+                }
+            }
+        }
+
+        /* nothing of the old cache is read or saved any more */
+        if (broken) {
+            stop_workers(pids, nworkers + 1);
+            if (stop) {
+                fprintf(stderr, "The cache is not saved\n");
+                exit(1);
+            }
+            shm_reset();
+            init_caches();
+            print = save = broken = 0;
+            for (i = 0; i < nworkers; i++) {
+                if ((pids[i] = fork_worker(master, &worker_mask, i)) == 0) {
+                    free(pids);
+                    return;
+                }
+            }
+        }
+
+        if (pids[nworkers] == 0 && (print || save)) {
+            if ((pids[nworkers] = fork_worker(master, &worker_mask,
+                            nworkers)) == 0) {
+                if (print) {
+                    cache_stats(cache_inst, stdout);
+                    shm_stats(stdout);
+                }
+                if (save)
+                    save_cache();
+                exit(0);
+            }
+            print = save = 0;
+        }
+
+        if (stop && pids[nworkers] == 0 && !save) {
+            for (i = 0; i < nworkers; i++) {
+                if (pids[i] > 0)
+                    kill(pids[i], SIGTERM);
+            }
+            exit(rc);
+        }
+    }
+}
+
+/*
+ * Fork a worker with the signals of mask blocked, return its pid,
+ * or 0 in the worker. It counts its locks of the cache in slot.
+ */
+pid_t fork_worker(pid_t master, sigset_t *mask, int slot) {
+    pid_t pid;
+
+    fflush(stdout);
+    if ((pid = Fork()) == 0) {
+        /* a worker does not outlive the master */
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != master)
+            exit(0);
+        is_worker = 1;
+        shm_worker(slot);
+        Sigprocmask(SIG_SETMASK, mask, NULL);
+
+        /* the processes write the same output, keep their lines whole */
+        setvbuf(stdout, NULL, _IOLBF, 0);
+    }
+    return pid;
+}
+
+/*
+ * Kill the n processes of pids that run and wait for them
+ */
+void stop_workers(pid_t *pids, int n) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (pids[i] > 0) {
+            kill(pids[i], SIGKILL);
+            waitpid(pids[i], NULL, 0);
+            pids[i] = 0;
+        }
+    }
+}
+
 /* 
  * Customized r/w func and error handler wrapper 
  */
@@ -445,17 +1407,6 @@ int iOpen_clientfd_r(int fd, char *hostname, int port) {
     return rc;
 }
 
-ssize_t iRio_readnb(int fd, char *hostname, rio_t *rp, 
-            void *usrbuf, size_t n) {
-    ssize_t rc;
-
-    if ((rc = rio_readnb(rp, usrbuf, n)) < 0)
-        client_error(fd, hostname, "404", "Not found",
-            "Proxy couldn't connect to this server");
-
-    return rc;
-}
-
 void iClose(int fd){
     if (close(fd) < 0)
         printf("fd close error\n");
@@ -466,21 +1417,14 @@ void iClose(int fd){
  */
 void client_error(int fd, char *cause, char *errnum, 
             char *shortmsg, char *longmsg) {
-    char buf[MAXLINE], body[MAXLINE];
-
-    /* Build the HTTP response body */
-    sprintf(body, "<html><title>Request Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The proxy</em>\r\n", body);
-
-    /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
-}
\ No newline at end of file
+    char page[2 * MAXLINE];
+    int len;
+
+    /* 
+     * Print the HTTP response, the client may have gone away 
+     * already, so a failed write must not kill the proxy
+     */
+    len = http_error_page(page, sizeof(page), cause, errnum, 
+        shortmsg, longmsg);
+    iRio_writen(fd, page, len);
+}
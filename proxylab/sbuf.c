@@ -0,0 +1,106 @@
+/*
+ * sbuf.c -- Bounded connection queue for the 15-213 proxy lab
+ *
+ * Team Member1: Cheng Zhang, Andrew ID: chengzh1
+ * Team Member2: Zhe Qian, Andrew ID: zheq
+ *
+ * Overview of the queue:
+ *	The main thread is the producer, it accepts connections
+ *	and inserts the connected descriptors into a circular buffer.
+ *	The worker threads are the consumers, each of them removes
+ *	one descriptor at a time and serves it. The buffer is guarded
+ *	by three semaphores: mutex for exclusive access, slots for the
+ *	number of empty slots and items for the number of descriptors
+ *	waiting to be served. When the buffer is full the producer can
+ *	either block in sbuf_insert or give up in sbuf_tryinsert.
+ *	A consumer looks at sbuf_waiting to tell if others wait for it.
+ */
+
+#include "csapp.h"
+#include "sbuf.h"
+
+/*
+ * Create an empty, bounded, shared FIFO buffer with n slots
+ */
+void sbuf_init(sbuf_t *sp, int n)
+{
+	sp->buf = Calloc(n, sizeof(int));
+	sp->n = n;
+	sp->front = sp->rear = 0;
+	Sem_init(&sp->mutex, 0, 1);
+	Sem_init(&sp->slots, 0, n);
+	Sem_init(&sp->items, 0, 0);
+	return;
+}
+
+/*
+ * Clean up buffer sp
+ */
+void sbuf_deinit(sbuf_t *sp)
+{
+	Free(sp->buf);
+	return;
+}
+
+/*
+ * Insert item onto the rear of shared buffer sp,
+ * wait for an available slot if the buffer is full.
+ */
+void sbuf_insert(sbuf_t *sp, int item)
+{
+	P(&sp->slots);
+	P(&sp->mutex);
+	sp->buf[(++sp->rear) % (sp->n)] = item;
+	V(&sp->mutex);
+	V(&sp->items);
+	return;
+}
+
+/*
+ * Insert item onto the rear of shared buffer sp
+ * only if there is an available slot right now.
+ * Return 1 on success and 0 if the buffer is full.
+ */
+int sbuf_tryinsert(sbuf_t *sp, int item)
+{
+	while (sem_trywait(&sp->slots) < 0)
+	{
+		if (errno == EAGAIN)
+			return 0;
+		if (errno != EINTR)
+			unix_error("sbuf_tryinsert error");
+	}
+
+	P(&sp->mutex);
+	sp->buf[(++sp->rear) % (sp->n)] = item;
+	V(&sp->mutex);
+	V(&sp->items);
+	return 1;
+}
+
+/*
+ * Return how many items of buffer sp wait to be removed
+ */
+int sbuf_waiting(sbuf_t *sp)
+{
+	int n;
+
+	sem_getvalue(&sp->items, &n);
+	return n > 0 ? n : 0;
+}
+
+/*
+ * Remove and return the first item from buffer sp,
+ * wait for an item if the buffer is empty.
+ */
+int sbuf_remove(sbuf_t *sp)
+{
+	int item;
+
+	P(&sp->items);
+	P(&sp->mutex);
+	item = sp->buf[(++sp->front) % (sp->n)];
+	V(&sp->mutex);
+	V(&sp->slots);
+	return item;
+}
@@ -0,0 +1,35 @@
+/*
+ * sbuf.h -- Declaration of the bounded connection queue 
+ *			 for 15-213 proxy lab
+ *
+ * Team Member1: Cheng Zhang, Andrew ID: chengzh1
+ * Team Member2: Zhe Qian, Andrew ID: zheq
+ *
+ */
+
+#ifndef SBUF_H
+#define SBUF_H
+
+#include <semaphore.h>
+
+/* Definition of the bounded producer/consumer buffer */
+typedef struct
+{
+	int *buf;			/* buffer array */
+	int n;				/* maximum number of slots */
+	unsigned int front;	/* buf[(front+1)%n] is the first item */
+	unsigned int rear;	/* buf[rear%n] is the last item */
+	sem_t mutex;		/* protects accesses to buf */
+	sem_t slots;		/* counts available slots */
+	sem_t items;		/* counts available items */
+}sbuf_t;
+
+/* Declaration of some method that is used in proxy.c */
+void sbuf_init(sbuf_t *sp, int n);
+void sbuf_deinit(sbuf_t *sp);
+void sbuf_insert(sbuf_t *sp, int item);
+int sbuf_tryinsert(sbuf_t *sp, int item);
+int sbuf_remove(sbuf_t *sp);
+int sbuf_waiting(sbuf_t *sp);
+
+#endif
@@ -0,0 +1,515 @@
+/*
+ * shm.c -- Shared memory of the cache for the 15-213 proxy lab
+ *
+ * Team Member1: Cheng Zhang, Andrew ID: chengzh1
+ * Team Member2: Zhe Qian, Andrew ID: zheq
+ *
+ * Overview of the shared memory:
+ *	With worker processes, see proxy.c, all of them use one cache.
+ *	Everything of the cache is allocated from one arena, mapped
+ *	shared and anonymous before the workers are forked. A forked
+ *	process has the mapping at the same address, so the pointers
+ *	between shards, blocks and bodies mean the same thing in every
+ *	worker and the cache code keeps its plain pointers. A worker
+ *	forked again after a crash gets the same mapping too.
+ *
+ *	The arena is managed like in the CS:APP malloc lab: a chunk has
+ *	its size and whether it is in use in a header and a footer, free
+ *	chunks are on segregated lists by powers of two of their size.
+ *	An allocation takes the first chunk that fits from the smallest
+ *	list that may have one and splits off the rest, a freed chunk is
+ *	merged with its free neighbours. One process-shared mutex guards
+ *	the lists. The arena is mapped without reserving swap, pages are
+ *	only backed once they are touched.
+ *
+ *	A worker killed while it holds a lock of the cache, the mutex of
+ *	the arena or one in cache.c, leaves it held and what it guards
+ *	half changed, and the blocks it has references on are never
+ *	freed. So each worker has a counter in the arena of the locks
+ *	and the references it holds, shm_enter and shm_leave go around
+ *	every one of them. When a worker dies, the master reads its
+ *	counter: at zero the cache is whole and a new worker is forked
+ *	into it, else the master stops the workers and makes the arena
+ *	new with shm_reset.
+ *
+ *	Without an arena, or for a pointer that is not in it, these are
+ *	the functions of the C library.
+ */
+
+#define _GNU_SOURCE
+#include <malloc.h>
+#include <sys/mman.h>
+#include "csapp.h"
+#include "shm.h"
+
+#define SHM_LISTS 32		/* free lists, one per power of two */
+#define SHM_ALIGN 16		/* of the payloads and the chunk sizes */
+#define SHM_MIN 32			/* smallest chunk: two tags, two links */
+#define SHM_TAG sizeof(size_t)
+
+/* Definition of the arena, at the start of the mapping */
+typedef struct
+{
+	pthread_mutex_t lock;		/* process-shared */
+	char *start;				/* first chunk */
+	char *end;					/* last byte of the chunks + 1 */
+	size_t size;				/* of the chunks */
+	size_t used;				/* bytes of the chunks in use */
+	size_t peak;
+	unsigned long n_allocs;
+	unsigned long n_fails;		/* allocations that found no chunk */
+	unsigned long n_resets;
+	char *lists[SHM_LISTS];		/* payloads of the free chunks */
+	int busy[SHM_WORKERS];		/* locks of the cache each worker is in */
+}shm_arena;
+
+/* The tags of a chunk: its size, the low bit set if it is in use */
+#define TAG(p) (*(size_t *)(p))
+#define SIZE(p) (TAG(p) & ~(size_t)(SHM_ALIGN - 1))
+#define USED(p) (TAG(p) & 1)
+
+/* Given the payload of a chunk, its tags and its neighbours */
+#define HDR(bp) ((bp) - SHM_TAG)
+#define FTR(bp) ((bp) + SIZE(HDR(bp)) - 2 * SHM_TAG)
+#define NEXT_CHUNK(bp) ((bp) + SIZE(HDR(bp)))
+#define PREV_CHUNK(bp) ((bp) - SIZE((bp) - 2 * SHM_TAG))
+
+/* Links of a free chunk, in its payload */
+#define NEXT_FREE(bp) (((char **)(bp))[0])
+#define PREV_FREE(bp) (((char **)(bp))[1])
+
+static shm_arena *arena = NULL;
+static int *busy = NULL;		/* counter of this worker, none in the master */
+
+static void format_arena(void);
+static void lock_arena(void);
+static void unlock_arena(void);
+static void set_tags(char *bp, size_t size, int used);
+static int list_index(size_t size);
+static char *find_fit(size_t asize);
+static void insert_free(char *bp);
+static void remove_free(char *bp);
+static char *coalesce(char *bp);
+static void place(char *bp, size_t asize);
+static int in_arena(void *ptr);
+
+/*
+ * Map an arena with room for size bytes of chunks, before any
+ * worker is forked. Return 0 on success, -1 on error.
+ */
+int shm_init(size_t size)
+{
+	size_t head = (sizeof(shm_arena) + SHM_ALIGN - 1) & ~(SHM_ALIGN - 1);
+	char *base;
+
+	size = (size + SHM_ALIGN - 1) & ~(size_t)(SHM_ALIGN - 1);
+	if (size < SHM_MIN)
+		return -1;
+
+	/* the arena, a prologue chunk, the chunks and an epilogue tag */
+	base = mmap(NULL, head + 2 * SHM_ALIGN + size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED)
+		return -1;
+
+	arena = (shm_arena *)base;
+	arena->start = base + head + 2 * SHM_ALIGN;
+	arena->end = arena->start + size;
+	arena->size = size;
+	format_arena();
+	return 0;
+}
+
+/*
+ * Free everything of the arena and take its lock back from whoever
+ * held it. Only when no worker runs, the master makes the cache anew.
+ */
+void shm_reset(void)
+{
+	unsigned long n_resets = arena->n_resets;
+
+	format_arena();
+	arena->n_resets = n_resets + 1;
+	return;
+}
+
+/*
+ * Use counter i of the arena for the locks and the references this
+ * process holds, a worker does before it serves any client
+ */
+void shm_worker(int i)
+{
+	busy = &arena->busy[i];
+	*busy = 0;
+	return;
+}
+
+/*
+ * Return how many locks and references of the cache worker i held,
+ * the locks it waited for count too
+ */
+int shm_busy(int i)
+{
+	return __atomic_load_n(&arena->busy[i], __ATOMIC_SEQ_CST);
+}
+
+/*
+ * The caller takes a lock or a reference in the arena, this is
+ * counted before it may hold it. No-op without workers.
+ */
+void shm_enter(void)
+{
+	if (busy != NULL)
+		__atomic_add_fetch(busy, 1, __ATOMIC_SEQ_CST);
+	return;
+}
+
+/*
+ * The caller released a lock or a reference in the arena
+ */
+void shm_leave(void)
+{
+	if (busy != NULL)
+		__atomic_sub_fetch(busy, 1, __ATOMIC_SEQ_CST);
+	return;
+}
+
+/*
+ * Return whether the cache is allocated in a shared arena
+ */
+int shm_enabled(void)
+{
+	return arena != NULL;
+}
+
+/*
+ * Allocate size bytes, NULL if no free chunk is big enough
+ */
+void *shm_malloc(size_t size)
+{
+	size_t asize;
+	char *bp;
+
+	if (arena == NULL)
+		return malloc(size);
+	if (size > arena->size)
+		return NULL;
+
+	asize = (size + 2 * SHM_TAG + SHM_ALIGN - 1) & ~(size_t)(SHM_ALIGN - 1);
+	if (asize < SHM_MIN)
+		asize = SHM_MIN;
+
+	lock_arena();
+	if ((bp = find_fit(asize)) != NULL)
+	{
+		remove_free(bp);
+		place(bp, asize);
+		arena->used += SIZE(HDR(bp));
+		if (arena->used > arena->peak)
+			arena->peak = arena->used;
+		arena->n_allocs++;
+	}
+	else
+		arena->n_fails++;
+	unlock_arena();
+	return bp;
+}
+
+/*
+ * Allocate nmemb elements of size bytes, zeroed
+ */
+void *shm_calloc(size_t nmemb, size_t size)
+{
+	void *ptr;
+
+	if (arena == NULL)
+		return calloc(nmemb, size);
+	if (size != 0 && nmemb > (size_t)-1 / size)
+		return NULL;
+
+	if ((ptr = shm_malloc(nmemb * size)) != NULL)
+		memset(ptr, 0, nmemb * size);
+	return ptr;
+}
+
+/*
+ * shm_calloc for the tables made at startup, exit on error
+ */
+void *Shm_calloc(size_t nmemb, size_t size)
+{
+	void *ptr;
+
+	if ((ptr = shm_calloc(nmemb, size)) == NULL)
+		app_error("Shm_calloc error: the arena is too small");
+	return ptr;
+}
+
+/*
+ * Change the size of ptr to size bytes. A chunk that shrinks stays
+ * where it is and gives its tail back. On failure ptr is unchanged
+ * and NULL is returned.
+ */
+void *shm_realloc(void *ptr, size_t size)
+{
+	size_t asize, csize;
+	char *bp = ptr, *rest, *new_ptr;
+
+	if (arena == NULL || (ptr != NULL && !in_arena(ptr)))
+		return realloc(ptr, size);
+	if (ptr == NULL)
+		return shm_malloc(size);
+	if (size > arena->size)
+		return NULL;
+
+	asize = (size + 2 * SHM_TAG + SHM_ALIGN - 1) & ~(size_t)(SHM_ALIGN - 1);
+	if (asize < SHM_MIN)
+		asize = SHM_MIN;
+
+	lock_arena();
+	csize = SIZE(HDR(bp));
+	if (asize <= csize)
+	{
+		if (csize - asize >= SHM_MIN)
+		{
+			set_tags(bp, asize, 1);
+			rest = NEXT_CHUNK(bp);
+			set_tags(rest, csize - asize, 0);
+			coalesce(rest);
+			arena->used -= csize - asize;
+		}
+		unlock_arena();
+		return bp;
+	}
+	unlock_arena();
+
+	if ((new_ptr = shm_malloc(size)) == NULL)
+		return NULL;
+	memcpy(new_ptr, bp, csize - 2 * SHM_TAG);
+	shm_free(bp);
+	return new_ptr;
+}
+
+/*
+ * Free ptr
+ */
+void shm_free(void *ptr)
+{
+	char *bp = ptr;
+
+	if (ptr == NULL)
+		return;
+	if (arena == NULL || !in_arena(ptr))
+	{
+		free(ptr);
+		return;
+	}
+
+	lock_arena();
+	arena->used -= SIZE(HDR(bp));
+	set_tags(bp, SIZE(HDR(bp)), 0);
+	coalesce(bp);
+	unlock_arena();
+	return;
+}
+
+/*
+ * Return the bytes the allocation of ptr really takes, its tags
+ * or the size word of malloc included
+ */
+size_t shm_charge(void *ptr)
+{
+	if (arena == NULL || !in_arena(ptr))
+		return malloc_usable_size(ptr) + sizeof(size_t);
+	return SIZE(HDR((char *)ptr));
+}
+
+/*
+ * Print the counters of the arena
+ */
+void shm_stats(FILE *fp)
+{
+	if (arena == NULL)
+		return;
+
+	lock_arena();
+	fprintf(fp, "shm: %lu of %lu bytes in use, %lu at most, "
+			"%lu allocations, %lu found no room, made anew %lu times "
+			"after a worker died holding part of it\n",
+			(unsigned long)arena->used, (unsigned long)arena->size,
+			(unsigned long)arena->peak, arena->n_allocs, arena->n_fails,
+			arena->n_resets);
+	unlock_arena();
+	return;
+}
+
+/*
+ * Make the lock of the arena and one free chunk of all of it,
+ * nothing is in use
+ */
+static void format_arena(void)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutex_init(&arena->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	arena->used = arena->peak = 0;
+	arena->n_allocs = arena->n_fails = 0;
+	memset(arena->lists, 0, sizeof(arena->lists));
+	memset(arena->busy, 0, sizeof(arena->busy));
+
+	/* the prologue is never free, so no chunk merges past it */
+	set_tags(arena->start - SHM_ALIGN, SHM_ALIGN, 1);
+	TAG(HDR(arena->end)) = 1;
+	set_tags(arena->start, arena->size, 0);
+	insert_free(arena->start);
+	return;
+}
+
+/*
+ * Take and release the lock of the arena
+ */
+static void lock_arena(void)
+{
+	shm_enter();
+	pthread_mutex_lock(&arena->lock);
+	return;
+}
+
+static void unlock_arena(void)
+{
+	pthread_mutex_unlock(&arena->lock);
+	shm_leave();
+	return;
+}
+
+/*
+ * Write the header and the footer of the chunk at bp
+ */
+static void set_tags(char *bp, size_t size, int used)
+{
+	TAG(HDR(bp)) = size | used;
+	TAG(FTR(bp)) = size | used;
+	return;
+}
+
+/*
+ * Return the free list of chunks of size bytes, list i has those
+ * of SHM_MIN << i bytes up to twice that
+ */
+static int list_index(size_t size)
+{
+	int i = 0;
+
+	for (size /= SHM_MIN; size > 1 && i < SHM_LISTS - 1; size >>= 1)
+		i++;
+	return i;
+}
+
+/*
+ * Return the first free chunk of asize bytes at least from the
+ * smallest list that may have one, NULL if none. Above its own
+ * list, the first chunk of a list fits. Must hold the lock.
+ */
+static char *find_fit(size_t asize)
+{
+	char *bp;
+	int i;
+
+	for (i = list_index(asize); i < SHM_LISTS; i++)
+	{
+		for (bp = arena->lists[i]; bp != NULL; bp = NEXT_FREE(bp))
+		{
+			if (SIZE(HDR(bp)) >= asize)
+				return bp;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Push the free chunk at bp on its list. Must hold the lock.
+ */
+static void insert_free(char *bp)
+{
+	char **list = &arena->lists[list_index(SIZE(HDR(bp)))];
+
+	NEXT_FREE(bp) = *list;
+	PREV_FREE(bp) = NULL;
+	if (*list != NULL)
+		PREV_FREE(*list) = bp;
+	*list = bp;
+	return;
+}
+
+/*
+ * Take the free chunk at bp off its list. Must hold the lock.
+ */
+static void remove_free(char *bp)
+{
+	if (PREV_FREE(bp) != NULL)
+		NEXT_FREE(PREV_FREE(bp)) = NEXT_FREE(bp);
+	else
+		arena->lists[list_index(SIZE(HDR(bp)))] = NEXT_FREE(bp);
+	if (NEXT_FREE(bp) != NULL)
+		PREV_FREE(NEXT_FREE(bp)) = PREV_FREE(bp);
+	return;
+}
+
+/*
+ * Merge the free chunk at bp, on no list yet, with its free
+ * neighbours and put the result on its list. Must hold the lock.
+ */
+static char *coalesce(char *bp)
+{
+	size_t size = SIZE(HDR(bp));
+	char *next = NEXT_CHUNK(bp), *prev;
+
+	if (!USED(HDR(next)))
+	{
+		remove_free(next);
+		size += SIZE(HDR(next));
+	}
+	if (!USED(bp - 2 * SHM_TAG))
+	{
+		prev = PREV_CHUNK(bp);
+		remove_free(prev);
+		size += SIZE(HDR(prev));
+		bp = prev;
+	}
+	set_tags(bp, size, 0);
+	insert_free(bp);
+	return bp;
+}
+
+/*
+ * Mark the chunk at bp, off its list, used for asize bytes, a rest
+ * big enough for a chunk is freed. Must hold the lock.
+ */
+static void place(char *bp, size_t asize)
+{
+	size_t csize = SIZE(HDR(bp));
+	char *rest;
+
+	if (csize - asize >= SHM_MIN)
+	{
+		/* the chunk after a free one is in use, the rest stays alone */
+		set_tags(bp, asize, 1);
+		rest = NEXT_CHUNK(bp);
+		set_tags(rest, csize - asize, 0);
+		insert_free(rest);
+	}
+	else
+		set_tags(bp, csize, 1);
+	return;
+}
+
+/*
+ * Return whether ptr was allocated from the arena
+ */
+static int in_arena(void *ptr)
+{
+	return (char *)ptr >= arena->start && (char *)ptr < arena->end;
+}
@@ -0,0 +1,35 @@
+/*
+ * shm.h -- Declaration of the shared memory of the cache
+ *			for 15-213 proxy lab
+ *
+ * Team Member1: Cheng Zhang, Andrew ID: chengzh1
+ * Team Member2: Zhe Qian, Andrew ID: zheq
+ *
+ */
+
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* Most worker processes, each has a counter in the arena */
+#define SHM_WORKERS 256
+
+/* Declaration of some method that is used in proxy.c and cache.c */
+int shm_init(size_t size);
+int shm_enabled(void);
+void shm_reset(void);
+void shm_worker(int i);
+int shm_busy(int i);
+void shm_enter(void);
+void shm_leave(void);
+void *shm_malloc(size_t size);
+void *shm_calloc(size_t nmemb, size_t size);
+void *Shm_calloc(size_t nmemb, size_t size);
+void *shm_realloc(void *ptr, size_t size);
+void shm_free(void *ptr);
+size_t shm_charge(void *ptr);
+void shm_stats(FILE *fp);
+
+#endif
@@ -0,0 +1,437 @@
+/*
+ * zip.c -- gzip compression of cached bodies for the 15-213 proxy lab
+ *
+ * Team Member1: Cheng Zhang, Andrew ID: chengzh1
+ * Team Member2: Zhe Qian, Andrew ID: zheq
+ *
+ * Overview of the compressor:
+ *	Text bodies take 3 to 5 times less memory compressed, so the
+ *	cache can compress them, see cache.c. The format is gzip, so a
+ *	client that accepts gzip gets the stored bytes as they are and
+ *	only the others cost a decompression.
+ *
+ *	The compressor is LZ77 with the fixed Huffman codes of deflate
+ *	(RFC 1951), written out as a single gzip member (RFC 1952). The
+ *	matches are found with a hash table of the last position of
+ *	every 3 bytes and a chain of earlier positions with the same
+ *	hash, at most ZIP_CHAIN of them are tried. There are no dynamic
+ *	Huffman tables, so it does not compress as well as gzip does,
+ *	but it needs no pass over the symbols and no library.
+ *
+ *	The decompressor only reads what the compressor writes: one
+ *	gzip member without optional fields made of fixed Huffman
+ *	blocks. Both run on buffers of the caller and take no locks.
+ */
+
+#include "csapp.h"
+#include "zip.h"
+
+#define ZIP_WINDOW 32768	/* farthest back a match may be */
+#define ZIP_HASH_BITS 14	/* of the table of positions */
+#define ZIP_CHAIN 16		/* positions tried for a match */
+#define ZIP_MIN_MATCH 3
+#define ZIP_MAX_MATCH 258
+#define ZIP_NONE 0xffffffffU	/* no position with this hash yet */
+
+/* Definition of the bits being written, the low bits go first */
+typedef struct
+{
+	unsigned char *p;
+	unsigned char *end;
+	unsigned long long bits;
+	int n;						/* bits in bits */
+	int full;					/* the output did not fit */
+}bit_writer;
+
+/* Definition of the bits being read */
+typedef struct
+{
+	const unsigned char *p;
+	const unsigned char *end;
+	unsigned long long bits;
+	int n;
+}bit_reader;
+
+/* Lengths and distances of the codes of deflate, and their extra bits */
+static const unsigned short len_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const unsigned char len_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const unsigned short dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+	8193, 12289, 16385, 24577};
+static const unsigned char dist_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+/* Tables built once, see build_tables */
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+static unsigned int crc_table[256];
+static unsigned short lit_code[288];	/* bit reversed, as written */
+static unsigned char lit_bits[288];
+static unsigned char len_code[ZIP_MAX_MATCH + 1];	/* length to its code */
+static unsigned char dist_code[512];	/* see dist_sym */
+static unsigned short lit_decode[512];	/* 9 bits to symbol << 4 | bits */
+static unsigned char dist_decode[32];	/* 5 bits to distance code */
+
+static void build_tables(void);
+static unsigned int reverse(unsigned int code, int bits);
+static unsigned int crc32(const char *data, size_t len);
+static int dist_sym(unsigned int dist);
+static void put_bits(bit_writer *bw, unsigned int value, int n);
+static void put_byte(bit_writer *bw, int c);
+static void put_match(bit_writer *bw, unsigned int len, unsigned int dist);
+static int need_bits(bit_reader *br, int n);
+
+
+/*
+ * Compress len bytes at src into a gzip member in dst of size
+ * bytes. Return the length of the member, or 0 if it does not fit,
+ * the caller keeps the bytes as they are then.
+ */
+size_t zip_deflate(const char *src, size_t len, char *dst, size_t size)
+{
+	unsigned int head[1 << ZIP_HASH_BITS];
+	unsigned short prev[ZIP_WINDOW];	/* back to the last same hash */
+	const unsigned char *s = (const unsigned char *)src;
+	unsigned int i, j, h, cand, n, max, chain, best_len, best_dist;
+	unsigned int crc;
+	bit_writer bw;
+
+#define HASH3(p) ((((p)[0] << 16 | (p)[1] << 8 | (p)[2]) * 2654435761U) \
+					>> (32 - ZIP_HASH_BITS))
+#define INSERT(pos) do { \
+		h = HASH3(s + (pos)); \
+		prev[(pos) & (ZIP_WINDOW - 1)] = head[h] != ZIP_NONE && \
+			(pos) - head[h] <= ZIP_WINDOW ? (pos) - head[h] : 0; \
+		head[h] = (pos); \
+	} while (0)
+
+	/* the 10 byte header, a trailer of 8 and a block of at least 1 */
+	if (size < 19 || len > 0xffffffffU)
+		return 0;
+	pthread_once(&tables_once, build_tables);
+	memset(head, 0xff, sizeof(head));
+
+	/* deflate, no flags, no time, no extra flags, Unix */
+	memcpy(dst, "\x1f\x8b\x08\x00\x00\x00\x00\x00\x00\x03", 10);
+	bw.p = (unsigned char *)dst + 10;
+	bw.end = (unsigned char *)dst + size - 8;
+	bw.bits = 0;
+	bw.n = 0;
+	bw.full = 0;
+
+	/* one last block with the fixed codes */
+	put_bits(&bw, 1, 1);
+	put_bits(&bw, 1, 2);
+
+	for (i = 0; i < len && !bw.full; )
+	{
+		best_len = 0;
+		best_dist = 0;
+		if (i + ZIP_MIN_MATCH <= len)
+		{
+			max = len - i < ZIP_MAX_MATCH ? len - i : ZIP_MAX_MATCH;
+			cand = head[HASH3(s + i)];
+			for (chain = 0; cand != ZIP_NONE && i - cand <= ZIP_WINDOW &&
+				 chain < ZIP_CHAIN; chain++)
+			{
+				/* a longer match must differ nowhere up to best_len */
+				if (s[cand + best_len] == s[i + best_len])
+				{
+					for (n = 0; n < max && s[cand + n] == s[i + n]; n++)
+						;
+					if (n > best_len)
+					{
+						best_len = n;
+						best_dist = i - cand;
+						if (n == max)
+							break;
+					}
+				}
+				if (prev[cand & (ZIP_WINDOW - 1)] == 0)
+					break;
+				cand -= prev[cand & (ZIP_WINDOW - 1)];
+			}
+			INSERT(i);
+		}
+
+		if (best_len >= ZIP_MIN_MATCH)
+		{
+			put_match(&bw, best_len, best_dist);
+			for (j = i + 1; j < i + best_len && j + ZIP_MIN_MATCH <= len; j++)
+				INSERT(j);
+			i += best_len;
+		}
+		else
+			put_byte(&bw, s[i++]);
+	}
+#undef INSERT
+#undef HASH3
+
+	/* the end of the block, then the last bits up to a byte */
+	put_bits(&bw, lit_code[256], lit_bits[256]);
+	if (bw.n > 0)
+		put_bits(&bw, 0, 8 - bw.n);
+	if (bw.full)
+		return 0;
+
+	/* the CRC-32 and the length, little endian */
+	crc = crc32(src, len);
+	for (j = 0; j < 4; j++)
+		*bw.p++ = crc >> (8 * j);
+	for (j = 0; j < 4; j++)
+		*bw.p++ = (unsigned int)len >> (8 * j);
+	return (char *)bw.p - dst;
+}
+
+/*
+ * Decompress the gzip member of len bytes at src that zip_deflate
+ * wrote into dst of size bytes. Return the length of what it holds,
+ * or -1 if it is not such a member or does not fit.
+ */
+long zip_inflate(const char *src, size_t len, char *dst, size_t size)
+{
+	const unsigned char *s = (const unsigned char *)src;
+	unsigned int sym, length, dist, code, isize, k;
+	size_t out = 0;
+	bit_reader br;
+	int last;
+
+	if (len < 19 || s[0] != 0x1f || s[1] != 0x8b || s[2] != 8 || s[3] != 0)
+		return -1;
+	pthread_once(&tables_once, build_tables);
+
+	br.p = s + 10;
+	br.end = s + len - 8;
+	br.bits = 0;
+	br.n = 0;
+	do
+	{
+		if (!need_bits(&br, 3) || ((br.bits >> 1) & 3) != 1)
+			return -1;
+		last = br.bits & 1;
+		br.bits >>= 3;
+		br.n -= 3;
+
+		while (1)
+		{
+			/* the codes are 7 to 9 bits, the end may be closer */
+			need_bits(&br, 9);
+			sym = lit_decode[br.bits & 511];
+			if ((int)(sym & 15) > br.n)
+				return -1;
+			br.bits >>= sym & 15;
+			br.n -= sym & 15;
+			sym >>= 4;
+
+			if (sym < 256)
+			{
+				if (out == size)
+					return -1;
+				dst[out++] = sym;
+				continue;
+			}
+			if (sym == 256)
+				break;
+			if (sym > 285)
+				return -1;
+
+			/* a match: its length, then its distance */
+			code = sym - 257;
+			if (!need_bits(&br, len_extra[code] + 5))
+				return -1;
+			length = len_base[code] +
+				(br.bits & ((1U << len_extra[code]) - 1));
+			br.bits >>= len_extra[code];
+			br.n -= len_extra[code];
+			code = dist_decode[br.bits & 31];
+			br.bits >>= 5;
+			br.n -= 5;
+			if (code > 29 || !need_bits(&br, dist_extra[code]))
+				return -1;
+			dist = dist_base[code] +
+				(br.bits & ((1U << dist_extra[code]) - 1));
+			br.bits >>= dist_extra[code];
+			br.n -= dist_extra[code];
+
+			/* the copy may overlap itself, byte by byte then */
+			if (dist > out || length > size - out)
+				return -1;
+			if (dist >= length)
+				memcpy(dst + out, dst + out - dist, length);
+			else
+				for (k = 0; k < length; k++)
+					dst[out + k] = dst[out + k - dist];
+			out += length;
+		}
+	} while (!last);
+
+	isize = s[len - 4] | s[len - 3] << 8 | s[len - 2] << 16 |
+		(unsigned int)s[len - 1] << 24;
+	if (isize != (unsigned int)out)
+		return -1;
+	return out;
+}
+
+/*
+ * Build the tables of the CRC-32, of the fixed codes as they are
+ * written and read, and of the codes of lengths and distances
+ */
+static void build_tables(void)
+{
+	unsigned int c, i, j, r, bits;
+	int k;
+
+	for (i = 0; i < 256; i++)
+	{
+		c = i;
+		for (k = 0; k < 8; k++)
+			c = c & 1 ? 0xedb88320U ^ (c >> 1) : c >> 1;
+		crc_table[i] = c;
+	}
+
+	/* the fixed literal/length codes of RFC 1951, 3.2.6 */
+	for (i = 0; i < 288; i++)
+	{
+		if (i < 144)
+		{
+			c = 0x30 + i;
+			bits = 8;
+		}
+		else if (i < 256)
+		{
+			c = 0x190 + i - 144;
+			bits = 9;
+		}
+		else if (i < 280)
+		{
+			c = i - 256;
+			bits = 7;
+		}
+		else
+		{
+			c = 0xc0 + i - 280;
+			bits = 8;
+		}
+		r = reverse(c, bits);
+		lit_code[i] = r;
+		lit_bits[i] = bits;
+		for (j = r; j < 512; j += 1U << bits)
+			lit_decode[j] = i << 4 | bits;
+	}
+	for (i = 0; i < 32; i++)
+		dist_decode[reverse(i, 5)] = i;
+
+	for (i = 0; i < 29; i++)
+		for (j = len_base[i]; j < len_base[i] + (1U << len_extra[i]) &&
+			 j <= ZIP_MAX_MATCH; j++)
+			len_code[j] = i;
+	for (i = 0; i < 30; i++)
+		for (j = dist_base[i]; j < dist_base[i] + (1U << dist_extra[i]); j++)
+			dist_code[j <= 256 ? j - 1 : 256 + ((j - 1) >> 7)] = i;
+	return;
+}
+
+/*
+ * The low bits of code in reverse order, Huffman codes go out
+ * from their highest bit
+ */
+static unsigned int reverse(unsigned int code, int bits)
+{
+	unsigned int r = 0;
+
+	while (bits-- > 0)
+	{
+		r = r << 1 | (code & 1);
+		code >>= 1;
+	}
+	return r;
+}
+
+/*
+ * The CRC-32 of gzip of len bytes at data
+ */
+static unsigned int crc32(const char *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	unsigned int c = 0xffffffffU;
+
+	while (len-- > 0)
+		c = crc_table[(c ^ *p++) & 0xff] ^ (c >> 8);
+	return c ^ 0xffffffffU;
+}
+
+/*
+ * The code of a match distance, distances up to 256 have their
+ * own entry, the longer ones one per 128
+ */
+static int dist_sym(unsigned int dist)
+{
+	return dist <= 256 ? dist_code[dist - 1] :
+		dist_code[256 + ((dist - 1) >> 7)];
+}
+
+/*
+ * Write the n low bits of value, the output is full once it
+ * reaches the room for the trailer
+ */
+static void put_bits(bit_writer *bw, unsigned int value, int n)
+{
+	bw->bits |= (unsigned long long)value << bw->n;
+	bw->n += n;
+	while (bw->n >= 8)
+	{
+		if (bw->p == bw->end)
+		{
+			bw->full = 1;
+			bw->n = 0;
+			bw->bits = 0;
+			return;
+		}
+		*bw->p++ = bw->bits;
+		bw->bits >>= 8;
+		bw->n -= 8;
+	}
+	return;
+}
+
+/*
+ * Write a literal byte
+ */
+static void put_byte(bit_writer *bw, int c)
+{
+	put_bits(bw, lit_code[c], lit_bits[c]);
+	return;
+}
+
+/*
+ * Write a match of len bytes dist bytes back
+ */
+static void put_match(bit_writer *bw, unsigned int len, unsigned int dist)
+{
+	int code = len_code[len], dcode = dist_sym(dist);
+
+	put_bits(bw, lit_code[257 + code], lit_bits[257 + code]);
+	put_bits(bw, len - len_base[code], len_extra[code]);
+	put_bits(bw, reverse(dcode, 5), 5);
+	put_bits(bw, dist - dist_base[dcode], dist_extra[dcode]);
+	return;
+}
+
+/*
+ * Read bytes until n bits are there, return 0 if the input ends
+ * first. The bits after the end read as zeros.
+ */
+static int need_bits(bit_reader *br, int n)
+{
+	while (br->n < n && br->p < br->end)
+	{
+		br->bits |= (unsigned long long)*br->p++ << br->n;
+		br->n += 8;
+	}
+	return br->n >= n;
+}
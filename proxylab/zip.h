@@ -0,0 +1,19 @@
+/*
+ * zip.h -- Declaration of the gzip compression of cached bodies
+ *			for 15-213 proxy lab
+ *
+ * Team Member1: Cheng Zhang, Andrew ID: chengzh1
+ * Team Member2: Zhe Qian, Andrew ID: zheq
+ *
+ */
+
+#ifndef ZIP_H
+#define ZIP_H
+
+#include <stddef.h>
+
+/* Declaration of some method that is used in cache.c */
+size_t zip_deflate(const char *src, size_t len, char *dst, size_t size);
+long zip_inflate(const char *src, size_t len, char *dst, size_t size);
+
+#endif